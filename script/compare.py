@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+"""Diff two zns_bench --output=json result files.
+
+Every metric of every phase present in both files is compared. A change is
+flagged as a regression when it is worse than --threshold and statistically
+significant at --alpha:
+
+  - throughput: Welch's t-test over the interval samples of both runs
+    (run with --report_interval), threshold only without samples
+  - average latency: Welch's t-test from the histogram mean, stddev and count
+  - latency percentiles: Mann-Whitney U test over the histogram buckets
+
+Exits with 1 if any regression is found, so it can gate upgrades.
+"""
+
+import argparse
+import json
+import math
+import sys
+
+PERCENTILES = ["p50", "p99", "p999"]
+
+
+def betacf(a, b, x):
+    # Continued fraction of the incomplete beta function (Numerical Recipes)
+    tiny = 1e-300
+    c, d = 1.0, 1.0 - (a + b) * x / (a + 1.0)
+    d = 1.0 / (d if abs(d) > tiny else tiny)
+    h = d
+    for m in range(1, 300):
+        m2 = 2 * m
+        for num in (m * (b - m) * x / ((a + m2 - 1.0) * (a + m2)),
+                    -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1.0))):
+            d = 1.0 + num * d
+            d = 1.0 / (d if abs(d) > tiny else tiny)
+            c = 1.0 + num / c
+            c = c if abs(c) > tiny else tiny
+            h *= d * c
+        if abs(d * c - 1.0) < 1e-12:
+            break
+    return h
+
+
+def betai(a, b, x):
+    if x <= 0.0:
+        return 0.0
+    if x >= 1.0:
+        return 1.0
+    front = math.exp(math.lgamma(a + b) - math.lgamma(a) - math.lgamma(b) +
+                     a * math.log(x) + b * math.log(1.0 - x))
+    if x < (a + 1.0) / (a + b + 2.0):
+        return front * betacf(a, b, x) / a
+    return 1.0 - front * betacf(b, a, 1.0 - x) / b
+
+
+def welch(mean1, var1, n1, mean2, var2, n2):
+    """Two-sided p-value of Welch's t-test."""
+    if n1 < 2 or n2 < 2:
+        return None
+    se1, se2 = var1 / n1, var2 / n2
+    if se1 + se2 == 0:
+        return 0.0 if mean1 != mean2 else 1.0
+    t = (mean1 - mean2) / math.sqrt(se1 + se2)
+    df = (se1 + se2) ** 2 / (se1 ** 2 / (n1 - 1) + se2 ** 2 / (n2 - 1))
+    return betai(df / 2.0, 0.5, df / (df + t * t))
+
+
+def mann_whitney(buckets1, buckets2):
+    """Two-sided p-value of the Mann-Whitney U test over two histograms with
+    the same bucket bounds, using the normal approximation with ties."""
+    counts = {}
+    for low, high, count in buckets1:
+        counts.setdefault((low, high), [0, 0])[0] += count
+    for low, high, count in buckets2:
+        counts.setdefault((low, high), [0, 0])[1] += count
+    n1 = sum(c[0] for c in counts.values())
+    n2 = sum(c[1] for c in counts.values())
+    if n1 == 0 or n2 == 0:
+        return None
+    n = n1 + n2
+    rank, r1, ties = 0, 0.0, 0.0
+    for key in sorted(counts):
+        c1, c2 = counts[key]
+        t = c1 + c2
+        # Every sample of a bucket shares the average rank of the bucket
+        r1 += c1 * (rank + (t + 1) / 2.0)
+        rank += t
+        ties += t ** 3 - t
+    u = r1 - n1 * (n1 + 1) / 2.0
+    var = n1 * n2 / 12.0 * ((n + 1) - ties / (n * (n - 1)))
+    if var <= 0:
+        return 1.0
+    z = (u - n1 * n2 / 2.0) / math.sqrt(var)
+    return math.erfc(abs(z) / math.sqrt(2))
+
+
+def mean_var(values):
+    n = len(values)
+    if n == 0:
+        return 0.0, 0.0, 0
+    mean = sum(values) / n
+    var = sum((v - mean) ** 2 for v in values) / (n - 1) if n > 1 else 0.0
+    return mean, var, n
+
+
+def interval_key(metric):
+    return {"read": "read_mibs", "write": "write_mibs"}.get(metric)
+
+
+def compare_phase(name, old, new, rows):
+    old_metrics = old["stats"]["metrics"]
+    new_metrics = new["stats"]["metrics"]
+    for metric in sorted(set(old_metrics) & set(new_metrics)):
+        o, n = old_metrics[metric], new_metrics[metric]
+
+        # Throughput, higher is better
+        key = interval_key(metric)
+        p = None
+        if key:
+            s1 = [i[key] for i in old["stats"]["intervals"]]
+            s2 = [i[key] for i in new["stats"]["intervals"]]
+            p = welch(*mean_var(s1), *mean_var(s2))
+        rows.append((name, metric, "throughput_mibs", o["throughput_mibs"],
+                     n["throughput_mibs"], p, False))
+
+        # Latency, lower is better
+        lo, ln = o["latency_us"], n["latency_us"]
+        p = welch(lo["average"], lo["stddev"] ** 2, lo["count"],
+                  ln["average"], ln["stddev"] ** 2, ln["count"])
+        rows.append((name, metric, "latency_avg_us", lo["average"],
+                     ln["average"], p, True))
+        p = mann_whitney(lo["buckets"], ln["buckets"])
+        for pct in PERCENTILES:
+            rows.append((name, metric, "latency_%s_us" % pct, lo[pct],
+                         ln[pct], p, True))
+
+
+def verdict(old, new, p, lower_is_better, args):
+    if old in (None, 0) or new is None:
+        return 0.0, "n/a"
+    change = (new - old) / old
+    worse = change > args.threshold if lower_is_better \
+        else change < -args.threshold
+    better = change < -args.threshold if lower_is_better \
+        else change > args.threshold
+    significant = p is None or p < args.alpha
+    if worse and significant:
+        return change, "REGRESSION"
+    if better and significant:
+        return change, "improved"
+    return change, "ok"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("old", help="baseline result file")
+    parser.add_argument("new", help="result file to check")
+    parser.add_argument("--threshold", type=float, default=0.05,
+                        help="relative change below which nothing is flagged")
+    parser.add_argument("--alpha", type=float, default=0.01,
+                        help="significance level of the tests")
+    args = parser.parse_args()
+
+    with open(args.old) as f:
+        old = json.load(f)
+    with open(args.new) as f:
+        new = json.load(f)
+
+    for key in ("kernel", "command_line"):
+        if old["metadata"].get(key) != new["metadata"].get(key):
+            print("%s: %s -> %s" % (key, old["metadata"].get(key),
+                                    new["metadata"].get(key)))
+    old_fw = [d.get("firmware") for d in old["metadata"]["devices"]]
+    new_fw = [d.get("firmware") for d in new["metadata"]["devices"]]
+    if old_fw != new_fw:
+        print("firmware: %s -> %s" % (old_fw, new_fw))
+
+    rows = []
+    new_phases = {p["name"]: p for p in new["phases"]}
+    for phase in old["phases"]:
+        if phase["name"] not in new_phases:
+            print("phase %s missing from %s" % (phase["name"], args.new))
+            continue
+        compare_phase(phase["name"], phase, new_phases[phase["name"]],
+                      rows)
+
+    regressions = 0
+    print("%-12s %-10s %-18s %12s %12s %9s %9s  %s" %
+          ("phase", "metric", "value", "old", "new", "change", "p", ""))
+    for name, metric, value, o, n, p, lower_is_better in rows:
+        change, result = verdict(o, n, p, lower_is_better, args)
+        regressions += result == "REGRESSION"
+        print("%-12s %-10s %-18s %12.2f %12.2f %8.1f%% %9s  %s" %
+              (name, metric, value, o, n, change * 100,
+               "-" if p is None else "%.3g" % p, result))
+
+    print("%d regression(s)" % regressions)
+    return 1 if regressions else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
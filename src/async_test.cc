@@ -8,7 +8,7 @@
 #include <unistd.h>
 #include <cstdio>
 
-int RunAsync(ZonedBlockDevice *zbd, int id);
+int RunAsync(ZonedBlockDevice *zbd, int id, uint32_t depth);
 int RunSync(ZonedBlockDevice *zbd, int id);
 
 void PrepareWrite(ZonedBlockDevice *zbd, int id);
@@ -27,7 +27,9 @@ int main(int argc, char *argv[]) {
   PrepareWrite(zbd, 0);
 
   if (std::strcmp(argv[1], "async") == 0) {
-    RunAsync(zbd, 0);
+    // Number of reads kept in flight, two gives the classic double buffer
+    uint32_t depth = argc > 2 ? std::atoi(argv[2]) : 2;
+    RunAsync(zbd, 0, depth);
   } else {
     RunSync(zbd, 0);
   }
@@ -36,7 +38,7 @@ int main(int argc, char *argv[]) {
 }
 
 void PrepareWrite(ZonedBlockDevice *zbd, int id) {
-  auto zone = zbd->io_zones_[id];
+  auto zone = zbd->GetIOZone(id);
   auto sz = 512 * 1024ULL * 1024ULL;
   char* buf;
   posix_memalign((void**)&buf, sysconf(_SC_PAGE_SIZE), sz);
@@ -60,7 +62,7 @@ int SyncRead(int fd, size_t sz, size_t off, char *buf) {
   return 0;
 }
 
-auto do_check = [](char *buf, size_t sz) -> bool {
+auto do_check = [](const char *buf, size_t sz) -> bool {
   auto start = std::chrono::steady_clock::now();
   for (uint64_t i = 0; i < sz; ++i) {
     if (buf[i] != '1')
@@ -72,54 +74,30 @@ auto do_check = [](char *buf, size_t sz) -> bool {
   return true;
 };
 
-int RunAsync(ZonedBlockDevice *zbd, int id) {
+int RunAsync(ZonedBlockDevice *zbd, int id, uint32_t depth) {
   auto start = std::chrono::steady_clock::now();
-  auto limit = 512 * 1024ULL * 1024ULL;
-
-  auto zone = zbd->io_zones_[id];
-  auto buf_sz = kBufferSize;
-  // Needs two buffers
-  char *buf[2];
-  posix_memalign((void**)(&buf[0]), sysconf(_SC_PAGE_SIZE), buf_sz);
-  posix_memalign((void**)(&buf[1]), sysconf(_SC_PAGE_SIZE), buf_sz);
-  int curr_buf_id = 0;
-
-  auto curr_off = zone->start_;
-  auto done_sz = 0;
-
 
-  AsyncIORequest async;
-  while (done_sz < limit) {
-    // Init
-    if (done_sz == 0) {
-      SyncRead(zbd->GetReadDirectFD(), buf_sz, curr_off, buf[curr_buf_id]);
-    } else {
-      while (!async.CheckFinish())
-        ;
-    }
+  auto zone = zbd->GetIOZone(id);
+  // Keep `depth` reads in flight while checking the chunk that has arrived
+  ZoneStreamReader reader(zbd, {zone}, kBufferSize, depth);
+  if (!reader.Init()) {
+    abort();
+  }
 
-    // Submit the async command before processing the data
-    auto s = async.Init();
-    assert(s);
-    async.PrepareRead(zbd->GetReadDirectFD(), buf_sz, curr_off + buf_sz,
-                      buf[(curr_buf_id + 1) % 2]);
-    s = async.Submit();
-    assert(s);
-    if (!do_check(buf[curr_buf_id], buf_sz)) {
+  auto s = reader.ForEach([](const ZoneStreamReader::Chunk &chunk) {
+    if (!do_check(chunk.data, chunk.size)) {
       abort();
     }
-    curr_buf_id = (curr_buf_id + 1) % 2;
-    curr_off += buf_sz;
-    done_sz += buf_sz;
-  }
-
-  free(buf[0]);
-  free(buf[1]);
+    return true;
+  });
+  assert(s);
 
   auto end = std::chrono::steady_clock::now();
   auto dura =
       std::chrono::duration_cast<std::chrono::microseconds>(end - start);
-  std::cout << "[Async Pass Time]: " << dura.count() << std::endl;
+  std::cout << "[Async Pass Time]: " << dura.count()
+            << " [Depth]: " << depth
+            << " [Bytes]: " << reader.BytesRead() << std::endl;
 
   return 0;
 }
@@ -128,7 +106,7 @@ int RunSync(ZonedBlockDevice *zbd, int id) {
   auto start = std::chrono::steady_clock::now();
   auto limit = 512 * 1024ULL * 1024ULL;
 
-  auto zone = zbd->io_zones_[id];
+  auto zone = zbd->GetIOZone(id);
   auto buf_sz = kBufferSize;
   // Needs two buffers
   char *buf[1];
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#include "histogram.h"
+
+// Cheap timestamps for the per-op path. With an invariant TSC, which ticks
+// at a constant rate through frequency changes and idle states, rdtsc is read
+// directly and converted with a rate calibrated once against steady_clock.
+// Other CPUs, or SetUseTsc(false), fall back to steady_clock in nanoseconds
+class FastClock {
+public:
+  static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (Get().use_tsc_) {
+      return __rdtsc();
+    }
+#endif
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static uint64_t ToMicros(uint64_t ticks) {
+    return static_cast<uint64_t>(ticks / Get().ticks_per_us_);
+  }
+
+  static bool UsesTsc() { return Get().use_tsc_; }
+
+  // Only takes effect if the CPU has an invariant TSC. Call it before any
+  // thread takes timestamps
+  static void SetUseTsc(bool on) { Get().Select(on); }
+
+private:
+  FastClock() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    // CPUID.80000007H:EDX[8] is the invariant TSC bit
+    has_tsc_ = __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) &&
+               (edx & (1U << 8));
+    if (has_tsc_) {
+      auto start = std::chrono::steady_clock::now();
+      uint64_t tsc_start = __rdtsc();
+      auto end = start + std::chrono::milliseconds(10);
+      auto now = start;
+      while ((now = std::chrono::steady_clock::now()) < end)
+        ;
+      uint64_t ticks = __rdtsc() - tsc_start;
+      auto us = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    now - start)
+                    .count() /
+                1000.0;
+      tsc_per_us_ = ticks / us;
+    }
+#endif
+    Select(true);
+  }
+
+  void Select(bool tsc) {
+    use_tsc_ = tsc && has_tsc_;
+    ticks_per_us_ = use_tsc_ ? tsc_per_us_ : 1000.0;
+  }
+
+  static FastClock &Get() {
+    static FastClock clock;
+    return clock;
+  }
+
+  bool has_tsc_ = false;
+  bool use_tsc_ = false;
+  double tsc_per_us_ = 0;
+  double ticks_per_us_ = 1000.0;
+};
+
+// End of a benchmark loop, checked once per loop iteration. The loop ends
+// after `seconds`, or once Done() has charged `max_ops` completed I/Os or
+// `max_bytes` bytes, whichever comes first; 0 turns a limit off. Iterations
+// that complete no I/O, e.g. a zone switch or a retry, charge nothing.
+// The clock is not read on every call: the iterations until the next check
+// are sized from the time per iteration seen so far to land about
+// kCheckMicros apart, and capped at kMaxCheckStride. If iterations slow down
+// after a check, the run can overshoot by up to kMaxCheckStride of the
+// slower ones. Runs bounded by I/Os or bytes alone never read it
+struct Duration {
+  using TimePoint = decltype(std::chrono::steady_clock::now());
+  static constexpr uint64_t kCheckMicros = 1000;
+  static constexpr uint64_t kMaxCheckStride = 1024;
+
+  uint64_t start;
+  uint64_t limit;
+  uint64_t max_ops;
+  uint64_t max_bytes;
+  uint64_t iterations = 0;
+  uint64_t ops = 0;
+  uint64_t bytes = 0;
+  uint64_t next_check = 1;
+  bool ended = false;
+
+  Duration(const uint64_t seconds, const uint64_t _max_ops = 0,
+           const uint64_t _max_bytes = 0)
+      : start(FastClock::Now()), limit(seconds), max_ops(_max_ops),
+        max_bytes(_max_bytes) {}
+
+  // Charge `_ops` completed I/Os moving `_bytes` in total
+  void Done(uint64_t _bytes, uint64_t _ops = 1) {
+    ops += _ops;
+    bytes += _bytes;
+  }
+
+  bool Ending() {
+    ++iterations;
+    if (ended || (max_ops && ops >= max_ops) ||
+        (max_bytes && bytes >= max_bytes)) {
+      return true;
+    }
+    if (limit == 0 || iterations < next_check) {
+      return false;
+    }
+
+    auto elapsed = FastClock::ToMicros(FastClock::Now() - start);
+    if (elapsed >= limit * 1000000) {
+      ended = true;
+      return true;
+    }
+    double per_iter = std::max<double>((double)elapsed / iterations, 1e-3);
+    double stride = std::min<double>(kCheckMicros,
+                                     limit * 1000000 - elapsed) / per_iter;
+    next_check = iterations + std::min<uint64_t>(
+                                  std::max<uint64_t>(stride, 1),
+                                  kMaxCheckStride);
+    return false;
+  }
+
+  static TimePoint NowTime() { return std::chrono::steady_clock::now(); }
+
+  static uint64_t ElapseTimeMicro(TimePoint _start) {
+    auto dura = std::chrono::duration_cast<std::chrono::microseconds>(
+        NowTime() - _start);
+    return dura.count();
+  }
+};
+
+// Record the latency, throughput and bytes of the operation issued in the
+// scope of the guard
+struct MetricsGuard {
+  uint64_t start;
+  uint64_t sz;
+  Statistics *statistic;
+  MetricsType type;
+
+  MetricsGuard(uint64_t _sz, Statistics *_statistic, MetricsType _type)
+      : start(FastClock::Now()), sz(_sz), statistic(_statistic),
+        type(_type) {}
+
+  ~MetricsGuard() {
+    auto dura = FastClock::ToMicros(FastClock::Now() - start);
+    auto thpt = (double)sz * 1e6 / std::max<uint64_t>(dura, 1);
+    statistic->AddThroughput(type, thpt);
+    statistic->AddLatency(type, dura);
+    statistic->AddBytes(type, sz);
+  }
+};
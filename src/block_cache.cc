@@ -0,0 +1,198 @@
+#include "block_cache.h"
+
+#include <unistd.h>
+
+#include <cassert>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+
+bool BlockCache::ParsePolicy(const std::string &name, Policy *policy) {
+  if (name == "lru") {
+    *policy = kLRU;
+  } else if (name == "clock") {
+    *policy = kClock;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+BlockCache::BlockCache(const Options &options)
+    : options_(options), shards_(std::max<uint32_t>(options.shards, 1)),
+      zone_gen_(new std::atomic<uint32_t>[options.nr_zones]) {
+  assert(options_.block_size > 0 && options_.zone_size > 0);
+  for (uint32_t i = 0; i < options_.nr_zones; ++i) {
+    zone_gen_[i] = 0;
+  }
+
+  uint64_t total_slots = options_.capacity / options_.block_size;
+  uint32_t per_shard =
+      std::max<uint64_t>(total_slots / shards_.size(), 1);
+  for (auto &shard : shards_) {
+    shard.nr_slots = per_shard;
+    shard.slots.reset(new Slot[per_shard]);
+    if (posix_memalign((void **)&shard.data, sysconf(_SC_PAGESIZE),
+                       per_shard * options_.block_size)) {
+      abort();
+    }
+    shard.map.reserve(per_shard);
+  }
+}
+
+BlockCache::~BlockCache() {
+  for (auto &shard : shards_) {
+    free(shard.data);
+  }
+}
+
+BlockCache::Shard &BlockCache::ShardOf(uint64_t offset) {
+  uint64_t block = offset / options_.block_size;
+  return shards_[(block * 0x9e3779b97f4a7c15ULL >> 32) % shards_.size()];
+}
+
+uint32_t BlockCache::Generation(uint64_t offset) const {
+  uint64_t zone_nr = offset / options_.zone_size;
+  assert(zone_nr < options_.nr_zones);
+  return zone_gen_[zone_nr].load(std::memory_order_acquire);
+}
+
+void BlockCache::InvalidateZone(uint64_t zone_nr) {
+  assert(zone_nr < options_.nr_zones);
+  zone_gen_[zone_nr].fetch_add(1, std::memory_order_acq_rel);
+}
+
+bool BlockCache::Lookup(uint64_t offset, char *buf, uint32_t *gen) {
+  *gen = Generation(offset);
+  auto &shard = ShardOf(offset);
+
+  if (options_.policy == kClock) {
+    std::shared_lock<std::shared_mutex> lck(shard.mtx);
+    auto it = shard.map.find(offset);
+    if (it != shard.map.end() && shard.slots[it->second].gen == *gen) {
+      shard.slots[it->second].referenced.store(true,
+                                               std::memory_order_relaxed);
+      memcpy(buf, SlotData(shard, it->second), options_.block_size);
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  } else {
+    std::unique_lock<std::shared_mutex> lck(shard.mtx);
+    auto it = shard.map.find(offset);
+    if (it != shard.map.end() && shard.slots[it->second].gen == *gen) {
+      LruUnlink(shard, it->second);
+      LruPushFront(shard, it->second);
+      memcpy(buf, SlotData(shard, it->second), options_.block_size);
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+void BlockCache::Insert(uint64_t offset, const char *buf, uint32_t gen) {
+  auto &shard = ShardOf(offset);
+  std::unique_lock<std::shared_mutex> lck(shard.mtx);
+  // The zone was reset while the block was being read
+  if (gen != Generation(offset)) {
+    return;
+  }
+
+  uint32_t idx;
+  auto it = shard.map.find(offset);
+  if (it != shard.map.end()) {
+    // Another reader inserted it first, or a stale generation is replaced
+    idx = it->second;
+    if (options_.policy == kLRU) {
+      LruUnlink(shard, idx);
+    }
+  } else {
+    idx = Evict(shard);
+    shard.map[offset] = idx;
+  }
+
+  auto &slot = shard.slots[idx];
+  slot.offset = offset;
+  slot.gen = gen;
+  slot.used = true;
+  slot.referenced.store(false, std::memory_order_relaxed);
+  memcpy(SlotData(shard, idx), buf, options_.block_size);
+  if (options_.policy == kLRU) {
+    LruPushFront(shard, idx);
+  }
+}
+
+uint32_t BlockCache::Evict(Shard &shard) {
+  if (shard.nr_used < shard.nr_slots) {
+    return shard.nr_used++;
+  }
+
+  uint32_t victim;
+  if (options_.policy == kClock) {
+    // Give referenced blocks a second chance
+    while (true) {
+      auto &slot = shard.slots[shard.hand];
+      if (!slot.referenced.exchange(false, std::memory_order_relaxed)) {
+        victim = shard.hand;
+        shard.hand = (shard.hand + 1) % shard.nr_slots;
+        break;
+      }
+      shard.hand = (shard.hand + 1) % shard.nr_slots;
+    }
+  } else {
+    victim = shard.tail;
+    LruUnlink(shard, victim);
+  }
+
+  shard.map.erase(shard.slots[victim].offset);
+  shard.slots[victim].used = false;
+  return victim;
+}
+
+void BlockCache::LruUnlink(Shard &shard, uint32_t idx) {
+  auto &slot = shard.slots[idx];
+  if (slot.prev != kNil) {
+    shard.slots[slot.prev].next = slot.next;
+  } else if (shard.head == idx) {
+    shard.head = slot.next;
+  }
+  if (slot.next != kNil) {
+    shard.slots[slot.next].prev = slot.prev;
+  } else if (shard.tail == idx) {
+    shard.tail = slot.prev;
+  }
+  slot.prev = slot.next = kNil;
+}
+
+void BlockCache::LruPushFront(Shard &shard, uint32_t idx) {
+  auto &slot = shard.slots[idx];
+  slot.prev = kNil;
+  slot.next = shard.head;
+  if (shard.head != kNil) {
+    shard.slots[shard.head].prev = idx;
+  }
+  shard.head = idx;
+  if (shard.tail == kNil) {
+    shard.tail = idx;
+  }
+}
+
+double BlockCache::HitRatio() const {
+  uint64_t total = Hits() + Misses();
+  return total ? (double)Hits() / total : 0;
+}
+
+std::string BlockCache::ToString() const {
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "[Policy: %s][Capacity: %.1fMiB][Hits: %" PRIu64
+           "][Misses: %" PRIu64 "][Hit ratio: %.2f%%]",
+           options_.policy == kLRU ? "lru" : "clock",
+           options_.capacity / (1024.0 * 1024.0), Hits(), Misses(),
+           100 * HitRatio());
+  return buf;
+}
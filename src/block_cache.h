@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A DRAM cache of fixed-size device blocks in front of zone reads, split
+// into shards by block address. LRU shards take an exclusive lock on every
+// lookup to reorder their list; CLOCK shards only set a reference bit on a
+// hit, so lookups share the shard lock.
+//
+// Resetting a zone bumps the generation of the zone instead of walking its
+// blocks: entries of an older generation are treated as misses and get
+// evicted over time.
+class BlockCache {
+public:
+  enum Policy { kLRU, kClock };
+
+  struct Options {
+    uint64_t capacity = 0;  // bytes of cached data
+    uint64_t block_size = 4096;
+    uint64_t zone_size = 0;
+    uint32_t nr_zones = 0;  // zones of the device, incl. non-I/O ones
+    uint32_t shards = 16;
+    Policy policy = kLRU;
+  };
+
+  // "lru" or "clock". Return false for unknown names
+  static bool ParsePolicy(const std::string &name, Policy *policy);
+
+  explicit BlockCache(const Options &options);
+  ~BlockCache();
+
+  BlockCache(const BlockCache &) = delete;
+  BlockCache &operator=(const BlockCache &) = delete;
+
+  // Copy the block at device offset `offset` into `buf` and return true on
+  // a hit. `gen` receives the zone generation to pass to Insert() after a
+  // miss
+  bool Lookup(uint64_t offset, char *buf, uint32_t *gen);
+
+  // Cache the block read at `offset`, unless the zone was reset since the
+  // Lookup() that returned `gen`
+  void Insert(uint64_t offset, const char *buf, uint32_t gen);
+
+  // Drop every block of a zone, called when the zone is reset
+  void InvalidateZone(uint64_t zone_nr);
+
+  uint64_t BlockSize() const { return options_.block_size; }
+  uint64_t Hits() const { return hits_.load(std::memory_order_relaxed); }
+  uint64_t Misses() const { return misses_.load(std::memory_order_relaxed); }
+  double HitRatio() const;
+  std::string ToString() const;
+
+private:
+  static constexpr uint32_t kNil = UINT32_MAX;
+
+  struct Slot {
+    uint64_t offset = 0;
+    uint32_t gen = 0;
+    bool used = false;
+    std::atomic_bool referenced{false};  // CLOCK
+    uint32_t prev = kNil, next = kNil;    // LRU list, head is most recent
+  };
+
+  struct Shard {
+    std::shared_mutex mtx;
+    std::unordered_map<uint64_t, uint32_t> map;
+    std::unique_ptr<Slot[]> slots;
+    char *data = nullptr;
+    uint32_t nr_slots = 0;
+    uint32_t nr_used = 0;
+    uint32_t hand = 0;  // CLOCK
+    uint32_t head = kNil, tail = kNil;
+  };
+
+  Shard &ShardOf(uint64_t offset);
+  uint32_t Generation(uint64_t offset) const;
+  char *SlotData(Shard &shard, uint32_t idx) {
+    return shard.data + idx * options_.block_size;
+  }
+
+  // Pick a slot to hold a new block, evicting one if the shard is full.
+  // Called with the shard lock held exclusively
+  uint32_t Evict(Shard &shard);
+  void LruUnlink(Shard &shard, uint32_t idx);
+  void LruPushFront(Shard &shard, uint32_t idx);
+
+  Options options_;
+  std::vector<Shard> shards_;
+  std::unique_ptr<std::atomic<uint32_t>[]> zone_gen_;
+
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+};
@@ -0,0 +1,133 @@
+#include "cpu_stats.h"
+
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+int PerfEventOpen(uint32_t type, uint64_t config) {
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.exclude_hv = 1;
+  // Count the calling thread on any cpu
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+uint64_t ReadPerfFd(int fd) {
+  uint64_t value = 0;
+  if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+    return 0;
+  }
+  return value;
+}
+
+uint64_t TimevalMicro(const timeval &tv) {
+  return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+CpuUsage FromRusage(const rusage &usage) {
+  CpuUsage u;
+  u.user_us = TimevalMicro(usage.ru_utime);
+  u.sys_us = TimevalMicro(usage.ru_stime);
+  u.context_switches = usage.ru_nvcsw + usage.ru_nivcsw;
+  return u;
+}
+} // namespace
+
+void CpuUsage::Merge(const CpuUsage &other) {
+  cycles += other.cycles;
+  instructions += other.instructions;
+  context_switches += other.context_switches;
+  user_us += other.user_us;
+  sys_us += other.sys_us;
+}
+
+CpuUsage CpuUsage::Since(const CpuUsage &prev) const {
+  CpuUsage u;
+  u.cycles = cycles - prev.cycles;
+  u.instructions = instructions - prev.instructions;
+  u.context_switches = context_switches - prev.context_switches;
+  u.user_us = user_us - prev.user_us;
+  u.sys_us = sys_us - prev.sys_us;
+  return u;
+}
+
+std::string CpuUsage::ToString(uint64_t ops) const {
+  char buf[512];
+  double per_op = ops ? 1.0 / ops : 0;
+  double cpu_sec = CpuMicros() / 1e6;
+  snprintf(buf, sizeof(buf),
+           "[User: %" PRIu64 "us][Sys: %" PRIu64 "us]"
+           "[CPU/op: %.3fus][Ops/core: %.0f/s]"
+           "[Cycles/op: %.0f][Instructions/op: %.0f][IPC: %.2f]"
+           "[CtxSwitch/op: %.3f]",
+           user_us, sys_us, CpuMicros() * per_op,
+           cpu_sec > 0 ? ops / cpu_sec : 0, cycles * per_op,
+           instructions * per_op,
+           cycles ? (double)instructions / cycles : 0,
+           context_switches * per_op);
+  return buf;
+}
+
+bool ThreadCpuCounter::Open() {
+  Close();
+  fds_[kCycles] = PerfEventOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+  fds_[kInstructions] =
+      PerfEventOpen(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+  fds_[kContextSwitches] =
+      PerfEventOpen(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES);
+
+  base_ = CpuUsage();
+  base_ = ReadSelf();
+  opened_.store(true, std::memory_order_release);
+  return fds_[kCycles] >= 0 && fds_[kInstructions] >= 0;
+}
+
+void ThreadCpuCounter::Close() {
+  opened_.store(false, std::memory_order_release);
+  for (auto &fd : fds_) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    fd = -1;
+  }
+}
+
+CpuUsage ThreadCpuCounter::ReadCounters() const {
+  CpuUsage u;
+  u.cycles = ReadPerfFd(fds_[kCycles]) - base_.cycles;
+  u.instructions = ReadPerfFd(fds_[kInstructions]) - base_.instructions;
+  if (fds_[kContextSwitches] >= 0) {
+    u.context_switches =
+        ReadPerfFd(fds_[kContextSwitches]) - base_.context_switches;
+  }
+  return u;
+}
+
+CpuUsage ThreadCpuCounter::ReadSelf() const {
+  rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  auto u = FromRusage(usage).Since(base_);
+  auto counters = ReadCounters();
+  u.cycles = counters.cycles;
+  u.instructions = counters.instructions;
+  // Prefer the perf count when it is available
+  if (fds_[kContextSwitches] >= 0) {
+    u.context_switches = counters.context_switches;
+  }
+  return u;
+}
+
+CpuUsage ThreadCpuCounter::ReadProcess() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return FromRusage(usage);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Host CPU consumed by a thread (or a set of threads) over some period.
+// Hardware counters are zero when perf_event is not available.
+struct CpuUsage {
+  uint64_t cycles = 0;
+  uint64_t instructions = 0;
+  uint64_t context_switches = 0;
+  uint64_t user_us = 0;
+  uint64_t sys_us = 0;
+
+  uint64_t CpuMicros() const { return user_us + sys_us; }
+
+  void Merge(const CpuUsage &other);
+  // Usage accumulated between `prev` and this sample
+  CpuUsage Since(const CpuUsage &prev) const;
+
+  // One line summary, normalized by the number of operations done in the
+  // same period
+  std::string ToString(uint64_t ops) const;
+};
+
+// Per-thread counters of cycles, instructions and context switches based on
+// perf_event_open, plus user/sys time from getrusage(RUSAGE_THREAD). Open()
+// and ReadSelf() must be called by the measured thread; ReadCounters() only
+// touches the perf fds and may be called from any thread.
+class ThreadCpuCounter {
+public:
+  ThreadCpuCounter() = default;
+  ~ThreadCpuCounter() { Close(); }
+
+  ThreadCpuCounter(const ThreadCpuCounter &) = delete;
+  ThreadCpuCounter &operator=(const ThreadCpuCounter &) = delete;
+
+  // Start counting for the calling thread. Return false if no hardware
+  // counter could be opened, the rusage based fields still work
+  bool Open();
+  void Close();
+
+  bool IsOpen() const { return opened_.load(std::memory_order_acquire); }
+
+  // Counters and rusage since Open(), for the calling thread
+  CpuUsage ReadSelf() const;
+  // Only the perf counters since Open()
+  CpuUsage ReadCounters() const;
+
+  // Process wide user/sys time and context switches
+  static CpuUsage ReadProcess();
+
+private:
+  enum { kCycles, kInstructions, kContextSwitches, kNumCounters };
+
+  int fds_[kNumCounters] = {-1, -1, -1};
+  CpuUsage base_;
+  std::atomic_bool opened_{false};
+};
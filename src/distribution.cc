@@ -0,0 +1,72 @@
+#include "distribution.h"
+
+#include <cassert>
+#include <cmath>
+
+KeyGenerator::KeyGenerator(Kind kind, uint64_t n, double theta, uint64_t seed)
+    : kind_(kind), n_(n), theta_(theta), rng_(seed), real_(0, 1) {
+  if (kind_ == kZipf) {
+    // Gray et al., "Quickly generating billion-record synthetic databases",
+    // which only holds for 0 < theta < 1
+    assert(theta_ > 0 && theta_ < 1);
+    double zeta2 = Zeta(2, theta_);
+    zetan_ = Zeta(n_, theta_);
+    alpha_ = 1.0 / (1.0 - theta_);
+    eta_ = (1 - std::pow(2.0 / n_, 1 - theta_)) / (1 - zeta2 / zetan_);
+  }
+}
+
+bool KeyGenerator::ParseKind(const std::string &name, Kind *kind) {
+  if (name == "uniform") {
+    *kind = kUniform;
+  } else if (name == "zipf") {
+    *kind = kZipf;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+double KeyGenerator::Zeta(uint64_t n, double theta) {
+  // Exact for the head of the sum; the tail of a device sized key space is
+  // approximated by its integral (Euler-Maclaurin)
+  const uint64_t kExact = 1000000;
+  double sum = 0;
+  uint64_t i = 1;
+  for (; i <= n && i <= kExact; ++i) {
+    sum += 1.0 / std::pow((double)i, theta);
+  }
+  if (i <= n) {
+    double a = i, b = n;
+    sum += (std::pow(b, 1 - theta) - std::pow(a, 1 - theta)) / (1 - theta) +
+           (std::pow(a, -theta) + std::pow(b, -theta)) / 2;
+  }
+  return sum;
+}
+
+uint64_t KeyGenerator::Next() {
+  if (kind_ == kUniform) {
+    return rng_() % n_;
+  }
+
+  double u = real_(rng_);
+  double uz = u * zetan_;
+  uint64_t rank;
+  if (uz < 1.0) {
+    rank = 0;
+  } else if (uz < 1.0 + std::pow(0.5, theta_)) {
+    rank = 1;
+  } else {
+    rank = n_ * std::pow(eta_ * u - eta_ + 1, alpha_);
+  }
+  if (rank >= n_) {
+    rank = n_ - 1;
+  }
+  // FNV-1a of the rank
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < 8; ++i) {
+    h ^= (rank >> (i * 8)) & 0xff;
+    h *= 0x100000001b3ULL;
+  }
+  return h % n_;
+}
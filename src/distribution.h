@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+#include <random>
+#include <string>
+
+// Pick keys (e.g. block numbers) in [0, n), either uniformly or following a
+// Zipfian distribution with skew `theta` in (0, 1). Zipfian ranks are
+// scattered over the key space by a hash, so hot keys are not adjacent.
+class KeyGenerator {
+public:
+  enum Kind { kUniform, kZipf };
+
+  KeyGenerator(Kind kind, uint64_t n, double theta, uint64_t seed);
+
+  // "uniform" or "zipf". Return false for unknown names
+  static bool ParseKind(const std::string &name, Kind *kind);
+
+  uint64_t Next();
+
+private:
+  // Sum of 1/i^theta for i in [1, n]
+  static double Zeta(uint64_t n, double theta);
+
+  Kind kind_;
+  uint64_t n_;
+  double theta_;
+  double alpha_, zetan_, eta_;
+  std::mt19937_64 rng_;
+  std::uniform_real_distribution<double> real_;
+};
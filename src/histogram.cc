@@ -12,6 +12,7 @@
 #endif
 
 #include "histogram.h"
+#include "json_writer.h"
 
 #include <inttypes.h>
 #include <math.h>
@@ -236,3 +237,107 @@ void HistogramStat::Data(HistogramData* const data) const {
   data->sum = sum();
 }
 
+
+void HistogramStat::WriteJson(JsonWriter* writer) const {
+  uint64_t cur_num = num();
+  writer->BeginObject();
+  writer->Field("count", cur_num);
+  writer->Field("sum", sum());
+  writer->Field("min", cur_num == 0 ? 0 : min());
+  writer->Field("max", cur_num == 0 ? 0 : max());
+  writer->Field("average", Average());
+  writer->Field("stddev", StandardDeviation());
+  writer->Field("p50", Median());
+  writer->Field("p95", Percentile(95));
+  writer->Field("p99", Percentile(99));
+  writer->Field("p999", Percentile(99.9));
+  writer->Field("p9999", Percentile(99.99));
+  // [low, high, count] with the same bounds ToString() prints
+  writer->Key("buckets");
+  writer->BeginArray();
+  for (unsigned int b = 0; b < num_buckets_; b++) {
+    uint64_t bucket_value = bucket_at(b);
+    if (bucket_value == 0) continue;
+    writer->BeginArray();
+    writer->Uint((b == 0) ? 0 : bucketMapper.BucketLimit(b - 1));
+    writer->Uint(bucketMapper.BucketLimit(b));
+    writer->Uint(bucket_value);
+    writer->EndArray();
+  }
+  writer->EndArray();
+  writer->EndObject();
+}
+
+const char* MetricsName(MetricsType type) {
+  switch (type) {
+    case kWrite:
+      return "write";
+    case kRead:
+      return "read";
+    case kGc:
+      return "gc";
+    case kCopy:
+      return "copy";
+    case kCacheHit:
+      return "cache_hit";
+    case kCacheMiss:
+      return "cache_miss";
+    case kSubmit:
+      return "submit";
+    case kDevice:
+      return "device";
+    case kComplete:
+      return "complete";
+    default:
+      return "unknown";
+  }
+}
+
+void Statistics::WriteJson(JsonWriter* writer) {
+  writer->BeginObject();
+  writer->Field("wall_us", wall_micros_);
+  writer->Key("metrics");
+  writer->BeginObject();
+  for (int i = 0; i < kMetricsTypeNum; i++) {
+    auto type = static_cast<MetricsType>(i);
+    auto latency = latency_[type];
+    if (latency->Empty()) continue;
+    writer->Key(MetricsName(type));
+    writer->BeginObject();
+    writer->Field("ops", latency->num());
+    writer->Field("bytes", Bytes(type));
+    writer->Field("throughput_mibs", ToMiB(AggregateThroughput(type)));
+    writer->Key("latency_us");
+    latency->WriteJson(writer);
+    writer->EndObject();
+  }
+  writer->EndObject();
+
+  {
+    std::lock_guard<std::mutex> lck(cpu_mtx_);
+    if (has_cpu_) {
+      writer->Key("cpu");
+      writer->BeginObject();
+      writer->Field("cycles", cpu_.cycles);
+      writer->Field("instructions", cpu_.instructions);
+      writer->Field("context_switches", cpu_.context_switches);
+      writer->Field("user_us", cpu_.user_us);
+      writer->Field("sys_us", cpu_.sys_us);
+      writer->EndObject();
+    }
+  }
+
+  writer->Key("intervals");
+  writer->BeginArray();
+  for (auto& sample : intervals_) {
+    double secs = sample.micros / 1e6;
+    writer->BeginObject();
+    writer->Field("us", sample.micros);
+    writer->Field("iops", sample.ops / secs);
+    writer->Field("read_mibs", ToMiB(sample.read_bytes) / secs);
+    writer->Field("write_mibs", ToMiB(sample.write_bytes) / secs);
+    writer->EndObject();
+  }
+  writer->EndArray();
+  writer->EndObject();
+}
@@ -18,6 +18,10 @@
 #include <vector>
 #include <iostream>
 
+#include "cpu_stats.h"
+
+class JsonWriter;
+
 inline double ToMiB(uint64_t value) {
   return value / (1024.0 * 1024.0);
 }
@@ -91,6 +95,8 @@ struct HistogramStat {
   double StandardDeviation() const;
   void Data(HistogramData *const data) const;
   std::string ToString() const;
+  // Summary plus the bounds and counts of every non-empty bucket
+  void WriteJson(JsonWriter *writer) const;
 
   // To be able to use HistogramStat as thread local variable, it
   // cannot have dynamic allocated member. That's why we're
@@ -107,6 +113,25 @@ struct HistogramStat {
 enum MetricsType {
   kWrite,
   kRead,
+  kGc,  // one garbage collection run: migrate a victim and reset it
+  kCopy,  // one zone to zone copy
+  kCacheHit,   // a read served by the block cache
+  kCacheMiss,  // a read that missed the block cache
+  // Phases of one async request, see AsyncIOQueue::SetPhaseStats()
+  kSubmit,    // inside io_submit
+  kDevice,    // io_submit returned until io_getevents returned it
+  kComplete,  // handling a reaped batch until the next call into the queue
+  kMetricsTypeNum,
+};
+
+const char *MetricsName(MetricsType type);
+
+// Operations and bytes of one report interval
+struct IntervalSample {
+  uint64_t micros;  // length of the interval
+  uint64_t ops;
+  uint64_t read_bytes;
+  uint64_t write_bytes;
 };
 
 class Statistics {
@@ -116,6 +141,14 @@ public:
     thpt_.insert_or_assign(kRead, new HistogramStat);
     latency_.insert_or_assign(kWrite, new HistogramStat);
     latency_.insert_or_assign(kRead, new HistogramStat);
+    latency_.insert_or_assign(kGc, new HistogramStat);
+    thpt_.insert_or_assign(kCopy, new HistogramStat);
+    latency_.insert_or_assign(kCopy, new HistogramStat);
+    latency_.insert_or_assign(kCacheHit, new HistogramStat);
+    latency_.insert_or_assign(kCacheMiss, new HistogramStat);
+    latency_.insert_or_assign(kSubmit, new HistogramStat);
+    latency_.insert_or_assign(kDevice, new HistogramStat);
+    latency_.insert_or_assign(kComplete, new HistogramStat);
   }
 
   ~Statistics() {
@@ -135,17 +168,111 @@ public:
     latency_[type]->Add(value);
   }
 
+  // Bytes moved by one operation, for the aggregate throughput
+  void AddBytes(MetricsType type, uint64_t bytes) {
+    bytes_[type].fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  // Wall time of the run these statistics were collected over
+  void AddWallMicros(uint64_t micros) { wall_micros_ += micros; }
+  uint64_t WallMicros() const { return wall_micros_; }
+
+  uint64_t Bytes(MetricsType type) const {
+    return bytes_[type].load(std::memory_order_relaxed);
+  }
+
+  // All bytes of `type` over the wall time, in bytes per second. Unlike the
+  // per-op throughput histogram this adds up across threads
+  double AggregateThroughput(MetricsType type) const {
+    if (wall_micros_ == 0) {
+      return 0;
+    }
+    return Bytes(type) * 1e6 / wall_micros_;
+  }
+
+  // Only called by the interval monitor while the run is going on
+  void AddInterval(const IntervalSample &sample) {
+    intervals_.push_back(sample);
+  }
+
+  // Accumulate the CPU consumed by one finished benchmark thread
+  void AddCpuUsage(const CpuUsage &usage) {
+    std::lock_guard<std::mutex> lck(cpu_mtx_);
+    cpu_.Merge(usage);
+    has_cpu_ = true;
+  }
+
+  // Number of reads and writes recorded so far
+  uint64_t OpCount() const {
+    return latency_.at(kRead)->num() + latency_.at(kWrite)->num();
+  }
+
   void Report() {
     ReportThroughput(kRead);
     ReportLatency(kRead);
     ReportThroughput(kWrite);
     ReportLatency(kWrite);
+    if (!latency_[kGc]->Empty()) {
+      std::cout << "[GC]";
+      ReportLatency(kGc);
+    }
+    if (!latency_[kCopy]->Empty()) {
+      std::cout << "[Copy]";
+      ReportThroughput(kCopy);
+      std::cout << "[Copy]";
+      ReportLatency(kCopy);
+    }
+    if (!latency_[kCacheHit]->Empty() || !latency_[kCacheMiss]->Empty()) {
+      std::cout << "[Cache hit]";
+      ReportLatency(kCacheHit);
+      std::cout << "[Cache miss]";
+      ReportLatency(kCacheMiss);
+    }
+    if (!latency_[kDevice]->Empty()) {
+      std::cout << "[Submit]";
+      ReportLatency(kSubmit);
+      std::cout << "[Device]";
+      ReportLatency(kDevice);
+      std::cout << "[Complete]";
+      ReportLatency(kComplete);
+    }
+    ReportCpu();
+  }
+
+  const HistogramStat &Latency(MetricsType type) const {
+    return *latency_.at(type);
+  }
+  const HistogramStat &Throughput(MetricsType type) const {
+    return *thpt_.at(type);
+  }
+
+  // Fold in the histograms and bytes of `type` recorded elsewhere, such as
+  // by another process
+  void Merge(MetricsType type, const HistogramStat &latency,
+             const HistogramStat &throughput, uint64_t bytes) {
+    latency_[type]->Merge(latency);
+    thpt_[type]->Merge(throughput);
+    AddBytes(type, bytes);
+  }
+
+  void LatencyData(MetricsType type, HistogramData *data) {
+    latency_[type]->Data(data);
+  }
+
+  void ReportCpu() {
+    std::lock_guard<std::mutex> lck(cpu_mtx_);
+    if (!has_cpu_) {
+      return;
+    }
+    std::cout << "[CPU]" << cpu_.ToString(OpCount()) << "\n";
   }
 
   void ReportThroughput(MetricsType type) {
     HistogramData data;
     thpt_[type]->Data(&data);
-    std::cout << "[Throughput]" 
+    std::cout << "[Throughput]"
+              << "[Aggregate: " << ToMiB(AggregateThroughput(type))
+              << "MiB/s]"
               << "[Average: " << ToMiB(data.average) << "MiB/s]"
               << "[Max: " << ToMiB(data.max) << "MiB/s]" 
               << "[Median: " << ToMiB(data.median) << "MiB/s]\n";
@@ -162,7 +289,18 @@ public:
               << "[Max: " << data.max << "us]\n";
   }
 
+  // Wall time, bytes, latency histograms, CPU usage and interval samples
+  // as one JSON object
+  void WriteJson(JsonWriter *writer);
+
 private:
   std::unordered_map<MetricsType, HistogramStat *> thpt_;
   std::unordered_map<MetricsType, HistogramStat *> latency_;
+  std::atomic<uint64_t> bytes_[kMetricsTypeNum] = {};
+  uint64_t wall_micros_ = 0;
+  std::vector<IntervalSample> intervals_;
+
+  std::mutex cpu_mtx_;
+  CpuUsage cpu_;
+  bool has_cpu_ = false;
 };
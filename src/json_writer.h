@@ -0,0 +1,139 @@
+#pragma once
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// A minimal streaming JSON writer for benchmark results. Values are written
+// as they come; the writer only tracks where commas are needed, so callers
+// must pair every Begin with its End and put a Key before each value of an
+// object.
+class JsonWriter {
+public:
+  explicit JsonWriter(std::ostream &out) : out_(out) {}
+
+  void BeginObject() {
+    Separate();
+    out_ << '{';
+    first_.push_back(true);
+  }
+  void EndObject() {
+    first_.pop_back();
+    out_ << '}';
+  }
+  void BeginArray() {
+    Separate();
+    out_ << '[';
+    first_.push_back(true);
+  }
+  void EndArray() {
+    first_.pop_back();
+    out_ << ']';
+  }
+
+  void Key(const std::string &key) {
+    Separate();
+    WriteString(key);
+    out_ << ':';
+    after_key_ = true;
+  }
+
+  void String(const std::string &value) {
+    Separate();
+    WriteString(value);
+  }
+  void Uint(uint64_t value) {
+    Separate();
+    out_ << value;
+  }
+  void Double(double value) {
+    Separate();
+    // JSON has no NaN or infinity
+    if (!std::isfinite(value)) {
+      out_ << "null";
+      return;
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.6g", value);
+    out_ << buf;
+  }
+  void Bool(bool value) {
+    Separate();
+    out_ << (value ? "true" : "false");
+  }
+
+  // Shorthands for a key followed by its value
+  void Field(const std::string &key, const std::string &value) {
+    Key(key);
+    String(value);
+  }
+  void Field(const std::string &key, const char *value) {
+    Key(key);
+    String(value);
+  }
+  void Field(const std::string &key, uint64_t value) {
+    Key(key);
+    Uint(value);
+  }
+  void Field(const std::string &key, double value) {
+    Key(key);
+    Double(value);
+  }
+  void Field(const std::string &key, bool value) {
+    Key(key);
+    Bool(value);
+  }
+
+private:
+  // Emit the comma between two elements of the enclosing object or array
+  void Separate() {
+    if (after_key_) {
+      after_key_ = false;
+      return;
+    }
+    if (first_.empty()) {
+      return;
+    }
+    if (!first_.back()) {
+      out_ << ',';
+    }
+    first_.back() = false;
+  }
+
+  void WriteString(const std::string &value) {
+    out_ << '"';
+    for (unsigned char c : value) {
+      switch (c) {
+      case '"':
+        out_ << "\\\"";
+        break;
+      case '\\':
+        out_ << "\\\\";
+        break;
+      case '\n':
+        out_ << "\\n";
+        break;
+      case '\t':
+        out_ << "\\t";
+        break;
+      default:
+        if (c < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          out_ << buf;
+        } else {
+          out_ << c;
+        }
+      }
+    }
+    out_ << '"';
+  }
+
+  std::ostream &out_;
+  // One entry per open object or array, true until its first element
+  std::vector<bool> first_;
+  bool after_key_ = false;
+};
@@ -0,0 +1,321 @@
+// Device-free microbenchmarks of the host-side code on the per-op path.
+// Every benchmark is run with 1, 2, 4, ... up to --max_threads threads and
+// reports the aggregate ops/s and the ns/op seen by each thread.
+
+#include "gflags/gflags.h"
+#include "bench_util.h"
+#include "histogram.h"
+#include "zbd_fs.h"
+#include "zone_group.h"
+
+#include <libzbd/zbd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+DEFINE_string(benchmarks,
+              "histogram,metricsguard,duration,clock,acquire,fill,parity,"
+              "zoneops",
+              "Comma separated list of microbenchmarks to run");
+DEFINE_uint64(max_threads, 8, "Largest number of threads to scale to");
+DEFINE_uint64(ops, 10000000,
+              "Operations issued by each thread. fill moves a whole buffer "
+              "per operation and issues 1/64 of them");
+DEFINE_uint64(fill_size, 4096,
+              "Buffer size of the fill and parity microbenchmarks");
+DEFINE_uint64(parity_k, 4, "Data buffers XORed by the parity microbenchmark");
+
+namespace {
+
+const uint32_t kBlockSize = 4096;
+const uint64_t kZoneSize = 1ULL << 30;
+
+// Keep the compiler from dropping stores to or loads from `p`
+inline void Escape(void *p) { asm volatile("" : : "g"(p) : "memory"); }
+
+// Run `fn(thread id, ops)` on `threads` threads started together and print
+// the scaling numbers of this run
+void RunScaling(const std::string &name, uint64_t threads, uint64_t ops,
+                const std::function<void(uint64_t, uint64_t)> &fn) {
+  std::atomic<uint64_t> ready(0);
+  std::atomic_bool go(false);
+  std::vector<std::thread> workers;
+  for (uint64_t i = 0; i < threads; ++i) {
+    workers.emplace_back([&, i]() {
+      ready++;
+      while (!go.load(std::memory_order_acquire))
+        ;
+      fn(i, ops);
+    });
+  }
+  while (ready.load() < threads)
+    ;
+
+  auto start = std::chrono::steady_clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto &t : workers) {
+    t.join();
+  }
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+
+  double total_ops = (double)ops * threads;
+  printf("[%s][Threads: %lu][Ops/s: %.0f][ns/op: %.2f]\n", name.c_str(),
+         threads, total_ops * 1e9 / ns, (double)ns / ops);
+}
+
+void RunAllScales(const std::string &name,
+                  const std::function<void(uint64_t, uint64_t)> &fn,
+                  uint64_t ops = FLAGS_ops) {
+  for (uint64_t t = 1; t <= FLAGS_max_threads; t *= 2) {
+    RunScaling(name, t, ops, fn);
+  }
+}
+
+// All benchmark threads share one histogram, so these include the cost of
+// its shared atomics
+void BenchHistogram() {
+  HistogramStat hist;
+  RunAllScales("histogram/add", [&](uint64_t /*id*/, uint64_t ops) {
+    for (uint64_t i = 0; i < ops; ++i) {
+      hist.Add((i & 1023) + 1);
+    }
+  });
+}
+
+void BenchMetricsGuard() {
+  Statistics stats;
+  RunAllScales("metricsguard", [&](uint64_t /*id*/, uint64_t ops) {
+    for (uint64_t i = 0; i < ops; ++i) {
+      MetricsGuard guard(kBlockSize, &stats, kWrite);
+    }
+  });
+}
+
+// The end of run check every benchmark loop does once per operation
+void BenchDuration() {
+  RunAllScales("duration/ending", [&](uint64_t /*id*/, uint64_t ops) {
+    auto dura = Duration(3600);
+    uint64_t ended = 0;
+    for (uint64_t i = 0; i < ops; ++i) {
+      ended += dura.Ending();
+    }
+    Escape(&ended);
+  });
+}
+
+// One timestamp from the clock of the per-op path and from steady_clock
+void BenchClock() {
+  printf("[clock][TSC: %s]\n", FastClock::UsesTsc() ? "yes" : "no");
+  RunAllScales("clock/fast", [&](uint64_t /*id*/, uint64_t ops) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < ops; ++i) {
+      sum += FastClock::Now();
+    }
+    Escape(&sum);
+  });
+  RunAllScales("clock/steady", [&](uint64_t /*id*/, uint64_t ops) {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < ops; ++i) {
+      sum += std::chrono::steady_clock::now().time_since_epoch().count();
+    }
+    Escape(&sum);
+  });
+}
+
+void BenchAcquire() {
+  ZonedBlockDevice zbd("none");
+  std::vector<Zone> zones(FLAGS_max_threads);
+  for (uint64_t i = 0; i < zones.size(); ++i) {
+    struct zbd_zone z;
+    memset(&z, 0, sizeof(z));
+    z.start = z.wp = i * kZoneSize;
+    z.capacity = z.len = kZoneSize;
+    zones[i].Init(&zbd, &z);
+  }
+
+  // Every thread owns a zone, as the writers of the benchmarks do
+  RunAllScales("acquire/private", [&](uint64_t id, uint64_t ops) {
+    auto zone = &zones[id];
+    for (uint64_t i = 0; i < ops; ++i) {
+      while (!zone->Acquire())
+        ;
+      zone->Release();
+    }
+  });
+  // All threads fight for the same zone
+  RunAllScales("acquire/shared", [&](uint64_t /*id*/, uint64_t ops) {
+    auto zone = &zones[0];
+    for (uint64_t i = 0; i < ops; ++i) {
+      while (!zone->Acquire())
+        ;
+      zone->Release();
+    }
+  });
+}
+
+// Filling a write buffer with a pattern, byte by byte as the write
+// benchmarks do and with memset
+void BenchFill() {
+  auto fill_ops = std::max<uint64_t>(FLAGS_ops / 64, 1);
+  auto size = FLAGS_fill_size;
+  RunAllScales("fill/loop", [&](uint64_t /*id*/, uint64_t ops) {
+    char *buf = (char *)aligned_alloc(4096, size);
+    for (uint64_t i = 0; i < ops; ++i) {
+      for (size_t j = 0; j < size; ++j) {
+        buf[j] = '1';
+      }
+      Escape(buf);
+    }
+    free(buf);
+  }, fill_ops);
+  RunAllScales("fill/memset", [&](uint64_t /*id*/, uint64_t ops) {
+    char *buf = (char *)aligned_alloc(4096, size);
+    for (uint64_t i = 0; i < ops; ++i) {
+      memset(buf, '1', size);
+      Escape(buf);
+    }
+    free(buf);
+  }, fill_ops);
+}
+
+// Parity of --parity_k buffers of --fill_size, as ParityZoneGroup computes
+// it for every row it appends
+void BenchParity() {
+  auto parity_ops = std::max<uint64_t>(FLAGS_ops / 64, 1);
+  auto size = FLAGS_fill_size;
+  for (bool simd : {false, true}) {
+    RunAllScales(simd ? "parity/simd" : "parity/scalar",
+                 [&](uint64_t id, uint64_t ops) {
+      std::vector<char *> srcs(FLAGS_parity_k);
+      for (auto &src : srcs) {
+        src = (char *)aligned_alloc(4096, size);
+        memset(src, (int)id, size);
+      }
+      char *parity = (char *)aligned_alloc(4096, size);
+      for (uint64_t i = 0; i < ops; ++i) {
+        ParityZoneGroup::XorBlocks(parity, srcs.data(), srcs.size(), size,
+                                   simd);
+        Escape(parity);
+      }
+      for (auto src : srcs) {
+        free(src);
+      }
+      free(parity);
+    }, parity_ops);
+  }
+}
+
+// The zone bookkeeping of the per-op path, on the same fields and with the
+// same operations as Zone. Only the layout differs: kAlign of 8 packs the
+// zones of neighbouring threads into shared cache lines as Zone was before
+// it was padded, kCacheLineSize gives each one a line of its own
+template <size_t kAlign>
+struct alignas(kAlign) ZoneState {
+  std::atomic_bool busy_{false};
+  uint64_t start_ = 0;
+  uint64_t capacity_ = 0;
+  uint64_t max_capacity_ = 0;
+  uint64_t wp_ = 0;
+  std::atomic<uint64_t> used_capacity_{0};
+
+  bool Acquire() {
+    bool expected = false;
+    return busy_.compare_exchange_strong(expected, true,
+                                         std::memory_order_acq_rel);
+  }
+  bool Release() {
+    bool expected = true;
+    return busy_.compare_exchange_strong(expected, false,
+                                         std::memory_order_acq_rel);
+  }
+  bool Reserve(uint32_t size, uint64_t *offset) {
+    if (capacity_ < size) {
+      return false;
+    }
+    *offset = wp_;
+    wp_ += size;
+    capacity_ -= size;
+    return true;
+  }
+  void Rewind() {
+    wp_ = start_;
+    capacity_ = max_capacity_;
+  }
+};
+
+static_assert(sizeof(ZoneState<8>) < kCacheLineSize,
+              "Packed zones must share cache lines");
+static_assert(sizeof(ZoneState<kCacheLineSize>) == kCacheLineSize,
+              "Padded zones must fill one cache line");
+
+// One append worth of zone bookkeeping: acquire the zone, advance its write
+// pointer, account the valid data and release it again. Every thread works
+// on its own zone, and the zones of neighbouring threads are adjacent
+template <size_t kAlign>
+void RunZoneOps(const std::string &name) {
+  std::vector<ZoneState<kAlign>> zones(FLAGS_max_threads);
+  for (uint64_t i = 0; i < zones.size(); ++i) {
+    zones[i].start_ = zones[i].wp_ = i * kZoneSize;
+    zones[i].capacity_ = zones[i].max_capacity_ = kZoneSize;
+  }
+  RunAllScales(name, [&](uint64_t id, uint64_t ops) {
+    auto zone = &zones[id];
+    uint64_t offset;
+    for (uint64_t i = 0; i < ops; ++i) {
+      while (!zone->Acquire())
+        ;
+      if (!zone->Reserve(kBlockSize, &offset)) {
+        zone->Rewind();
+        zone->Reserve(kBlockSize, &offset);
+      }
+      zone->used_capacity_.fetch_add(kBlockSize, std::memory_order_relaxed);
+      zone->Release();
+    }
+  });
+}
+
+void BenchZoneOps() {
+  RunZoneOps<kCacheLineSize>("zoneops/padded");
+  RunZoneOps<8>("zoneops/packed");
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  std::stringstream names(FLAGS_benchmarks);
+  std::string name;
+  while (std::getline(names, name, ',')) {
+    if (name == "histogram") {
+      BenchHistogram();
+    } else if (name == "metricsguard") {
+      BenchMetricsGuard();
+    } else if (name == "duration") {
+      BenchDuration();
+    } else if (name == "clock") {
+      BenchClock();
+    } else if (name == "acquire") {
+      BenchAcquire();
+    } else if (name == "fill") {
+      BenchFill();
+    } else if (name == "parity") {
+      BenchParity();
+    } else if (name == "zoneops") {
+      BenchZoneOps();
+    } else {
+      printf("Unknown microbenchmark %s\n", name.c_str());
+      return 1;
+    }
+  }
+  return 0;
+}
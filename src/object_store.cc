@@ -0,0 +1,345 @@
+#include "object_store.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+LifetimeGenerator::LifetimeGenerator(Kind kind, uint64_t mean,
+                                     double hot_ratio, uint64_t seed)
+    : kind_(kind), mean_(std::max<uint64_t>(mean, 1)), hot_ratio_(hot_ratio),
+      rng_(seed) {
+  hot_mean_ = cold_mean_ = mean_;
+  if (kind_ == kBimodal) {
+    // Hot objects live a tenth of the mean, cold objects make up the rest so
+    // that the overall mean is kept
+    assert(hot_ratio_ > 0 && hot_ratio_ < 1);
+    hot_mean_ = std::max<uint64_t>(mean_ / 10, 1);
+    cold_mean_ = (mean_ - hot_ratio_ * hot_mean_) / (1 - hot_ratio_);
+  }
+}
+
+bool LifetimeGenerator::ParseKind(const std::string &name, Kind *kind) {
+  if (name == "uniform") {
+    *kind = kUniform;
+  } else if (name == "exp") {
+    *kind = kExponential;
+  } else if (name == "bimodal") {
+    *kind = kBimodal;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+uint64_t LifetimeGenerator::Next() {
+  switch (kind_) {
+  case kUniform:
+    return std::uniform_int_distribution<uint64_t>(0, 2 * mean_)(rng_);
+  case kExponential:
+    return std::exponential_distribution<double>(1.0 / mean_)(rng_);
+  case kBimodal: {
+    bool hot = std::bernoulli_distribution(hot_ratio_)(rng_);
+    double mean = hot ? hot_mean_ : cold_mean_;
+    return std::exponential_distribution<double>(1.0 / mean)(rng_);
+  }
+  }
+  return mean_;
+}
+
+void GcStats::Merge(const GcStats &other) {
+  objects += other.objects;
+  user_bytes += other.user_bytes;
+  gc_bytes += other.gc_bytes;
+  gc_micros += other.gc_micros;
+  gc_runs += other.gc_runs;
+  resets += other.resets;
+  victim_valid_bytes += other.victim_valid_bytes;
+  victim_capacity += other.victim_capacity;
+  for (int i = 0; i < 11; ++i) {
+    victim_valid_hist[i] += other.victim_valid_hist[i];
+  }
+}
+
+double GcStats::WriteAmplification() const {
+  if (user_bytes == 0) {
+    return 0;
+  }
+  return (double)(user_bytes + gc_bytes) / user_bytes;
+}
+
+std::string GcStats::ToString() const {
+  char buf[512];
+  double gc_bw = gc_micros ? ToMiB(gc_bytes) * 1e6 / gc_micros : 0;
+  double victim_valid =
+      victim_capacity ? 100.0 * victim_valid_bytes / victim_capacity : 0;
+  snprintf(buf, sizeof(buf),
+           "[Objects: %" PRIu64 "][User: %.1fMiB][Migrated: %.1fMiB]"
+           "[WA: %.3f][GC runs: %" PRIu64 "][Resets: %" PRIu64 "]"
+           "[GC time: %.3fs][GC bandwidth: %.1fMiB/s]"
+           "[Victim valid: %.1f%%]",
+           objects, ToMiB(user_bytes), ToMiB(gc_bytes), WriteAmplification(),
+           gc_runs, resets, gc_micros / 1e6, gc_bw, victim_valid);
+  return buf;
+}
+
+std::string GcStats::VictimHistogram() const {
+  std::string r;
+  for (int i = 0; i < 11; ++i) {
+    if (i) {
+      r += " ";
+    }
+    r += std::to_string(i * 10) + "%:" + std::to_string(victim_valid_hist[i]);
+  }
+  return r;
+}
+
+ObjectStore::ObjectStore(ZonedBlockDevice *zbd, std::vector<Zone *> zones,
+                         Statistics *statistic, const Options &options)
+    : zbd_(zbd), zones_(std::move(zones)), statistic_(statistic),
+      options_(options),
+      placement_(PlacementPolicy::Create(options.placement, options.seed)) {}
+
+ObjectStore::~ObjectStore() {
+  // Init() may have stopped before it acquired all of them
+  for (uint32_t i = 0; i < acquired_; ++i) {
+    zones_[i]->used_capacity_ = 0;
+    zones_[i]->CheckRelease();
+  }
+  free(gc_buf_);
+}
+
+bool ObjectStore::Init() {
+  if (!placement_) {
+    printf("[ObjectStore] Unknown placement %s\n", options_.placement.c_str());
+    return false;
+  }
+  // The user streams, the collector and its reserve all need a zone
+  if (zones_.size() < options_.open_zones + options_.gc_free_zones + 1) {
+    printf("[ObjectStore] %zu zones are too few for %u open zones\n",
+           zones_.size(), options_.open_zones);
+    return false;
+  }
+  assert((options_.object_size % zbd_->GetBlockSize()) == 0);
+
+  if (posix_memalign((void **)&gc_buf_, sysconf(_SC_PAGESIZE),
+                     options_.object_size)) {
+    return false;
+  }
+
+  states_.assign(zones_.size(), kFree);
+  zone_objects_.assign(zones_.size(), {});
+  for (uint32_t i = 0; i < zones_.size(); ++i) {
+    auto zone = zones_[i];
+    zone->LoopForAcquire();
+    acquired_++;
+    zone->used_capacity_ = 0;
+    if (!zone->IsEmpty() && !zone->Reset()) {
+      return false;
+    }
+    index_[zone] = i;
+  }
+  // Hand out zones from the front of the list first
+  free_zones_.assign(zones_.rbegin(), zones_.rend());
+
+  for (uint32_t i = 0; i < options_.open_zones; ++i) {
+    open_.push_back(TakeFreeZone());
+  }
+  return true;
+}
+
+double ObjectStore::Utilization() const {
+  uint64_t valid = 0, capacity = 0;
+  for (uint32_t i = 0; i < zones_.size(); ++i) {
+    if (states_[i] != kFree) {
+      valid += zones_[i]->used_capacity_;
+      capacity += zones_[i]->max_capacity_;
+    }
+  }
+  return capacity ? (double)valid / capacity : 0;
+}
+
+Zone *ObjectStore::TakeFreeZone() {
+  if (free_zones_.empty()) {
+    return nullptr;
+  }
+  auto zone = free_zones_.back();
+  free_zones_.pop_back();
+  states_[index_[zone]] = kOpen;
+  return zone;
+}
+
+void ObjectStore::MaybeRetire(Zone *zone) {
+  if (zone->GetCapacityLeft() >= options_.object_size) {
+    return;
+  }
+  states_[index_[zone]] = kFull;
+  if (zone == gc_zone_) {
+    gc_zone_ = nullptr;
+  }
+  for (auto &open : open_) {
+    if (open == zone) {
+      open = nullptr;
+    }
+  }
+}
+
+Zone *ObjectStore::PickZone(uint64_t hint) {
+  uint32_t slot = placement_->Pick(hint, open_.size());
+  if (!open_[slot]) {
+    open_[slot] = TakeFreeZone();
+  }
+  return open_[slot];
+}
+
+void ObjectStore::Invalidate(uint64_t oid) {
+  auto &obj = objects_[oid];
+  obj.live = false;
+  obj.zone->used_capacity_ -= options_.object_size;
+  free_ids_.push_back(oid);
+}
+
+void ObjectStore::Expire() {
+  while (!expiry_.empty() && std::get<0>(expiry_.top()) <= seq_) {
+    auto [death, oid, seq] = expiry_.top();
+    expiry_.pop();
+    if (objects_[oid].live && objects_[oid].seq == seq) {
+      Invalidate(oid);
+    }
+  }
+}
+
+bool ObjectStore::AppendObject(Zone *zone, const char *data, uint64_t oid) {
+  auto offset = zone->wp_;
+  if (!zone->Append(const_cast<char *>(data), options_.object_size)) {
+    return false;
+  }
+  zone->used_capacity_ += options_.object_size;
+  objects_[oid].zone = zone;
+  objects_[oid].offset = offset;
+  zone_objects_[index_[zone]].emplace_back(oid, offset);
+  MaybeRetire(zone);
+  return true;
+}
+
+bool ObjectStore::Put(const char *data, uint64_t lifetime, uint64_t hint) {
+  seq_++;
+  Expire();
+
+  while (free_zones_.size() < options_.gc_free_zones) {
+    if (!CollectGarbage()) {
+      break;
+    }
+  }
+
+  auto zone = PickZone(hint);
+  if (!zone) {
+    printf("[ObjectStore] Out of space at utilization %.3f\n", Utilization());
+    return false;
+  }
+
+  uint64_t oid;
+  if (!free_ids_.empty()) {
+    oid = free_ids_.back();
+    free_ids_.pop_back();
+  } else {
+    oid = objects_.size();
+    objects_.emplace_back();
+  }
+  objects_[oid].seq = seq_;
+  objects_[oid].live = true;
+  if (!AppendObject(zone, data, oid)) {
+    return false;
+  }
+  expiry_.emplace(seq_ + lifetime, oid, seq_);
+
+  stats_.objects++;
+  stats_.user_bytes += options_.object_size;
+  return true;
+}
+
+Zone *ObjectStore::PickVictim() {
+  // Greedy: the full zone with the least valid data
+  Zone *victim = nullptr;
+  for (uint32_t i = 0; i < zones_.size(); ++i) {
+    if (states_[i] != kFull) {
+      continue;
+    }
+    if (!victim || zones_[i]->used_capacity_ < victim->used_capacity_) {
+      victim = zones_[i];
+    }
+  }
+  // Collecting a zone without garbage gains nothing. A zone holds whole
+  // objects only, the tail of its capacity below one object is never valid
+  if (victim && victim->used_capacity_ >= victim->max_capacity_ /
+                                              options_.object_size *
+                                              options_.object_size) {
+    return nullptr;
+  }
+  return victim;
+}
+
+bool ObjectStore::Migrate(Zone *victim) {
+  auto read_f = zbd_->GetReadDirectFD();
+  for (auto [oid, offset] : zone_objects_[index_[victim]]) {
+    auto &obj = objects_[oid];
+    if (!obj.live || obj.zone != victim || obj.offset != offset) {
+      continue;
+    }
+    if (!gc_zone_) {
+      gc_zone_ = TakeFreeZone();
+      if (!gc_zone_) {
+        printf("[ObjectStore] No free zone left for garbage collection\n");
+        return false;
+      }
+    }
+    auto ret = pread(read_f, gc_buf_, options_.object_size, offset);
+    if (ret != (ssize_t)options_.object_size) {
+      return false;
+    }
+    victim->used_capacity_ -= options_.object_size;
+    if (!AppendObject(gc_zone_, gc_buf_, oid)) {
+      return false;
+    }
+    stats_.gc_bytes += options_.object_size;
+  }
+  return true;
+}
+
+bool ObjectStore::CollectGarbage() {
+  auto victim = PickVictim();
+  if (!victim) {
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  stats_.victim_valid_bytes += victim->used_capacity_;
+  stats_.victim_capacity += victim->max_capacity_;
+  stats_.victim_valid_hist[10 * victim->used_capacity_ /
+                           victim->max_capacity_]++;
+
+  if (!Migrate(victim)) {
+    return false;
+  }
+  assert(victim->used_capacity_ == 0);
+  if (!victim->Reset()) {
+    return false;
+  }
+
+  auto idx = index_[victim];
+  zone_objects_[idx].clear();
+  states_[idx] = kFree;
+  free_zones_.push_back(victim);
+
+  auto dura = std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  statistic_->AddLatency(kGc, dura);
+  stats_.gc_micros += dura;
+  stats_.gc_runs++;
+  stats_.resets++;
+  return true;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstdint>
+#include <queue>
+#include <random>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "histogram.h"
+#include "placement.h"
+#include "zbd_fs.h"
+
+// Draw object lifetimes, measured in object writes: an object written at
+// logical time t dies once t + lifetime more objects have been written.
+class LifetimeGenerator {
+public:
+  enum Kind {
+    kUniform,      // uniform in [0, 2 * mean]
+    kExponential,  // exponential with the given mean
+    kBimodal,      // a short-lived hot set and a long-lived cold set
+  };
+
+  LifetimeGenerator(Kind kind, uint64_t mean, double hot_ratio, uint64_t seed);
+
+  // Parse "uniform", "exp" or "bimodal". Return false on unknown names
+  static bool ParseKind(const std::string &name, Kind *kind);
+
+  uint64_t Next();
+
+  // Expected lifetime of hot and cold objects, used as placement hints
+  uint64_t HotLifetime() const { return hot_mean_; }
+  uint64_t ColdLifetime() const { return cold_mean_; }
+
+private:
+  Kind kind_;
+  uint64_t mean_;
+  double hot_ratio_;
+  uint64_t hot_mean_;
+  uint64_t cold_mean_;
+  std::mt19937_64 rng_;
+};
+
+// Space reclamation counters of one or several object stores
+struct GcStats {
+  uint64_t objects = 0;
+  uint64_t user_bytes = 0;  // bytes written by Put()
+  uint64_t gc_bytes = 0;    // bytes migrated by the garbage collector
+  uint64_t gc_micros = 0;   // time spent in garbage collection
+  uint64_t gc_runs = 0;     // victims collected
+  uint64_t resets = 0;
+  uint64_t victim_valid_bytes = 0;  // valid bytes found in collected victims
+  uint64_t victim_capacity = 0;     // capacity of collected victims
+  // Collected victims by their valid fraction, in 10% steps
+  uint64_t victim_valid_hist[11] = {};
+
+  void Merge(const GcStats &other);
+  double WriteAmplification() const;
+  std::string ToString() const;
+  // The victim valid fraction distribution, e.g. "0%:12 10%:3 ..."
+  std::string VictimHistogram() const;
+};
+
+// A log-structured store of fixed-size objects on a private set of zones.
+// Every object carries a lifetime; expired objects turn into garbage, the
+// amount of valid data of each zone is kept in Zone::used_capacity_, and a
+// greedy host-side collector migrates the valid objects of the emptiest full
+// zone before resetting it. A PlacementPolicy spreads the user writes over
+// `open_zones` open zones. Not thread-safe, each writer owns its store.
+class ObjectStore {
+public:
+  struct Options {
+    uint64_t object_size = 4096;
+    // Number of zones written concurrently by user Put()s
+    uint32_t open_zones = 1;
+    // Name of the PlacementPolicy choosing among the open zones
+    std::string placement = "random";
+    // Collect garbage once fewer zones than this are free
+    uint32_t gc_free_zones = 2;
+    uint64_t seed = 0;
+  };
+
+  ObjectStore(ZonedBlockDevice *zbd, std::vector<Zone *> zones,
+              Statistics *statistic, const Options &options);
+  ~ObjectStore();
+
+  // Acquire and reset all zones of this store
+  bool Init();
+
+  // Write one object that expires after `lifetime` further writes, placed
+  // according to `hint`. Return false on I/O error or when the store is out
+  // of space
+  bool Put(const char *data, uint64_t lifetime, uint64_t hint);
+
+  const GcStats &Stats() const { return stats_; }
+
+  // Valid bytes over the capacity of all written zones
+  double Utilization() const;
+
+private:
+  enum ZoneState { kFree, kOpen, kFull };
+
+  struct Object {
+    Zone *zone = nullptr;
+    uint64_t offset = 0;
+    uint64_t seq = 0;  // logical time of the write, distinguishes reused ids
+    bool live = false;
+  };
+
+  // (death time, object id, write seq), ordered by death time
+  using Expiry = std::tuple<uint64_t, uint64_t, uint64_t>;
+
+  void Expire();
+  void Invalidate(uint64_t oid);
+
+  Zone *PickZone(uint64_t hint);
+  // Take a free zone for writing, nullptr if there is none
+  Zone *TakeFreeZone();
+  // Retire `zone` once it cannot fit another object
+  void MaybeRetire(Zone *zone);
+
+  bool AppendObject(Zone *zone, const char *data, uint64_t oid);
+  bool CollectGarbage();
+  Zone *PickVictim();
+  bool Migrate(Zone *victim);
+
+  ZonedBlockDevice *zbd_;
+  std::vector<Zone *> zones_;
+  // Zones acquired by Init(), a prefix of zones_
+  uint32_t acquired_ = 0;
+  Statistics *statistic_;
+  Options options_;
+  std::unique_ptr<PlacementPolicy> placement_;
+
+  std::unordered_map<Zone *, uint32_t> index_;
+  std::vector<ZoneState> states_;
+  // (object id, offset) of every object appended to each zone
+  std::vector<std::vector<std::pair<uint64_t, uint64_t>>> zone_objects_;
+  std::vector<Zone *> free_zones_;
+  std::vector<Zone *> open_;
+  Zone *gc_zone_ = nullptr;
+
+  std::vector<Object> objects_;
+  std::vector<uint64_t> free_ids_;
+  std::priority_queue<Expiry, std::vector<Expiry>, std::greater<Expiry>>
+      expiry_;
+  uint64_t seq_ = 0;
+
+  char *gc_buf_ = nullptr;
+  GcStats stats_;
+};
@@ -0,0 +1,30 @@
+#include "placement.h"
+
+#include <algorithm>
+
+std::unique_ptr<PlacementPolicy> PlacementPolicy::Create(
+    const std::string &name, uint64_t seed) {
+  if (name == "random") {
+    return std::make_unique<RandomPlacement>(seed);
+  } else if (name == "roundrobin") {
+    return std::make_unique<RoundRobinPlacement>(seed);
+  } else if (name == "hint") {
+    return std::make_unique<HintPlacement>();
+  }
+  return nullptr;
+}
+
+uint32_t HintPlacement::Pick(uint64_t hint, uint32_t n) {
+  int bucket = hint ? 64 - __builtin_clzll(hint) : 0;
+  buckets_[bucket]++;
+  total_++;
+
+  uint64_t below = 0;
+  for (int b = 0; b < bucket; ++b) {
+    below += buckets_[b];
+  }
+  // Position of this hint in the distribution, taking the middle of its
+  // bucket
+  double quantile = (below + buckets_[bucket] / 2.0) / total_;
+  return std::min<uint32_t>(quantile * n, n - 1);
+}
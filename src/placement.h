@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+
+// Decide where a write goes. A policy picks one of `n` candidates, which are
+// either zones of the device or the open zones (streams) of a writer. Every
+// write carries a hint of how long its data is expected to live; 0 means the
+// writer does not know. Policies are not thread-safe, create one per writer.
+class PlacementPolicy {
+public:
+  virtual ~PlacementPolicy() = default;
+
+  virtual const char *Name() const = 0;
+
+  // Choose one of `n` candidates for a write with the given lifetime hint
+  virtual uint32_t Pick(uint64_t hint, uint32_t n) = 0;
+
+  // "random", "roundrobin" or "hint". Return nullptr for unknown names
+  static std::unique_ptr<PlacementPolicy> Create(const std::string &name,
+                                                 uint64_t seed);
+};
+
+class RandomPlacement : public PlacementPolicy {
+public:
+  explicit RandomPlacement(uint64_t seed) : rng_(seed) {}
+
+  const char *Name() const override { return "random"; }
+  uint32_t Pick(uint64_t hint, uint32_t n) override { return rng_() % n; }
+
+private:
+  std::mt19937_64 rng_;
+};
+
+class RoundRobinPlacement : public PlacementPolicy {
+public:
+  explicit RoundRobinPlacement(uint64_t start) : next_(start) {}
+
+  const char *Name() const override { return "roundrobin"; }
+  uint32_t Pick(uint64_t hint, uint32_t n) override { return next_++ % n; }
+
+private:
+  uint64_t next_;
+};
+
+// Route writes with similar expected lifetimes to the same candidate, so
+// that data which dies together is co-located and zones are invalidated as
+// a whole. Hints are grouped by their order of magnitude; the boundaries
+// between the `n` classes are the quantiles of the hints seen so far, so
+// every candidate receives about the same share of the writes.
+class HintPlacement : public PlacementPolicy {
+public:
+  HintPlacement() = default;
+
+  const char *Name() const override { return "hint"; }
+  uint32_t Pick(uint64_t hint, uint32_t n) override;
+
+private:
+  static constexpr int kBuckets = 65;  // log2 of any uint64_t, plus zero
+
+  uint64_t buckets_[kBuckets] = {};
+  uint64_t total_ = 0;
+};
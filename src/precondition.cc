@@ -0,0 +1,254 @@
+#include "precondition.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+
+namespace {
+uint64_t NowMicros() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Run `fn(id)` on `threads` threads and return whether all of them succeeded
+template <typename Fn> bool RunThreads(uint32_t threads, Fn fn) {
+  std::atomic_bool ok(true);
+  std::vector<std::thread> workers;
+  for (uint32_t i = 0; i < std::max<uint32_t>(threads, 1); ++i) {
+    workers.emplace_back([&, i]() {
+      if (!fn(i)) {
+        ok = false;
+      }
+    });
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+  return ok;
+}
+} // namespace
+
+bool Preconditioner::ParsePattern(const std::string &name, Pattern *pattern) {
+  if (name == "zero") {
+    *pattern = kZero;
+  } else if (name == "ones") {
+    *pattern = kOnes;
+  } else if (name == "random") {
+    *pattern = kRandom;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+std::string Preconditioner::Stats::ToString() const {
+  char buf[512];
+  double mib = bytes / (1024.0 * 1024.0);
+  snprintf(buf, sizeof(buf),
+           "[Zones full: %" PRIu64 "][Zones partial: %" PRIu64 "]"
+           "[Zones empty: %" PRIu64 "][Resets: %" PRIu64 "]"
+           "[Written: %.1fMiB][Reset time: %.3fs][Fill time: %.3fs]"
+           "[Fill bandwidth: %.1fMiB/s]",
+           zones_full, zones_partial, zones_empty, resets, mib,
+           reset_micros / 1e6, fill_micros / 1e6,
+           fill_micros ? mib * 1e6 / fill_micros : 0);
+  return buf;
+}
+
+Preconditioner::Preconditioner(ZonedBlockDevice *zbd, const Options &options)
+    : zbd_(zbd), options_(options), next_(0), bytes_(0) {}
+
+bool Preconditioner::Run() {
+  assert((options_.chunk_size % zbd_->GetBlockSize()) == 0);
+  stats_ = Stats();
+
+  // Offline zones have no capacity and are left alone
+  std::vector<Zone *> zones;
+  for (size_t i = 0; i < zbd_->GetNrIOZones(); ++i) {
+    auto zone = zbd_->GetIOZone(i);
+    if (zone->max_capacity_ > 0) {
+      zones.push_back(zone);
+    }
+  }
+
+  // Pick the zones of each kind at random, so that full, partial and empty
+  // zones are spread over the whole device
+  std::mt19937_64 rng(options_.seed);
+  std::shuffle(zones.begin(), zones.end(), rng);
+  auto fill = std::min(std::max(options_.fill, 0.0), 1.0);
+  auto partial = std::min(std::max(options_.partial, 0.0), 1.0);
+  uint64_t nr_fill = zones.size() * fill + 0.5;
+  uint64_t nr_partial = nr_fill * partial + 0.5;
+  auto block = zbd_->GetBlockSize();
+
+  targets_.clear();
+  for (uint64_t i = 0; i < nr_fill; ++i) {
+    auto zone = zones[i];
+    uint64_t bytes = zone->max_capacity_;
+    uint64_t blocks = bytes / block;
+    if (i < nr_partial && blocks > 1) {
+      bytes = (1 + rng() % (blocks - 1)) * block;
+      stats_.zones_partial++;
+    } else {
+      stats_.zones_full++;
+    }
+    targets_.push_back({zone, bytes});
+  }
+  stats_.zones_empty = zones.size() - nr_fill;
+
+  auto start = NowMicros();
+  if (!ResetZones()) {
+    printf("[Precondition] Failed to reset zones\n");
+    return false;
+  }
+  stats_.reset_micros = NowMicros() - start;
+
+  start = NowMicros();
+  bool ok = FillZones();
+  stats_.fill_micros = NowMicros() - start;
+  stats_.bytes = bytes_;
+  if (!ok) {
+    printf("[Precondition] Failed to fill zones\n");
+  }
+  return ok;
+}
+
+bool Preconditioner::ResetZones() {
+  std::atomic<uint64_t> next(0), resets(0);
+  auto nr_zones = zbd_->GetNrIOZones();
+  bool ok = RunThreads(options_.threads, [&](uint32_t id) {
+    for (auto i = next++; i < nr_zones; i = next++) {
+      auto zone = zbd_->GetIOZone(i);
+      if (zone->IsEmpty()) {
+        continue;
+      }
+      zone->LoopForAcquire();
+      bool reset = zone->Reset();
+      zone->CheckRelease();
+      if (!reset) {
+        return false;
+      }
+      resets++;
+    }
+    return true;
+  });
+  stats_.resets = resets;
+  return ok;
+}
+
+bool Preconditioner::FillZones() {
+  next_ = 0;
+  bytes_ = 0;
+  return RunThreads(options_.threads,
+                    [this](uint32_t id) { return FillWorker(id); });
+}
+
+bool Preconditioner::FillWorker(uint64_t id) {
+  struct Slot {
+    Zone *zone = nullptr;
+    uint64_t left = 0;  // bytes still to be submitted to the zone
+    uint64_t size = 0;  // size of the write in flight
+  };
+
+  // Writes only read from the buffer, all slots share it
+  char *buf = nullptr;
+  if (posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE),
+                     options_.chunk_size)) {
+    return false;
+  }
+  if (options_.pattern == kRandom) {
+    std::mt19937_64 rng(options_.seed + id);
+    auto words = reinterpret_cast<uint64_t *>(buf);
+    for (uint64_t i = 0; i < options_.chunk_size / sizeof(uint64_t); ++i) {
+      words[i] = rng();
+    }
+  } else {
+    memset(buf, options_.pattern == kOnes ? '1' : 0, options_.chunk_size);
+  }
+
+  AsyncIOQueue queue(options_.depth);
+  if (!queue.Init()) {
+    free(buf);
+    return false;
+  }
+  std::vector<Slot> slots(options_.depth);
+  std::vector<io_event> events(options_.depth);
+  auto write_f = zbd_->GetWriteFD();
+
+  // Submit the next write of the slot's zone, moving on to the next target
+  // once the zone is done. A slot without a zone is idle for good
+  auto issue = [&](Slot *slot) {
+    while (true) {
+      if (slot->zone && slot->left == 0) {
+        slot->zone->CheckRelease();
+        slot->zone = nullptr;
+      }
+      if (!slot->zone) {
+        auto i = next_++;
+        if (i >= targets_.size()) {
+          return true;
+        }
+        slot->zone = targets_[i].zone;
+        slot->left = targets_[i].bytes;
+        slot->zone->LoopForAcquire();
+        continue;
+      }
+      uint64_t offset;
+      slot->size = std::min(options_.chunk_size, slot->left);
+      if (!slot->zone->Reserve(slot->size, &offset) ||
+          !queue.SubmitWrite(write_f, buf, slot->size, offset, slot)) {
+        slot->size = 0;
+        return false;
+      }
+      slot->left -= slot->size;
+      return true;
+    }
+  };
+
+  bool ok = true;
+  for (auto &slot : slots) {
+    if (!issue(&slot)) {
+      ok = false;
+      break;
+    }
+  }
+  while (queue.InFlight() > 0) {
+    int n = queue.Reap(1, events.size(), events.data());
+    if (n < 0) {
+      ok = false;
+      break;
+    }
+    for (int i = 0; i < n; ++i) {
+      auto slot = static_cast<Slot *>(events[i].data);
+      if (static_cast<int64_t>(events[i].res) !=
+          static_cast<int64_t>(slot->size)) {
+        printf("[Precondition] Write to zone %lu failed: %ld\n",
+               slot->zone->GetZoneNr(), static_cast<int64_t>(events[i].res));
+        ok = false;
+      } else {
+        bytes_ += slot->size;
+      }
+      if (ok && !issue(slot)) {
+        ok = false;
+      }
+    }
+  }
+
+  // Zones left behind by an error
+  for (auto &slot : slots) {
+    if (slot.zone) {
+      slot.zone->CheckRelease();
+    }
+  }
+  free(buf);
+  return ok;
+}
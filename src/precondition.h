@@ -0,0 +1,72 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "zbd_fs.h"
+
+// Bring a device into a known state before a measurement, so results do not
+// depend on whatever the last run left on the drive. Every zone is reset,
+// then a fraction of the zones is written: most of them up to their
+// capacity, some only partially, the rest stays empty.
+//
+// Zones are written by several threads. Each thread keeps up to `depth`
+// zones in flight with one outstanding write per zone, which saturates the
+// device while every zone is still written strictly sequentially.
+class Preconditioner {
+public:
+  enum Pattern { kZero, kOnes, kRandom };
+
+  struct Options {
+    double fill = 1.0;     // fraction of zones that are written
+    double partial = 0.0;  // fraction of the written zones left partial
+    Pattern pattern = kOnes;
+    uint64_t chunk_size = 1024 * 1024;
+    uint32_t depth = 32;  // writes in flight per thread
+    uint32_t threads = 4;
+    uint64_t seed = 0;
+  };
+
+  struct Stats {
+    uint64_t zones_full = 0;
+    uint64_t zones_partial = 0;
+    uint64_t zones_empty = 0;
+    uint64_t resets = 0;
+    uint64_t bytes = 0;
+    uint64_t reset_micros = 0;
+    uint64_t fill_micros = 0;
+
+    std::string ToString() const;
+  };
+
+  // "zero", "ones" or "random". Return false for unknown names
+  static bool ParsePattern(const std::string &name, Pattern *pattern);
+
+  Preconditioner(ZonedBlockDevice *zbd, const Options &options);
+
+  // Reset and fill the zones. The zones must not be in use. Return false on
+  // I/O error
+  bool Run();
+
+  const Stats &GetStats() const { return stats_; }
+
+private:
+  struct Target {
+    Zone *zone;
+    uint64_t bytes;
+  };
+
+  bool ResetZones();
+  bool FillZones();
+  // Write the targets handed out by `next_` until none is left
+  bool FillWorker(uint64_t id);
+
+  ZonedBlockDevice *zbd_;
+  Options options_;
+  std::vector<Target> targets_;
+  std::atomic<uint64_t> next_;
+  std::atomic<uint64_t> bytes_;
+  Stats stats_;
+};
@@ -0,0 +1,185 @@
+#include "qos_scheduler.h"
+
+#include <algorithm>
+
+QosScheduler::QosScheduler(const Options &options) : options_(options) {
+  if (options_.depth == 0) {
+    options_.depth = 1;
+  }
+  auto now = Clock::now();
+  classes_.resize(options_.classes.size());
+  for (size_t i = 0; i < classes_.size(); ++i) {
+    auto &c = classes_[i];
+    c.options = options_.classes[i];
+    c.options.weight = std::max<uint32_t>(c.options.weight, 1);
+    c.options.burst = std::max<uint64_t>(c.options.burst, 1);
+    c.tokens = c.options.burst;
+    c.refilled = now;
+  }
+}
+
+void QosScheduler::Refill(Class *c, Clock::time_point now) {
+  if (c->options.rate == 0 || now <= c->refilled) {
+    return;
+  }
+  double elapsed = std::chrono::duration<double>(now - c->refilled).count();
+  c->tokens = std::min<double>(c->tokens + elapsed * c->options.rate,
+                               c->options.burst);
+  c->refilled = now;
+}
+
+bool QosScheduler::Admit(const Class &c, uint64_t bytes,
+                         Clock::time_point now,
+                         Clock::time_point *wake) const {
+  if (c.options.rate == 0) {
+    return true;
+  }
+  // An I/O larger than the burst goes once the bucket is full and leaves it
+  // in debt, so that the cap holds over time
+  double need = std::min(bytes, c.options.burst);
+  if (c.tokens >= need) {
+    return true;
+  }
+  auto ready = now + std::chrono::duration_cast<Clock::duration>(
+                         std::chrono::duration<double>(
+                             (need - c.tokens) / c.options.rate));
+  *wake = std::min(*wake, ready);
+  return false;
+}
+
+QosScheduler::Clock::time_point QosScheduler::Dispatch() {
+  auto now = Clock::now();
+  for (auto &c : classes_) {
+    Refill(&c, now);
+  }
+
+  while (in_flight_ < options_.depth) {
+    Ticket *next = nullptr;
+    Ticket *throttled = nullptr;
+    auto wake = Clock::time_point::max();
+
+    // With read priority the appends are only looked at if no read can go,
+    // unless the reads had their burst
+    int first = kRead;
+    if (options_.read_burst && reads_in_row_ >= options_.read_burst) {
+      first = kAppend;
+    }
+    for (int pass = 0; pass < 2 && !next; ++pass) {
+      for (auto &c : classes_) {
+        for (int kind = 0; kind < kNumKinds; ++kind) {
+          if (options_.read_priority && kind != (first + pass) % kNumKinds) {
+            continue;
+          }
+          if (c.queues[kind].empty()) {
+            continue;
+          }
+          auto head = c.queues[kind].front();
+          auto before = wake;
+          if (!Admit(c, head->bytes_, now, &wake)) {
+            if (!head->throttled_) {
+              head->throttled_ = true;
+              c.stats.throttled++;
+            }
+            if (wake < before) {
+              throttled = head;
+            }
+            continue;
+          }
+          if (!next || head->start_tag_ < next->start_tag_ ||
+              (head->start_tag_ == next->start_tag_ &&
+               head->finish_tag_ < next->finish_tag_)) {
+            next = head;
+          }
+        }
+      }
+      if (!options_.read_priority) {
+        break;
+      }
+    }
+
+    if (!next) {
+      if (throttled) {
+        throttled->cv_.notify_one();
+      }
+      return wake;
+    }
+
+    auto &c = classes_[next->cls_];
+    c.queues[next->kind_].pop_front();
+    if (c.options.rate) {
+      c.tokens -= next->bytes_;
+    }
+    vtime_ = next->start_tag_;
+    in_flight_++;
+    reads_in_row_ = next->kind_ == kRead ? reads_in_row_ + 1 : 0;
+
+    uint64_t wait = std::chrono::duration_cast<std::chrono::microseconds>(
+                        now - next->queued_)
+                        .count();
+    c.stats.ops++;
+    c.stats.bytes += next->bytes_;
+    c.stats.wait_micros += wait;
+    c.stats.max_wait_micros = std::max(c.stats.max_wait_micros, wait);
+
+    next->granted_ = true;
+    next->cv_.notify_one();
+  }
+  // Every slot is taken, the next Release() dispatches again
+  return Clock::time_point::max();
+}
+
+void QosScheduler::Acquire(Ticket *ticket) {
+  std::unique_lock<std::mutex> lck(mtx_);
+  auto &c = classes_[ticket->cls_];
+
+  // Start-time fair queueing: an I/O starts at the virtual time, or where
+  // the previous I/O of its class ends if that is later, and takes its size
+  // over the weight of the class
+  ticket->start_tag_ = std::max(vtime_, c.last_finish);
+  ticket->finish_tag_ =
+      ticket->start_tag_ + (double)ticket->bytes_ / c.options.weight;
+  c.last_finish = ticket->finish_tag_;
+  ticket->queued_ = Clock::now();
+  c.queues[ticket->kind_].push_back(ticket);
+
+  while (!ticket->granted_) {
+    auto wake = Dispatch();
+    if (ticket->granted_) {
+      break;
+    }
+    if (wake == Clock::time_point::max()) {
+      ticket->cv_.wait(lck);
+    } else {
+      ticket->cv_.wait_until(lck, wake);
+    }
+  }
+}
+
+void QosScheduler::Release(Ticket *) {
+  std::lock_guard<std::mutex> lck(mtx_);
+  in_flight_--;
+  Dispatch();
+}
+
+bool QosScheduler::Read(uint32_t cls, Zone *zone, char *buf, uint32_t size,
+                        uint64_t offset, bool *hit) {
+  Ticket ticket(cls, kRead, size);
+  Acquire(&ticket);
+  bool ok = zone->Read(buf, size, offset, hit);
+  Release(&ticket);
+  return ok;
+}
+
+bool QosScheduler::Append(uint32_t cls, Zone *zone, char *data,
+                          uint32_t size) {
+  Ticket ticket(cls, kAppend, size);
+  Acquire(&ticket);
+  bool ok = zone->Append(data, size);
+  Release(&ticket);
+  return ok;
+}
+
+QosScheduler::Stats QosScheduler::GetStats(uint32_t cls) {
+  std::lock_guard<std::mutex> lck(mtx_);
+  return classes_[cls].stats;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "zbd_fs.h"
+
+// Host-side admission stage in front of the device for I/O of several
+// tenant classes. A caller queues its I/O in its class, waits until the
+// scheduler hands it one of `depth` dispatch slots and then issues the I/O
+// itself, so buffers never change threads and nothing but the wait is
+// added to the path. There is no scheduler thread: whoever queues or
+// finishes an I/O dispatches what fits into the free slots.
+//
+// Which I/O goes next:
+//  - reads before appends, if read_priority is set, so that a queue of
+//    appends never sits in front of a read. After read_burst reads in a
+//    row a waiting append goes first, appends are delayed but not starved
+//  - among the queued I/O of one kind, weighted fair queueing across the
+//    classes: start-time fair queueing with byte sized tags, so a class
+//    gets slots in proportion to its weight for as long as it has I/O
+//    queued, in bytes rather than in operations
+//  - a class with a bandwidth cap is skipped while its token bucket is
+//    short of the I/O at its head, and caught up at the refill time
+class QosScheduler {
+public:
+  enum IoKind { kRead, kAppend, kNumKinds };
+
+  struct ClassOptions {
+    std::string name;
+    uint32_t weight = 1;
+    // Bytes per second, 0 for no cap, and the most the bucket holds
+    uint64_t rate = 0;
+    uint64_t burst = 1 << 20;
+  };
+
+  struct Options {
+    // I/Os in flight at the device at most
+    uint32_t depth = 8;
+    bool read_priority = true;
+    // 0 for strict priority
+    uint32_t read_burst = 8;
+    std::vector<ClassOptions> classes;
+  };
+
+  struct Stats {
+    uint64_t ops = 0;
+    uint64_t bytes = 0;
+    // Time between queueing and dispatch
+    uint64_t wait_micros = 0;
+    uint64_t max_wait_micros = 0;
+    // Dispatches held back by the token bucket
+    uint64_t throttled = 0;
+  };
+
+  explicit QosScheduler(const Options &options);
+
+  QosScheduler(const QosScheduler &) = delete;
+  QosScheduler &operator=(const QosScheduler &) = delete;
+
+  // One I/O between Acquire() and Release(), on the stack of its caller
+  class Ticket {
+  public:
+    Ticket(uint32_t cls, IoKind kind, uint64_t bytes)
+        : cls_(cls), kind_(kind), bytes_(bytes) {}
+
+  private:
+    friend class QosScheduler;
+
+    uint32_t cls_;
+    IoKind kind_;
+    uint64_t bytes_;
+    double start_tag_ = 0;
+    double finish_tag_ = 0;
+    bool granted_ = false;
+    bool throttled_ = false;
+    std::chrono::steady_clock::time_point queued_;
+    std::condition_variable cv_;
+  };
+
+  // Wait for a dispatch slot for `ticket`, give it back once the I/O is done
+  void Acquire(Ticket *ticket);
+  void Release(Ticket *ticket);
+
+  // Zone::Read() and Zone::Append() through the scheduler
+  bool Read(uint32_t cls, Zone *zone, char *buf, uint32_t size,
+            uint64_t offset, bool *hit);
+  bool Append(uint32_t cls, Zone *zone, char *data, uint32_t size);
+
+  uint32_t NrClasses() const { return classes_.size(); }
+  const ClassOptions &GetClass(uint32_t cls) const {
+    return classes_[cls].options;
+  }
+  Stats GetStats(uint32_t cls);
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Class {
+    ClassOptions options;
+    // Finish tag of the last I/O queued
+    double last_finish = 0;
+    double tokens = 0;
+    Clock::time_point refilled;
+    std::deque<Ticket *> queues[kNumKinds];
+    Stats stats;
+  };
+
+  void Refill(Class *c, Clock::time_point now);
+  // Whether the token bucket of `c` lets its head I/O of `bytes` go. If
+  // not, `wake` moves up to when it will
+  bool Admit(const Class &c, uint64_t bytes, Clock::time_point now,
+             Clock::time_point *wake) const;
+  // Hand out free slots. Return when a throttled class can go next,
+  // Clock::time_point::max() if none is waiting for tokens, and wake the
+  // owner of its I/O so that someone waits for that time
+  Clock::time_point Dispatch();
+
+  Options options_;
+  std::mutex mtx_;
+  std::vector<Class> classes_;
+  uint32_t in_flight_ = 0;
+  // Start tag of the I/O dispatched last
+  double vtime_ = 0;
+  // Reads dispatched since the last append
+  uint32_t reads_in_row_ = 0;
+};
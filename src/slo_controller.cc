@@ -0,0 +1,70 @@
+#include "slo_controller.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+
+std::string SloController::Result::ToString() const {
+  if (!found) {
+    return "[Sustained: none]";
+  }
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "[Sustained QD: %u][Intervals: %u][IOPS: %.0f]"
+           "[Throughput: %.1fMiB/s][P99: %.1fus]",
+           depth, intervals, iops, ToMiB(throughput), p99);
+  return buf;
+}
+
+SloController::SloController(const Options &options)
+    : options_(options),
+      depth_(std::max<uint32_t>(options.min_depth, 1)) {
+  options_.max_depth = std::max(options_.max_depth, depth_);
+}
+
+uint32_t SloController::Update(uint64_t micros, uint64_t bytes,
+                               const HistogramStat &latency) {
+  double p99 = latency.Percentile(99);
+  bool met = latency.num() > 0 && p99 <= options_.target_p99_us;
+  trace_.push_back({micros, depth_, latency.num(), bytes, p99, met});
+
+  auto &level = levels_[depth_];
+  if (!level.latency) {
+    level.latency = std::make_unique<HistogramStat>();
+  }
+  level.intervals++;
+  level.micros += micros;
+  level.bytes += bytes;
+  level.latency->Merge(latency);
+
+  if (met) {
+    depth_ = std::min(depth_ + options_.increase, options_.max_depth);
+  } else {
+    depth_ = std::max<uint32_t>(depth_ * options_.decrease,
+                                std::max<uint32_t>(options_.min_depth, 1));
+  }
+  return depth_;
+}
+
+SloController::Result SloController::Sustained() const {
+  Result best;
+  for (auto &[depth, level] : levels_) {
+    if (level.intervals < options_.min_intervals || level.micros == 0) {
+      continue;
+    }
+    double p99 = level.latency->Percentile(99);
+    if (p99 > options_.target_p99_us) {
+      continue;
+    }
+    double throughput = level.bytes * 1e6 / level.micros;
+    if (!best.found || throughput > best.throughput) {
+      best.found = true;
+      best.depth = depth;
+      best.intervals = level.intervals;
+      best.iops = level.latency->num() * 1e6 / level.micros;
+      best.throughput = throughput;
+      best.p99 = p99;
+    }
+  }
+  return best;
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+
+// Closed-loop search for the largest number of requests in flight that still
+// meets a p99 latency target. The caller runs its I/O at Depth() and hands
+// in the latencies of every interval; AIMD then raises the depth by a fixed
+// step while the interval p99 meets the target and cuts it by a factor as
+// soon as it does not. Since the depth oscillates around the knee, every
+// depth it visits is accounted separately, and the result is the depth with
+// the highest throughput whose merged p99 met the target over enough
+// intervals.
+class SloController {
+public:
+  struct Options {
+    uint64_t target_p99_us = 500;
+    uint32_t min_depth = 1;
+    uint32_t max_depth = 64;
+    uint32_t increase = 1;   // added after an interval that met the target
+    double decrease = 0.5;   // factor applied after one that did not
+    // Intervals a depth needs before it counts as sustained
+    uint32_t min_intervals = 3;
+  };
+
+  // One interval of the convergence trace
+  struct Sample {
+    uint64_t micros;
+    uint32_t depth;
+    uint64_t ops;
+    uint64_t bytes;
+    double p99;
+    bool met;
+  };
+
+  // The best depth found, `found` is false if no depth met the target
+  struct Result {
+    bool found = false;
+    uint32_t depth = 0;
+    uint32_t intervals = 0;
+    double iops = 0;
+    double throughput = 0;  // bytes per second
+    double p99 = 0;
+
+    std::string ToString() const;
+  };
+
+  explicit SloController(const Options &options);
+
+  uint32_t Depth() const { return depth_; }
+
+  // Account an interval of `micros` run at Depth() that moved `bytes` with
+  // the given per-request latencies, and return the depth of the next one
+  uint32_t Update(uint64_t micros, uint64_t bytes,
+                  const HistogramStat &latency);
+
+  Result Sustained() const;
+  const std::vector<Sample> &Trace() const { return trace_; }
+  const Options &GetOptions() const { return options_; }
+
+private:
+  struct Level {
+    uint32_t intervals = 0;
+    uint64_t micros = 0;
+    uint64_t bytes = 0;
+    std::unique_ptr<HistogramStat> latency;
+  };
+
+  Options options_;
+  uint32_t depth_;
+  std::map<uint32_t, Level> levels_;
+  std::vector<Sample> trace_;
+};
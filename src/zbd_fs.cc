@@ -1,4 +1,8 @@
 #include "zbd_fs.h"
+#include "block_cache.h"
+#include "histogram.h"
+#include "zone_journal.h"
+#include "zone_stats.h"
 
 #include <assert.h>
 #include <errno.h>
@@ -8,8 +12,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <cstdlib>
 #include <fstream>
@@ -17,18 +24,51 @@
 #include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
-Zone::Zone(ZonedBlockDevice *zbd, struct zbd_zone *z)
-    : zbd_(zbd),
-      busy_(false),
-      start_(zbd_zone_start(z)),
-      max_capacity_(zbd_zone_capacity(z)),
-      wp_(zbd_zone_wp(z))
-      {
+namespace {
+// Split [0, n) into at most `threads` ranges and run `fn(begin, end)` on
+// each of them in its own thread
+template <typename Fn>
+void ParallelFor(uint64_t n, uint32_t threads, Fn fn) {
+  // Not worth a thread for less than this many zones
+  const uint64_t kMinPerThread = 256;
+  if (threads == 0) {
+    threads = std::min(std::thread::hardware_concurrency(), 16U);
+  }
+  uint64_t nr = std::max<uint64_t>(
+      std::min<uint64_t>(threads, n / kMinPerThread), 1);
+  uint64_t per = (n + nr - 1) / nr;
+
+  std::vector<std::thread> workers;
+  for (uint64_t begin = per; begin < n; begin += per) {
+    workers.emplace_back(fn, begin, std::min(begin + per, n));
+  }
+  fn(0, std::min(per, n));
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+} // namespace
+
+Zone::Zone(ZonedBlockDevice *zbd, struct zbd_zone *z) : Zone() {
+  Init(zbd, z);
+}
+
+void Zone::Init(ZonedBlockDevice *zbd, struct zbd_zone *z) {
+  zbd_ = zbd;
+  // Open() closes the zones a previous user left open
+  open_ = false;
+  finished_ = zbd_zone_full(z);
+  start_ = zbd_zone_start(z);
+  max_capacity_ = zbd_zone_capacity(z);
+  wp_ = zbd_zone_wp(z);
   used_capacity_ = 0;
+  generation_ = 0;
+  owner_ = kNoOwner;
   capacity_ = 0;
   if (!(zbd_zone_full(z) || zbd_zone_offline(z) || zbd_zone_rdonly(z)))
     capacity_ = zbd_zone_capacity(z) - (zbd_zone_wp(z) - zbd_zone_start(z));
@@ -37,9 +77,32 @@ Zone::Zone(ZonedBlockDevice *zbd, struct zbd_zone *z)
 bool Zone::IsUsed() { return (used_capacity_ > 0); }
 uint64_t Zone::GetCapacityLeft() { return capacity_; }
 bool Zone::IsFull() { return (capacity_ == 0); }
-bool Zone::IsEmpty() { return (wp_ == start_); }
+bool Zone::IsEmpty() { return wp_ == start_ && !finished_; }
 uint64_t Zone::GetZoneNr() { return start_ / zbd_->GetZoneSize(); }
 
+void Zone::AccountWrite(bool was_empty) {
+  if (was_empty) {
+    zbd_->active_io_zones_++;
+  }
+  if (!open_) {
+    open_ = true;
+    zbd_->open_io_zones_++;
+  }
+  if (capacity_ == 0) {
+    AccountInactive(true);
+  }
+}
+
+void Zone::AccountInactive(bool was_active) {
+  if (was_active) {
+    zbd_->active_io_zones_--;
+  }
+  if (open_) {
+    open_ = false;
+    zbd_->open_io_zones_--;
+  }
+}
+
 bool Zone::Reset() {
   size_t zone_sz = zbd_->GetZoneSize();
   unsigned int report = 1;
@@ -49,10 +112,20 @@ bool Zone::Reset() {
   assert(!IsUsed());
   assert(IsBusy());
 
+  // Journaled as open first: should the reset not be journaled in the
+  // end, replay still finds the zone empty, under its new generation
+  auto journal = zbd_->GetJournal();
+  if (journal && !journal->LogOpen(this, true)) {
+    return false;
+  }
+
+  bool was_active = IsActive();
   ret = zbd_reset_zones(zbd_->GetWriteFD(), start_, zone_sz);
   if (ret) {
     return false;
   }
+  AccountInactive(was_active);
+  generation_++;
 
   ret = zbd_report_zones(zbd_->GetReadFD(), start_, zone_sz, ZBD_RO_ALL, &z,
                          &report);
@@ -67,6 +140,21 @@ bool Zone::Reset() {
     max_capacity_ = capacity_ = zbd_zone_capacity(&z);
 
   wp_ = start_;
+  finished_ = false;
+  // Nothing below the write pointer is read, but the old data would stay
+  // cached until memory pressure evicts it
+  if (zbd_->GetReadPath() != ReadPath::kDirect) {
+    zbd_->DropCache(start_, zone_sz);
+  }
+  if (zbd_->GetBlockCache()) {
+    zbd_->GetBlockCache()->InvalidateZone(GetZoneNr());
+  }
+  if (zbd_->GetZoneStats()) {
+    zbd_->GetZoneStats()->AddReset(GetZoneNr());
+  }
+  if (journal) {
+    journal->Log(this);
+  }
 
   return true;
 }
@@ -78,13 +166,24 @@ bool Zone::Finish() {
 
   assert(IsBusy());
 
+  bool was_active = IsActive();
   ret = zbd_finish_zones(fd, start_, zone_sz);
   if (ret) {
     return false;
   }
+  AccountInactive(was_active);
+  zbd_->finishes_++;
+  zbd_->finish_waste_ += capacity_;
+  if (zbd_->GetZoneStats()) {
+    zbd_->GetZoneStats()->AddFinish(GetZoneNr());
+  }
 
+  // wp_ stays at the end of the written data, readers go up to it
+  finished_ = true;
   capacity_ = 0;
-  wp_ = start_ + zone_sz;
+  if (zbd_->GetJournal()) {
+    zbd_->GetJournal()->Log(this);
+  }
 
   return true;
 }
@@ -101,6 +200,11 @@ bool Zone::Close() {
     if (ret) {
       return false;
     }
+    if (open_) {
+      open_ = false;
+      zbd_->open_io_zones_--;
+      zbd_->closes_++;
+    }
   }
 
   return true;
@@ -119,6 +223,15 @@ bool Zone::Append(char *data, uint32_t size) {
 
   assert((size % zbd_->GetBlockSize()) == 0);
 
+  bool was_empty = IsEmpty();
+  // Replay must ask the device for the write pointer of a written zone
+  auto journal = zbd_->GetJournal();
+  if (was_empty && journal && !journal->LogOpen(this)) {
+    return false;
+  }
+  auto zone_stats = zbd_->GetZoneStats();
+  auto start = zone_stats ? std::chrono::steady_clock::now()
+                          : std::chrono::steady_clock::time_point();
   // errno = 75, "Value too large for defined data type"
   while (left) {
     ret = pwrite(fd, ptr, left, wp_);
@@ -135,7 +248,85 @@ bool Zone::Append(char *data, uint32_t size) {
 
     assert(wp_ <= start_ + max_capacity_);
   }
+  AccountWrite(was_empty);
+  if (zone_stats) {
+    zone_stats->AddWrite(GetZoneNr(), size, MicrosSince(start));
+  }
+  if (journal && capacity_ == 0) {
+    journal->Log(this);
+  }
 
+  auto threshold = zbd_->GetFinishThreshold();
+  if (threshold && capacity_ > 0 &&
+      capacity_ * 100 < max_capacity_ * threshold && !Finish()) {
+    // The data is on the device either way, the zone just stays open
+    zbd_->finish_failures_++;
+  }
+  return true;
+}
+
+bool Zone::Read(char *buf, uint32_t size, uint64_t offset, bool *hit,
+                bool written) {
+  auto cache = zbd_->GetBlockCache();
+  // Blocks beyond the write pointer will still be written, never cache them
+  bool cacheable = cache && size == cache->BlockSize() &&
+                   (written || offset + size <= wp_);
+  uint32_t gen = 0;
+
+  *hit = false;
+  if (cacheable && cache->Lookup(offset, buf, &gen)) {
+    *hit = true;
+    return true;
+  }
+
+  auto zone_stats = zbd_->GetZoneStats();
+  auto start = zone_stats ? std::chrono::steady_clock::now()
+                          : std::chrono::steady_clock::time_point();
+  if (!zbd_->ReadAt(buf, size, offset)) {
+    return false;
+  }
+  if (zone_stats) {
+    zone_stats->AddRead(GetZoneNr(), size, MicrosSince(start));
+  }
+  if (cacheable) {
+    cache->Insert(offset, buf, gen);
+  }
+  return true;
+}
+
+bool Zone::Reserve(uint32_t size, uint64_t *offset) {
+  if (capacity_ < size) {
+    return false;
+  }
+  assert((size % zbd_->GetBlockSize()) == 0);
+
+  bool was_empty = IsEmpty();
+  auto journal = zbd_->GetJournal();
+  if (was_empty && journal && !journal->LogOpen(this)) {
+    return false;
+  }
+  *offset = wp_;
+  wp_ += size;
+  capacity_ -= size;
+  AccountWrite(was_empty);
+  if (zbd_->GetZoneStats()) {
+    zbd_->GetZoneStats()->AddWriteBytes(GetZoneNr(), size);
+  }
+  if (journal && capacity_ == 0) {
+    journal->Log(this);
+  }
+  return true;
+}
+
+bool Zone::ReportWritePointer(uint64_t *wp) {
+  unsigned int report = 1;
+  struct zbd_zone z;
+  int ret = zbd_report_zones(zbd_->GetReadFD(), start_, zbd_->GetZoneSize(),
+                             ZBD_RO_ALL, &z, &report);
+  if (ret || (report != 1)) {
+    return false;
+  }
+  *wp = zbd_zone_wp(&z);
   return true;
 }
 
@@ -148,16 +339,24 @@ bool Zone::CheckRelease() {
   return true;
 }
 
+ZonedBlockDevice::ZonedBlockDevice(const std::string &bdevname)
+    : filename_(bdevname) {}
+
+ZonedBlockDevice::~ZonedBlockDevice() {
+  journal_.reset();
+  Unmap();
+  for (int fd : {read_f_, read_direct_f_, write_f_}) {
+    if (fd >= 0) {
+      zbd_close(fd);
+    }
+  }
+}
+
 bool ZonedBlockDevice::Open(bool readonly, bool exclusive) {
-  struct zbd_zone *zone_rep;
-  unsigned int reported_zones;
-  uint64_t addr_space_sz;
+  auto open_start = std::chrono::steady_clock::now();
   zbd_info info;
-  uint64_t i = 0;
-  uint64_t m = 0;
   // Reserve one zone for metadata and another one for extent migration
   int reserved_zones = 2;
-  int ret;
 
   if (!readonly && !exclusive)
     return false;
@@ -202,6 +401,7 @@ bool ZonedBlockDevice::Open(bool readonly, bool exclusive) {
   // xzw: we limit the total zones here to 500
   // info.nr_zones = 500;
   block_sz_ = info.pblock_size;
+  lblock_sz_ = info.lblock_size;
   zone_sz_ = info.zone_size;
   nr_zones_ = info.nr_zones;
 
@@ -220,71 +420,663 @@ bool ZonedBlockDevice::Open(bool readonly, bool exclusive) {
   else
     max_nr_open_io_zones_ = info.max_nr_open_zones - reserved_zones;
 
-  addr_space_sz = (uint64_t)nr_zones_ * zone_sz_;
+  active_io_zones_ = 0;
+  open_io_zones_ = 0;
+  reported_zones_ = 0;
+
+  // The journal needs a device it can write to
+  bool journal = use_journal_ && !readonly;
+  if (!(journal && replay_journal_ && LoadZones(readonly)) &&
+      !ScanZones(readonly)) {
+    return false;
+  }
+
+  start_time_ = time(NULL);
+  open_micros_ = std::chrono::duration_cast<std::chrono::microseconds>(
+                     std::chrono::steady_clock::now() - open_start)
+                     .count();
+
+  return true;
+}
 
-  ret = zbd_list_zones(read_f_, 0, addr_space_sz, ZBD_RO_ALL, &zone_rep,
-                       &reported_zones);
+bool ZonedBlockDevice::ScanZones(bool readonly) {
+  // Whatever a failed LoadZones() counted
+  active_io_zones_ = 0;
 
-  if (ret || reported_zones != nr_zones_) {
+  // Report the zones in parallel ranges straight into one array
+  std::vector<struct zbd_zone> report(nr_zones_);
+  std::atomic_bool ok(true);
+  ParallelFor(nr_zones_, open_threads_, [&](uint64_t begin, uint64_t end) {
+    unsigned int reported = end - begin;
+    int ret = zbd_report_zones(read_f_, begin * zone_sz_,
+                               (end - begin) * zone_sz_, ZBD_RO_ALL,
+                               &report[begin], &reported);
+    if (ret || reported != end - begin) {
+      ok = false;
+    }
+  });
+  if (!ok) {
     printf("Failed to list zones\n");
     return false;
   }
 
-  active_io_zones_ = 0;
-  open_io_zones_ = 0;
+  reported_zones_ += nr_zones_;
 
-  for (; i < reported_zones; i++) {
-    struct zbd_zone *z = &zone_rep[i];
-    /* Only use sequential write required zones */
-    if (zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR) {
-      if (!zbd_zone_offline(z)) {
-        Zone *newZone = new Zone(this, z);
-        if (!newZone->Acquire()) {
-          assert(false);
-          return false;
+  /* Only use sequential write required zones */
+  std::vector<uint32_t> io_idx;
+  struct zbd_zone meta[2];
+  uint32_t nr_meta = 0;
+  bool journal = use_journal_ && !readonly;
+  for (uint32_t i = 0; i < nr_zones_; i++) {
+    struct zbd_zone *z = &report[i];
+    if (zbd_zone_type(z) == ZBD_ZONE_TYPE_SWR && !zbd_zone_offline(z)) {
+      // The same two zones FindMetaZones() picks
+      if (journal && nr_meta < 2) {
+        meta[nr_meta++] = *z;
+        continue;
+      }
+      io_idx.push_back(i);
+    }
+  }
+  if (journal && nr_meta < 2) {
+    printf("No zones left for the zone journal\n");
+    return false;
+  }
+  std::vector<Zone> zones(io_idx.size());
+  io_zones_.swap(zones);
+
+  // Fill in the zone table in parallel. Zones left open by a previous user
+  // are closed with one command per run of adjacent open zones. Init() stays
+  // eager: it only copies the report entry, which had to be read anyway, and
+  // callers use the public wp_ and start_ of any zone without a hook that
+  // could initialize it on first use
+  ParallelFor(io_idx.size(), open_threads_, [&](uint64_t begin, uint64_t end) {
+    uint64_t run_start = 0, run_len = 0;
+    auto close_run = [&]() {
+      if (run_len && zbd_close_zones(write_f_, run_start * zone_sz_,
+                                     run_len * zone_sz_)) {
+        ok = false;
+      }
+      run_len = 0;
+    };
+
+    for (uint64_t i = begin; i < end; i++) {
+      struct zbd_zone *z = &report[io_idx[i]];
+      io_zones_[i].Init(this, z);
+      if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z) || zbd_zone_closed(z)) {
+        active_io_zones_++;
+      }
+      if (readonly || !(zbd_zone_imp_open(z) || zbd_zone_exp_open(z))) {
+        continue;
+      }
+      if (run_len && run_start + run_len == io_idx[i]) {
+        run_len++;
+      } else {
+        close_run();
+        run_start = io_idx[i];
+        run_len = 1;
+      }
+    }
+    close_run();
+  });
+  if (!ok) {
+    printf("Failed to close open zones\n");
+    return false;
+  }
+
+  if (journal) {
+    CreateJournal(meta);
+    if (!journal_->Start(true)) {
+      printf("Failed to start the zone journal\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+void ZonedBlockDevice::CreateJournal(const struct zbd_zone *meta) {
+  ZoneJournal::Options options;
+  if (journal_snapshot_records_) {
+    options.snapshot_records = journal_snapshot_records_;
+  }
+  journal_.reset(new ZoneJournal(this, meta, options));
+}
+
+bool ZonedBlockDevice::FindMetaZones(struct zbd_zone *meta) {
+  // Report a few zones at a time from the start of the device
+  const uint32_t kBatch = 16;
+  struct zbd_zone report[kBatch];
+  uint32_t found = 0;
+  for (uint32_t begin = 0; begin < nr_zones_ && found < 2; begin += kBatch) {
+    unsigned int nr = std::min(kBatch, nr_zones_ - begin);
+    if (zbd_report_zones(read_f_, (uint64_t)begin * zone_sz_,
+                         (uint64_t)nr * zone_sz_, ZBD_RO_ALL, report, &nr)) {
+      return false;
+    }
+    reported_zones_ += nr;
+    for (uint32_t i = 0; i < nr && found < 2; ++i) {
+      if (zbd_zone_type(&report[i]) == ZBD_ZONE_TYPE_SWR &&
+          !zbd_zone_offline(&report[i])) {
+        meta[found++] = report[i];
+      }
+    }
+  }
+  return found == 2;
+}
+
+bool ZonedBlockDevice::LoadZones(bool readonly) {
+  struct zbd_zone meta[2];
+  if (!FindMetaZones(meta)) {
+    return false;
+  }
+  CreateJournal(meta);
+  std::vector<ZoneJournal::Entry> table;
+  if (!journal_->Replay(&table)) {
+    printf("No zone journal on %s, scanning the zones\n", filename_.c_str());
+    journal_.reset();
+    reported_zones_ = 0;
+    return false;
+  }
+
+  std::vector<Zone> zones(table.size());
+  io_zones_.swap(zones);
+
+  // Empty and full zones are taken from the journal as they are. The write
+  // pointer of an open one may have moved since, so those are reported and
+  // closed like ScanZones() does
+  std::atomic_bool ok(true);
+  std::atomic<uint64_t> reported(0);
+  ParallelFor(table.size(), open_threads_, [&](uint64_t begin, uint64_t end) {
+    for (uint64_t i = begin; i < end; i++) {
+      auto &entry = table[i];
+      struct zbd_zone z = {};
+      z.start = (uint64_t)entry.zone_nr * zone_sz_;
+      z.len = zone_sz_;
+      z.capacity = entry.capacity;
+      z.wp = z.start + entry.wp;
+      z.type = ZBD_ZONE_TYPE_SWR;
+      z.cond = entry.state == ZoneJournal::kFull ? ZBD_ZONE_COND_FULL
+                                                 : ZBD_ZONE_COND_EMPTY;
+      if (entry.state == ZoneJournal::kOpen) {
+        unsigned int nr = 1;
+        if (zbd_report_zones(read_f_, z.start, zone_sz_, ZBD_RO_ALL, &z,
+                             &nr) ||
+            nr != 1) {
+          ok = false;
+          continue;
         }
-        io_zones_.emplace_back(newZone);
-        if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z) ||
-            zbd_zone_closed(z)) {
+        reported++;
+        if (zbd_zone_imp_open(&z) || zbd_zone_exp_open(&z) ||
+            zbd_zone_closed(&z)) {
           active_io_zones_++;
-          if (zbd_zone_imp_open(z) || zbd_zone_exp_open(z)) {
-            if (!readonly) {
-              newZone->Close();
-            }
-          }
         }
-        auto status = newZone->CheckRelease();
-        if (!status)
-          return status;
+        if (!readonly && (zbd_zone_imp_open(&z) || zbd_zone_exp_open(&z)) &&
+            zbd_close_zones(write_f_, z.start, zone_sz_)) {
+          ok = false;
+        }
       }
+      auto &zone = io_zones_[i];
+      zone.Init(this, &z);
+      zone.used_capacity_ = entry.valid;
+      zone.generation_ = entry.generation;
+      zone.owner_ = entry.owner;
     }
+  });
+  reported_zones_ += reported;
+  if (!ok) {
+    printf("Failed to check the open zones of the journal\n");
+    return false;
   }
 
-  free(zone_rep);
-  start_time_ = time(NULL);
-
+  // Continue in the other metadata zone from a snapshot of the checked
+  // table, past whatever torn tail the replayed zone has
+  if (!journal_->Start(false)) {
+    printf("Failed to start the zone journal\n");
+    return false;
+  }
   return true;
 }
 
+Zone *ZonedBlockDevice::AcquireEmptyZone() {
+  for (auto &zone : io_zones_) {
+    if (!zone.IsBusy() && zone.IsEmpty() && zone.Acquire()) {
+      // Someone may have written it between the check and the acquire
+      if (zone.IsEmpty()) {
+        return &zone;
+      }
+      zone.CheckRelease();
+    }
+  }
+  return nullptr;
+}
+
+Zone *ZonedBlockDevice::AcquireLeastUsedZone() {
+  while (true) {
+    Zone *least = nullptr;
+    for (auto &zone : io_zones_) {
+      if (zone.IsBusy() || zone.IsEmpty()) {
+        continue;
+      }
+      if (!least || zone.used_capacity_ < least->used_capacity_) {
+        least = &zone;
+      }
+    }
+    if (!least || least->Acquire()) {
+      return least;
+    }
+  }
+}
+
 bool ZonedBlockDevice::CheckScheduler() {
+  auto scheduler = GetScheduler();
+  if (scheduler == "mq-deadline") {
+    return true;
+  }
+  if (host_sequencing_ && scheduler == "none") {
+    return true;
+  }
+  printf("Unsupported I/O scheduler [%s] of %s\n", scheduler.c_str(),
+         filename_.c_str());
+  return false;
+}
+
+namespace {
+// Attribute `name` of the request queue of the device
+std::string QueuePath(const std::string &filename, const std::string &name) {
   std::ostringstream path;
-  std::string s = filename_;
-  std::fstream f;
+  // Remove "/dev/" from /dev/nvmeXnY
+  path << "/sys/block/" << filename.substr(filename.rfind('/') + 1)
+       << "/queue/" << name;
+  return path.str();
+}
+} // namespace
 
-  s.erase(0, 5);  // Remove "/dev/" from /dev/nvmeXnY
-  path << "/sys/block/" << s << "/queue/scheduler";
-  f.open(path.str(), std::fstream::in);
+std::string ZonedBlockDevice::GetScheduler() {
+  std::fstream f;
+  f.open(QueuePath(filename_, "scheduler"), std::fstream::in);
   if (!f.is_open()) {
-    return false;
+    return "";
   }
 
+  // The active one is in brackets, e.g. "[mq-deadline] kyber none"
   std::string buf;
   getline(f, buf);
-  if (buf.find("[mq-deadline]") == std::string::npos) {
-    f.close();
+  auto begin = buf.find('[');
+  auto end = buf.find(']');
+  if (begin == std::string::npos || end == std::string::npos || end < begin) {
+    return "";
+  }
+  return buf.substr(begin + 1, end - begin - 1);
+}
+
+bool ZonedBlockDevice::SetScheduler(const std::string &name) {
+  if (name != "mq-deadline" && !(host_sequencing_ && name == "none")) {
+    return false;
+  }
+  std::fstream f;
+  f.open(QueuePath(filename_, "scheduler"), std::fstream::out);
+  if (!f.is_open()) {
     return false;
   }
+  f << name;
+  f.close();
+  return GetScheduler() == name;
+}
 
+bool ZonedBlockDevice::ParseReadPath(const std::string &name,
+                                     ReadPath *path) {
+  if (name == "direct") {
+    *path = ReadPath::kDirect;
+  } else if (name == "buffered") {
+    *path = ReadPath::kBuffered;
+  } else if (name == "mmap") {
+    *path = ReadPath::kMmap;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool ZonedBlockDevice::ParseReadAdvice(const std::string &name,
+                                       ReadAdvice *advice) {
+  if (name == "normal") {
+    *advice = ReadAdvice::kNormal;
+  } else if (name == "random") {
+    *advice = ReadAdvice::kRandom;
+  } else if (name == "sequential") {
+    *advice = ReadAdvice::kSequential;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *ZonedBlockDevice::ReadPathName(ReadPath path) {
+  switch (path) {
+  case ReadPath::kDirect:
+    return "direct";
+  case ReadPath::kBuffered:
+    return "buffered";
+  case ReadPath::kMmap:
+    return "mmap";
+  }
+  return "unknown";
+}
+
+bool ZonedBlockDevice::SetReadPath(ReadPath path, ReadAdvice advice) {
+  if (path == ReadPath::kMmap && !map_) {
+    auto size = (uint64_t)nr_zones_ * zone_sz_;
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, read_f_, 0);
+    if (map == MAP_FAILED) {
+      printf("Failed to map %s: %s\n", filename_.c_str(), strerror(errno));
+      return false;
+    }
+    map_ = static_cast<char *>(map);
+    map_size_ = size;
+  } else if (path != ReadPath::kMmap) {
+    Unmap();
+  }
+  read_path_ = path;
+  read_advice_ = advice;
+  return Advise();
+}
+
+bool ZonedBlockDevice::Advise() {
+  static const int fadvice[] = {POSIX_FADV_NORMAL, POSIX_FADV_RANDOM,
+                                POSIX_FADV_SEQUENTIAL};
+  static const int madvice[] = {MADV_NORMAL, MADV_RANDOM, MADV_SEQUENTIAL};
+  auto i = static_cast<int>(read_advice_);
+  switch (read_path_) {
+  case ReadPath::kDirect:
+    return true;
+  case ReadPath::kBuffered:
+    // Sets the readahead of the descriptor: off for random, twice the
+    // device window for sequential
+    return posix_fadvise(read_f_, 0, 0, fadvice[i]) == 0;
+  case ReadPath::kMmap:
+    return madvise(map_, map_size_, madvice[i]) == 0;
+  }
+  return false;
+}
+
+void ZonedBlockDevice::Unmap() {
+  if (map_) {
+    munmap(map_, map_size_);
+    map_ = nullptr;
+    map_size_ = 0;
+  }
+}
+
+bool ZonedBlockDevice::ReadAt(char *buf, uint64_t size, uint64_t offset) {
+  switch (read_path_) {
+  case ReadPath::kMmap:
+    if (offset + size > map_size_) {
+      return false;
+    }
+    memcpy(buf, map_ + offset, size);
+    return true;
+  case ReadPath::kBuffered:
+    return pread(read_f_, buf, size, offset) == (ssize_t)size;
+  case ReadPath::kDirect:
+    break;
+  }
+  return pread(read_direct_f_, buf, size, offset) == (ssize_t)size;
+}
+
+bool ZonedBlockDevice::DropCache(uint64_t offset, uint64_t len) {
+  if (len == 0) {
+    offset = 0;
+    len = (uint64_t)nr_zones_ * zone_sz_;
+  }
+  bool ok = true;
+  // The page cache keeps pages that are still mapped, unmap them first
+  if (map_ && madvise(map_ + offset, len, MADV_DONTNEED)) {
+    ok = false;
+  }
+  if (posix_fadvise(read_f_, offset, len, POSIX_FADV_DONTNEED)) {
+    ok = false;
+  }
+  return ok;
+}
+
+int64_t ZonedBlockDevice::GetReadAheadKB() {
+  std::ifstream f(QueuePath(filename_, "read_ahead_kb"));
+  int64_t kb = -1;
+  if (!(f >> kb)) {
+    return -1;
+  }
+  return kb;
+}
+
+bool ZonedBlockDevice::SetReadAheadKB(uint64_t kb) {
+  std::ofstream f(QueuePath(filename_, "read_ahead_kb"));
+  if (!f.is_open()) {
+    return false;
+  }
+  f << kb;
   f.close();
+  return GetReadAheadKB() == (int64_t)kb;
+}
+
+AsyncIOQueue::~AsyncIOQueue() {
+  if (ctx_) {
+    io_destroy(ctx_);
+  }
+}
+
+bool AsyncIOQueue::Init() {
+  cbs_.resize(depth_);
+  submitted_.resize(depth_);
+  free_.clear();
+  for (auto &cb : cbs_) {
+    free_.push_back(&cb);
+  }
+  ctx_ = nullptr;
+  return io_setup(depth_, &ctx_) == 0;
+}
+
+bool AsyncIOQueue::SubmitRead(int fd, char *buf, size_t sz, uint64_t off,
+                              void *data) {
+  if (free_.empty()) {
+    return false;
+  }
+  iocb *cb = free_.back();
+  io_prep_pread(cb, fd, buf, sz, off);
+  cb->data = data;
+  return Submit(cb);
+}
+
+bool AsyncIOQueue::SubmitWrite(int fd, char *buf, size_t sz, uint64_t off,
+                               void *data) {
+  if (free_.empty()) {
+    return false;
+  }
+  iocb *cb = free_.back();
+  io_prep_pwrite(cb, fd, buf, sz, off);
+  cb->data = data;
+  return Submit(cb);
+}
+
+bool AsyncIOQueue::Submit(iocb *cb) {
+  if (!phase_stats_) {
+    if (io_submit(ctx_, 1, &cb) != 1) {
+      return false;
+    }
+    free_.pop_back();
+    return true;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  EndCompletion(start);
+  if (io_submit(ctx_, 1, &cb) != 1) {
+    return false;
+  }
+  auto end = std::chrono::steady_clock::now();
+  phase_stats_->AddLatency(kSubmit, MicrosBetween(start, end));
+  submitted_[cb - cbs_.data()] = end;
+  free_.pop_back();
   return true;
 }
+
+void AsyncIOQueue::EndCompletion(TimePoint now) {
+  if (completing_) {
+    phase_stats_->AddLatency(kComplete, MicrosBetween(reaped_, now));
+    completing_ = false;
+  }
+}
+
+int AsyncIOQueue::Reap(int min_nr, int max_nr, io_event *events) {
+  if (phase_stats_) {
+    EndCompletion(std::chrono::steady_clock::now());
+  }
+  int ret;
+  do {
+    ret = io_getevents(ctx_, min_nr, max_nr, events, nullptr);
+  } while (ret == -EINTR);
+  if (ret < 0) {
+    return -1;
+  }
+  if (phase_stats_ && ret > 0) {
+    reaped_ = std::chrono::steady_clock::now();
+    completing_ = true;
+    for (int i = 0; i < ret; ++i) {
+      phase_stats_->AddLatency(
+          kDevice, MicrosBetween(submitted_[events[i].obj - cbs_.data()],
+                                 reaped_));
+    }
+  }
+  for (int i = 0; i < ret; ++i) {
+    free_.push_back(events[i].obj);
+  }
+  return ret;
+}
+
+ZoneStreamReader::ZoneStreamReader(ZonedBlockDevice *zbd,
+                                   std::vector<Zone *> zones,
+                                   uint64_t chunk_sz, uint32_t depth)
+    : zbd_(zbd), zones_(std::move(zones)), chunk_sz_(chunk_sz),
+      queue_(depth), slots_(depth), events_(depth) {}
+
+ZoneStreamReader::~ZoneStreamReader() {
+  // The consumer may stop early, drain the outstanding reads before the
+  // buffers go away
+  while (queue_.InFlight() > 0) {
+    if (queue_.Reap(1, events_.size(), events_.data()) < 0) {
+      break;
+    }
+  }
+  for (auto &slot : slots_) {
+    free(slot.buf);
+  }
+}
+
+bool ZoneStreamReader::Init() {
+  assert(chunk_sz_ > 0 && (chunk_sz_ % zbd_->GetBlockSize()) == 0);
+  for (auto &slot : slots_) {
+    if (posix_memalign((void **)&slot.buf, sysconf(_SC_PAGESIZE), chunk_sz_)) {
+      return false;
+    }
+  }
+  if (!queue_.Init()) {
+    return false;
+  }
+
+  for (auto &slot : slots_) {
+    if (!Refill(&slot)) {
+      break;
+    }
+    issued_++;
+  }
+  return !error_;
+}
+
+bool ZoneStreamReader::Refill(Slot *slot) {
+  while (zone_idx_ < zones_.size()) {
+    Zone *zone = zones_[zone_idx_];
+    uint64_t pos = zone->start_ + zone_off_;
+    // Everything behind the write pointer is readable
+    uint64_t end = zone->wp_;
+    if (pos >= end) {
+      zone_idx_++;
+      zone_off_ = 0;
+      continue;
+    }
+
+    slot->zone = zone;
+    slot->offset = pos;
+    slot->size = std::min(chunk_sz_, end - pos);
+    slot->done = false;
+    if (!queue_.SubmitRead(zbd_->GetReadDirectFD(), slot->buf, slot->size,
+                           slot->offset, slot)) {
+      error_ = true;
+      return false;
+    }
+    zone_off_ += slot->size;
+    return true;
+  }
+  return false;
+}
+
+bool ZoneStreamReader::WaitHead() {
+  while (!slots_[head_].done) {
+    int n = queue_.Reap(1, events_.size(), events_.data());
+    if (n < 0) {
+      error_ = true;
+      return false;
+    }
+    for (int i = 0; i < n; ++i) {
+      auto slot = static_cast<Slot *>(events_[i].data);
+      if (static_cast<int64_t>(events_[i].res) !=
+          static_cast<int64_t>(slot->size)) {
+        printf("[ZoneStreamReader] Read at %lu failed: %ld\n", slot->offset,
+               static_cast<int64_t>(events_[i].res));
+        error_ = true;
+      }
+      slot->done = true;
+    }
+  }
+  return !error_;
+}
+
+bool ZoneStreamReader::Next(Chunk *chunk) {
+  if (error_) {
+    return false;
+  }
+
+  // The consumer is done with the previous chunk, reuse its buffer for the
+  // next read of the stream
+  if (yielded_) {
+    Slot *prev = &slots_[head_];
+    yielded_ = false;
+    issued_--;
+    head_ = (head_ + 1) % slots_.size();
+    if (Refill(prev)) {
+      issued_++;
+    } else if (error_) {
+      return false;
+    }
+  }
+
+  if (issued_ == 0 || !WaitHead()) {
+    return false;
+  }
+
+  const Slot &slot = slots_[head_];
+  chunk->zone = slot.zone;
+  chunk->offset = slot.offset;
+  chunk->size = slot.size;
+  chunk->data = slot.buf;
+  bytes_read_ += slot.size;
+  yielded_ = true;
+  return true;
+}
+
+bool ZoneStreamReader::ForEach(const Consumer &consumer) {
+  Chunk chunk;
+  while (Next(&chunk)) {
+    if (!consumer(chunk)) {
+      break;
+    }
+  }
+  return !error_;
+}
@@ -1,41 +1,125 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <memory>
 #include <cstring>
 #include <cassert>
+#include <functional>
 
 #include <libaio.h>
 
 class Zone;
 class ZonedBlockDevice;
+class BlockCache;
+class ZoneStats;
+class ZoneJournal;
+class Statistics;
 
-class Zone {
-  ZonedBlockDevice *zbd_;
+constexpr size_t kCacheLineSize = 64;
+
+inline uint64_t MicrosBetween(std::chrono::steady_clock::time_point start,
+                              std::chrono::steady_clock::time_point end) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+      .count();
+}
+
+inline uint64_t MicrosSince(std::chrono::steady_clock::time_point start) {
+  return MicrosBetween(start, std::chrono::steady_clock::now());
+}
+
+// How Zone::Read() and ZonedBlockDevice::ReadAt() reach the device
+enum class ReadPath {
+  kDirect,    // pread() of the O_DIRECT descriptor
+  kBuffered,  // pread() through the page cache, with kernel readahead
+  kMmap,      // copy out of a shared read-only mapping of the device
+};
+
+// Access pattern hint of the buffered and mmap paths, passed on as
+// posix_fadvise(2) and madvise(2) advice
+enum class ReadAdvice { kNormal, kRandom, kSequential };
+
+// Each zone owns a full cache line. Zones sit next to each other in the zone
+// table and are usually owned by different threads, so the Acquire() CAS and
+// the write pointer updates of one zone must not invalidate the line of its
+// neighbours.
+class alignas(kCacheLineSize) Zone {
   std::atomic_bool busy_;
+  // Opened by a write and not closed, finished or filled since. Only
+  // changed by the owner of the zone
+  bool open_;
+  // Full on the device, by writes or a finish, since the last reset. A zone
+  // finished while empty keeps wp_ at start_ but is not empty
+  bool finished_;
+  ZonedBlockDevice *zbd_;
+
+  // Keep the active and open zone counts of the device in step with a
+  // write of the zone, and with the zone leaving the active state
+  void AccountWrite(bool was_empty);
+  void AccountInactive(bool was_active);
 
 public:
+  // Owner of a zone nobody has claimed
+  static constexpr uint32_t kNoOwner = UINT32_MAX;
+
+  Zone()
+      : busy_(false), open_(false), finished_(false), zbd_(nullptr), wp_(0),
+        capacity_(0), used_capacity_(0), start_(0), max_capacity_(0),
+        generation_(0), owner_(kNoOwner) {}
   explicit Zone(ZonedBlockDevice *zbd, struct zbd_zone *z);
 
-  uint64_t start_;
-  uint64_t capacity_; /* remaining capacity */
-  uint64_t max_capacity_;
+  Zone(const Zone &) = delete;
+  Zone &operator=(const Zone &) = delete;
+
+  // Set up the zone from its report entry
+  void Init(ZonedBlockDevice *zbd, struct zbd_zone *z);
+
+  // Updated by every write
   uint64_t wp_;
+  uint64_t capacity_; /* remaining capacity */
   std::atomic<uint64_t> used_capacity_;
+  // Fixed between resets
+  uint64_t start_;
+  uint64_t max_capacity_;
+  // Bumped by every reset. Like the owner, only kept across restarts by
+  // the zone journal of the device
+  uint32_t generation_;
+  uint32_t owner_;
 
   bool Reset();
   bool Finish();
   bool Close();
 
+  // Once the capacity left drops below the finish threshold of the device
+  // the zone is finished, giving up the rest of it. A failed finish does
+  // not fail the write, it is counted in GetFinishFailures()
   bool Append(char *data, uint32_t size);
+  // Read `size` bytes at device offset `offset` of this zone, through the
+  // block cache of the device if it has one. `hit` tells whether the data
+  // came from the cache. `written` vouches that the range is below the
+  // write pointer, which is then not read, for a caller racing an appender
+  bool Read(char *buf, uint32_t size, uint64_t offset, bool *hit,
+            bool written = false);
+  // Reserve `size` bytes at the write pointer for a write the caller issues
+  // itself, e.g. asynchronously. Return false if the zone cannot fit it
+  bool Reserve(uint32_t size, uint64_t *offset);
+  // Ask the device for the write pointer of the zone. wp_ moves as soon as
+  // a write is reserved, this is where the device has actually written up to
+  bool ReportWritePointer(uint64_t *wp);
 
   bool IsUsed();
   bool IsFull();
   bool IsEmpty();
+  // Written but neither full nor finished, the zone holds an active zone
+  // resource of the device
+  bool IsActive() { return !IsEmpty() && capacity_ > 0; }
+  bool IsOpen() const { return open_; }
   uint64_t GetZoneNr();
   uint64_t GetCapacityLeft();
+  ZonedBlockDevice *GetDevice() const { return zbd_; }
   bool IsBusy() const { return this->busy_.load(std::memory_order_relaxed); }
   bool Acquire() {
     bool expected = false;
@@ -56,32 +140,95 @@ public:
   bool CheckRelease();
 };
 
+static_assert(sizeof(Zone) == kCacheLineSize, "Zone must fill one cache line");
+
 class ZonedBlockDevice {
 public:
   std::string filename_;
   uint32_t block_sz_;
+  uint32_t lblock_sz_;
   uint64_t zone_sz_;
   uint32_t nr_zones_;
-  std::vector<std::shared_ptr<Zone>> io_zones_;
-  int read_f_;
-  int read_direct_f_;
-  int write_f_;
+  // All usable zones in one contiguous table, sized once by Open()
+  std::vector<Zone> io_zones_;
+  int read_f_ = -1;
+  int read_direct_f_ = -1;
+  int write_f_ = -1;
   time_t start_time_;
+  // Percent of the zone capacity below which Append() finishes a zone, 0
+  // never finishes early
   uint32_t finish_threshold_ = 0;
+  // Optional DRAM cache in front of zone reads
+  BlockCache *cache_ = nullptr;
+  // Optional per-zone counters, updated by the zones themselves
+  ZoneStats *zone_stats_ = nullptr;
+  // Where reads go, kDirect unless SetReadPath() says otherwise
+  ReadPath read_path_ = ReadPath::kDirect;
+  ReadAdvice read_advice_ = ReadAdvice::kNormal;
+  // The whole device, mapped for ReadPath::kMmap
+  char *map_ = nullptr;
+  uint64_t map_size_ = 0;
+  // Optional journal of the zone table in the first two sequential zones
+  std::unique_ptr<ZoneJournal> journal_;
+  bool use_journal_ = false;
+  bool replay_journal_ = false;
+  uint64_t journal_snapshot_records_ = 0;
+  // Threads used to report and set up zones in Open(), 0 picks a default
+  uint32_t open_threads_ = 0;
+  uint64_t open_micros_ = 0;
+  // Zones Open() asked the device about
+  uint64_t reported_zones_ = 0;
+  // Writers keep their writes to a zone in order on the host, so the device
+  // does not need the zone write locking of mq-deadline
+  bool host_sequencing_ = false;
 
-  std::atomic<long> active_io_zones_;
-  std::atomic<long> open_io_zones_;
+  // Kept up to date by the zones as they are written, closed, finished and
+  // reset
+  std::atomic<long> active_io_zones_{0};
+  std::atomic<long> open_io_zones_{0};
+  std::atomic<uint64_t> finishes_{0};
+  // Early finishes of Append() that failed
+  std::atomic<uint64_t> finish_failures_{0};
+  std::atomic<uint64_t> closes_{0};
+  // Capacity given up by finishing zones before they were full
+  std::atomic<uint64_t> finish_waste_{0};
 
   unsigned int max_nr_active_io_zones_;
   unsigned int max_nr_open_io_zones_;
 
 
 public:
-  ZonedBlockDevice(const std::string &bdevname) : filename_(bdevname) {}
-  ~ZonedBlockDevice() = default;
+  explicit ZonedBlockDevice(const std::string &bdevname);
+  // Journal records that are not synced are lost, as in a crash
+  ~ZonedBlockDevice();
 
   bool Open(bool readonly, bool exclusive);
+  // mq-deadline is required, unless host sequencing allows none as well
   bool CheckScheduler();
+  // Active I/O scheduler from sysfs, empty if it cannot be read
+  std::string GetScheduler();
+  bool SetScheduler(const std::string &name);
+
+  // "direct", "buffered" or "mmap", and "normal", "random" or "sequential".
+  // Return false for unknown names
+  static bool ParseReadPath(const std::string &name, ReadPath *path);
+  static bool ParseReadAdvice(const std::string &name, ReadAdvice *advice);
+  static const char *ReadPathName(ReadPath path);
+
+  // Switch the path of every later read, mapping the device for kMmap.
+  // Not safe while reads are in flight
+  bool SetReadPath(ReadPath path, ReadAdvice advice = ReadAdvice::kNormal);
+  ReadPath GetReadPath() { return read_path_; }
+  // Read `size` bytes at device offset `offset` through the read path
+  bool ReadAt(char *buf, uint64_t size, uint64_t offset);
+  // Evict [offset, offset + len) of the device from the page cache, and
+  // from the mapping of the mmap path. `len` 0 is the whole device. Direct
+  // reads never see the page cache, but it may hold pages of an earlier
+  // path
+  bool DropCache(uint64_t offset = 0, uint64_t len = 0);
+  // Readahead window of the device from sysfs, -1 if it cannot be read
+  int64_t GetReadAheadKB();
+  bool SetReadAheadKB(uint64_t kb);
 
   int GetReadFD() { return read_f_; }
   int GetReadDirectFD() { return read_direct_f_; }
@@ -89,9 +236,62 @@ public:
 
   uint64_t GetZoneSize() { return zone_sz_; }
   uint32_t GetNrZones() { return nr_zones_; }
+  size_t GetNrIOZones() { return io_zones_.size(); }
+  Zone *GetIOZone(size_t idx) { return &io_zones_[idx]; }
+
+  // Scans over the zone table, touching one cache line per zone. Both
+  // return the acquired zone, nullptr if none is available
+  Zone *AcquireEmptyZone();
+  Zone *AcquireLeastUsedZone();
+
+  void SetOpenThreads(uint32_t threads) { open_threads_ = threads; }
+  // Must be set before Open()
+  void SetHostSequencing(bool on) { host_sequencing_ = on; }
+  void SetFinishThreshold(uint32_t percent) { finish_threshold_ = percent; }
+  uint32_t GetFinishThreshold() { return finish_threshold_; }
+
+  long GetActiveZones() { return active_io_zones_.load(); }
+  long GetOpenZones() { return open_io_zones_.load(); }
+  unsigned int GetMaxActiveZones() { return max_nr_active_io_zones_; }
+  unsigned int GetMaxOpenZones() { return max_nr_open_io_zones_; }
+  uint64_t GetFinishes() { return finishes_.load(); }
+  uint64_t GetFinishFailures() { return finish_failures_.load(); }
+  uint64_t GetCloses() { return closes_.load(); }
+  uint64_t GetFinishWaste() { return finish_waste_.load(); }
+  void SetBlockCache(BlockCache *cache) { cache_ = cache; }
+  BlockCache *GetBlockCache() { return cache_; }
+  void SetZoneStats(ZoneStats *stats) { zone_stats_ = stats; }
+  ZoneStats *GetZoneStats() { return zone_stats_; }
+  // Keep the first two sequential zones for a ZoneJournal that snapshots
+  // the table every `snapshot_records` records, 0 for the default. With
+  // `replay` Open() loads the zone table from the journal, and only scans
+  // the device if there is none; otherwise it scans and starts a new
+  // journal. Must be set before a writable Open()
+  void EnableJournal(bool replay, uint64_t snapshot_records) {
+    use_journal_ = true;
+    replay_journal_ = replay;
+    journal_snapshot_records_ = snapshot_records;
+  }
+  ZoneJournal *GetJournal() { return journal_.get(); }
+  // Time Open() took, in microseconds
+  uint64_t GetOpenMicros() { return open_micros_; }
+  uint64_t GetReportedZones() { return reported_zones_; }
 
   std::string GetFilename() { return filename_; }
   uint32_t GetBlockSize() { return block_sz_; }
+  // Logical block size, the unit of LBAs in NVMe commands
+  uint32_t GetLogicalBlockSize() { return lblock_sz_; }
+
+private:
+  // Build the zone table from a report of every zone
+  bool ScanZones(bool readonly);
+  // Build the zone table from the journal, false if it has none
+  bool LoadZones(bool readonly);
+  // Report entries of the two zones the journal lives in
+  bool FindMetaZones(struct zbd_zone *meta);
+  void CreateJournal(const struct zbd_zone *meta);
+  bool Advise();
+  void Unmap();
 };
 
 // A wrapper for Linux AsyncIO, note that this struct only supports one
@@ -147,3 +347,127 @@ struct AsyncIORequest {
 
   bool IsPending() const { return pending_async; }
 };
+
+// A fixed-depth queue of Linux AsyncIO requests. Unlike AsyncIORequest, the
+// io context is set up once and reused by every request issued through the
+// queue, so callers can keep up to Depth() requests in flight.
+class AsyncIOQueue {
+public:
+  explicit AsyncIOQueue(uint32_t depth) : depth_(depth) {}
+  ~AsyncIOQueue();
+
+  AsyncIOQueue(const AsyncIOQueue &) = delete;
+  AsyncIOQueue &operator=(const AsyncIOQueue &) = delete;
+
+  // Set up the io context. Return false if any error happens
+  bool Init();
+
+  // Submit a read or write command; `data` is handed back in the completion
+  // event. Return false if the queue is full or io_submit fails
+  bool SubmitRead(int fd, char *buf, size_t sz, uint64_t off, void *data);
+  bool SubmitWrite(int fd, char *buf, size_t sz, uint64_t off, void *data);
+
+  // Wait for at least `min_nr` completions and store at most `max_nr` of
+  // them in `events`. Return the number of reaped events or -1 on error
+  int Reap(int min_nr, int max_nr, io_event *events);
+
+  uint32_t Depth() const { return depth_; }
+  uint32_t InFlight() const { return depth_ - free_.size(); }
+
+  // Split the latency of every request into the time spent in io_submit
+  // (kSubmit), from then until io_getevents hands it back (kDevice), and
+  // the time the caller spends on a reaped batch before its next call into
+  // the queue (kComplete, one sample per batch). libaio has no kernel
+  // completion timestamp, so interrupt and wakeup delay count as kDevice.
+  // nullptr, the default, skips the clock reads
+  void SetPhaseStats(Statistics *stats) { phase_stats_ = stats; }
+
+private:
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  bool Submit(iocb *cb);
+  // Close the completion phase of the last reaped batch, if still open
+  void EndCompletion(TimePoint now);
+
+  uint32_t depth_;
+  io_context_t ctx_ = nullptr;
+  std::vector<iocb> cbs_;
+  std::vector<iocb *> free_;
+
+  Statistics *phase_stats_ = nullptr;
+  // When io_submit returned, indexed like cbs_
+  std::vector<TimePoint> submitted_;
+  TimePoint reaped_;
+  bool completing_ = false;
+};
+
+// Stream the written part of a list of zones in fixed-size chunks, keeping
+// up to `depth` reads in flight while the consumer processes the data that
+// has already arrived. Each zone is read from its start up to its write
+// pointer; chunks are yielded in device order.
+class ZoneStreamReader {
+public:
+  struct Chunk {
+    Zone *zone;
+    uint64_t offset;  // device offset of the first byte
+    uint64_t size;
+    const char *data;
+  };
+
+  // Return false to stop the stream early
+  using Consumer = std::function<bool(const Chunk &)>;
+
+  ZoneStreamReader(ZonedBlockDevice *zbd, std::vector<Zone *> zones,
+                   uint64_t chunk_sz, uint32_t depth);
+  ~ZoneStreamReader();
+
+  ZoneStreamReader(const ZoneStreamReader &) = delete;
+  ZoneStreamReader &operator=(const ZoneStreamReader &) = delete;
+
+  // Allocate the buffers and issue the first `depth` reads
+  bool Init();
+
+  // Fetch the next ready chunk. The chunk stays valid until the next call.
+  // Return false once the stream is exhausted or an error happened
+  bool Next(Chunk *chunk);
+
+  // Feed every chunk to `consumer`. Return false on I/O error
+  bool ForEach(const Consumer &consumer);
+
+  bool HasError() const { return error_; }
+  uint64_t BytesRead() const { return bytes_read_; }
+
+  // See AsyncIOQueue::SetPhaseStats()
+  void SetPhaseStats(Statistics *stats) { queue_.SetPhaseStats(stats); }
+
+private:
+  struct Slot {
+    char *buf = nullptr;
+    Zone *zone = nullptr;
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    bool done = false;
+  };
+
+  // Issue the next read of the stream into `slot`. Return false if there is
+  // nothing left to read or the submission fails
+  bool Refill(Slot *slot);
+  bool WaitHead();
+
+  ZonedBlockDevice *zbd_;
+  std::vector<Zone *> zones_;
+  uint64_t chunk_sz_;
+  AsyncIOQueue queue_;
+
+  std::vector<Slot> slots_;
+  std::vector<io_event> events_;
+  uint32_t head_ = 0;       // slot of the next chunk to yield
+  uint32_t issued_ = 0;     // slots that hold an outstanding or ready read
+  bool yielded_ = false;    // the head slot has been handed to the consumer
+
+  size_t zone_idx_ = 0;     // read cursor
+  uint64_t zone_off_ = 0;
+
+  uint64_t bytes_read_ = 0;
+  bool error_ = false;
+};
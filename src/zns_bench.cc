@@ -1,17 +1,206 @@
 #include "gflags/gflags.h"
+#include "bench_util.h"
+#include "block_cache.h"
+#include "distribution.h"
 #include "histogram.h"
+#include "json_writer.h"
+#include "object_store.h"
+#include "placement.h"
+#include "precondition.h"
+#include "qos_scheduler.h"
+#include "slo_controller.h"
 #include "zbd_fs.h"
+#include "zone_copy.h"
+#include "zone_group.h"
+#include "zone_lifecycle.h"
+#include "zone_daemon.h"
+#include "zone_journal.h"
+#include "zone_sequencer.h"
+#include "zone_stats.h"
 
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <ctime>
+#include <deque>
+#include <fstream>
 #include <cstdlib>
+#include <mutex>
+#include <random>
+#include <sstream>
 #include <thread>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 DEFINE_string(bench, "writeseq", "Write-Read patterns for this benchmark");
 DEFINE_uint64(bs, 4096, "request size for each read-write operation");
 DEFINE_uint64(threads, 1, "Number of threads to issue request");
-DEFINE_uint64(duration, 60, "Seconds to run this bench");
-DEFINE_string(dev, "", "The ZNS device to read and write");
+DEFINE_uint64(duration, 60, "Seconds to run this bench, 0 for no time limit");
+DEFINE_uint64(ops, 0,
+              "Operations to issue, split evenly between threads. The run "
+              "ends at whichever of --duration, --ops and --bytes comes "
+              "first; 0 turns a limit off");
+DEFINE_uint64(bytes, 0,
+              "Bytes to move, rounded up to --bs and split evenly between "
+              "threads. Only completed I/Os count towards --ops and --bytes");
+DEFINE_bool(tsc, true,
+            "Time operations with the invariant TSC if the CPU has one, "
+            "steady_clock otherwise");
+DEFINE_string(dev, "",
+              "The ZNS device to read and write. The stripe bench takes a "
+              "comma separated list of devices");
+DEFINE_bool(cpu_stats, true,
+            "Collect per-thread cycles, instructions, context switches and "
+            "user/sys time");
+DEFINE_uint64(report_interval, 0,
+              "Seconds between interval reports, 0 to disable");
+DEFINE_uint64(zones, 64,
+              "Number of zones used by the lifetime, daemon, readpath and qos "
+              "benches, split evenly between threads or clients. 0 means all "
+              "zones");
+DEFINE_string(lifetime_dist, "exp",
+              "Object lifetime distribution: uniform, exp or bimodal");
+DEFINE_uint64(lifetime_mean, 0,
+              "Mean object lifetime in object writes. 0 derives it from "
+              "--utilization");
+DEFINE_double(utilization, 0.7,
+              "Target fraction of valid data when --lifetime_mean=0");
+DEFINE_double(hot_ratio, 0.8,
+              "Fraction of short-lived objects of the bimodal distribution");
+DEFINE_uint64(open_zones, 1, "Zones written concurrently by each writer");
+DEFINE_string(placement, "random",
+              "Zone placement policy: random, roundrobin or hint. The "
+              "placement bench compares all of them");
+DEFINE_uint64(gc_free_zones, 2,
+              "Collect garbage once fewer zones than this are free");
+DEFINE_uint64(stripe_size, 0,
+              "Stripe unit of the stripe and parity benches. 0 splits each "
+              "request evenly over the devices, or the data zones");
+DEFINE_uint64(parity_k, 4,
+              "Data zones of every parity group of the parity bench, which "
+              "adds one parity zone. --bs is rounded to a multiple of this "
+              "many stripe units");
+DEFINE_string(read_dist, "uniform",
+              "Distribution of random reads over all blocks: uniform or zipf");
+DEFINE_double(zipf_theta, 0.99,
+              "Skew of the zipf read distribution, within (0, 1)");
+DEFINE_uint64(cache_size, 0,
+              "Bytes of DRAM block cache in front of reads, 0 to disable. "
+              "The cache block size is --bs");
+DEFINE_string(cache_policy, "lru", "Block cache replacement: lru or clock");
+DEFINE_uint64(cache_shards, 16, "Lock shards of the block cache");
+DEFINE_uint64(open_threads, 0,
+              "Threads used to set up the zone table when opening a device, "
+              "0 picks a default");
+DEFINE_uint64(copy_chunk, 1024 * 1024, "Chunk size of the zone copy engine");
+DEFINE_uint64(copy_depth, 4, "Chunks the zone copy engine keeps in flight");
+DEFINE_bool(simple_copy, true,
+            "Offload zone copies with NVMe Simple Copy when supported");
+DEFINE_bool(io_phases, false,
+            "Split the latency of the async I/O of zonecopy and stripe into "
+            "submit, device and completion histograms");
+DEFINE_uint64(writers, 1,
+              "Writer threads of the rwmix bench, the other threads read");
+DEFINE_string(read_placement, "same,disjoint,finished",
+              "Comma separated zones the rwmix readers target, each run for "
+              "--duration: same (zones being written), disjoint (zones no "
+              "writer touches) or finished (zones the writers just filled)");
+DEFINE_uint64(rw_fill_zones, 4,
+              "Zones filled up front for the disjoint readers of rwmix");
+DEFINE_uint64(qd, 8,
+              "Writes in flight per zone of the zoneqd bench, kept in order "
+              "by the host");
+DEFINE_string(schedulers, "mq-deadline,none",
+              "Comma separated I/O schedulers the zoneqd bench runs under, "
+              "each for --duration");
+DEFINE_uint64(slo_p99_us, 500,
+              "P99 read latency target of the slo bench, which searches for "
+              "the queue depth with the most throughput that meets it");
+DEFINE_uint64(slo_interval_ms, 500,
+              "Length of the intervals the slo bench adjusts its queue depth "
+              "after");
+DEFINE_uint64(slo_max_qd, 64, "Largest queue depth the slo bench tries");
+DEFINE_uint64(slo_min_intervals, 3,
+              "Intervals a queue depth must run before it counts as "
+              "sustained");
+DEFINE_uint64(streams, 32,
+              "Write streams of the zonefinish bench, split evenly between "
+              "threads. Each stream writes its own zone");
+DEFINE_string(finish_thresholds, "0,5,10,20",
+              "Comma separated finish thresholds, in percent of the zone "
+              "capacity, the zonefinish bench runs with, each for --duration");
+DEFINE_uint64(idle_close_ms, 0,
+              "Only close open zones idle for this long to make room for "
+              "another one, 0 closes the least recently written");
+DEFINE_bool(precondition, false,
+            "Reset every zone and fill --precondition_fill of them before "
+            "the measurement starts");
+DEFINE_double(precondition_fill, 1.0, "Fraction of zones to write");
+DEFINE_double(precondition_partial, 0.0,
+              "Fraction of the written zones to leave partially written");
+DEFINE_string(precondition_pattern, "ones",
+              "Data written by the precondition phase: zero, ones or random");
+DEFINE_uint64(precondition_bs, 1024 * 1024,
+              "Write size of the precondition phase");
+DEFINE_uint64(precondition_depth, 32,
+              "Writes in flight per precondition thread, one per zone");
+DEFINE_uint64(precondition_threads, 4, "Threads filling zones in parallel");
+DEFINE_uint64(clients, 4,
+              "Clients of the daemon bench, threads on the device and then "
+              "processes served by a zone daemon");
+DEFINE_string(shm_name, "/zns_bench",
+              "Shared memory region of the zone daemon, for the daemon, "
+              "serve and client benches");
+DEFINE_uint64(daemon_workers, 2, "Threads of the zone daemon");
+DEFINE_uint64(client_read_pct, 50,
+              "Percent of the operations of a daemon client that read back "
+              "a block it wrote");
+DEFINE_uint64(journal_snapshot_records, 64 * 1024,
+              "Zone journal records between two snapshots of the restart "
+              "bench, each one rolls the journal over to the other "
+              "metadata zone");
+DEFINE_bool(journal_crash, false,
+            "Have the restart bench drop the journal records that are not "
+            "on the device yet instead of syncing them, as a crash would");
+DEFINE_string(read_paths, "direct,buffered,mmap",
+              "Read paths the readpath bench runs, in order: direct, "
+              "buffered and mmap");
+DEFINE_string(read_advice, "normal",
+              "Access hint of buffered and mmap reads: normal, random or "
+              "sequential");
+DEFINE_string(read_pattern, "random",
+              "Reads of the readpath bench: random blocks drawn from "
+              "--read_dist, or seq to stream through the zones");
+DEFINE_int64(read_ahead_kb, -1,
+             "Readahead window of the device during the readpath bench, -1 "
+             "keeps the current one");
+DEFINE_bool(drop_cache, true,
+            "Drop the page cache and the block cache before every path of "
+            "the readpath bench, so that each starts cold");
+DEFINE_string(qos_classes, "reader:read:4:8,compaction:append:4:1",
+              "Tenant classes of the qos bench, comma separated "
+              "name:job:threads:weight[:MiB/s], job read or append. The "
+              "optional cap is a token bucket on the bytes of the class");
+DEFINE_uint64(qos_depth, 8,
+              "I/Os the qos scheduler lets reach the device at once");
+DEFINE_bool(qos_read_priority, true,
+            "Have the qos scheduler dispatch queued reads before appends");
+DEFINE_uint64(qos_read_burst, 8,
+              "Reads the qos scheduler dispatches in a row before a waiting "
+              "append, 0 for strict read priority");
+DEFINE_string(zone_stats, "",
+              "Write per-zone bytes, operations, resets, finishes and "
+              "latency percentiles of the run and of every report interval "
+              "to this file, as CSV or as heatmap JSON by its extension");
+DEFINE_string(output, "text",
+              "Result format: text, or json with run metadata and full "
+              "histograms for script/compare.py");
+DEFINE_string(output_file, "",
+              "Write the results to this file instead of stdout. Progress "
+              "lines go to stderr while json goes to stdout");
 
 class Benchmark {
   static constexpr int kMaxThreadNum = 32;
@@ -24,106 +213,2829 @@ public:
     uint64_t bs;
     uint64_t threads;
     uint64_t duration;
+    uint64_t ops;
+    uint64_t bytes;
+    bool cpu_stats;
+    uint64_t report_interval;
+
+    // Lifetime workload
+    uint64_t zones;
+    std::string lifetime_dist;
+    uint64_t lifetime_mean;
+    double utilization;
+    double hot_ratio;
+    uint64_t open_zones;
+    std::string placement;
+    uint64_t gc_free_zones;
+
+    uint64_t stripe_size;
+
+    uint64_t copy_chunk;
+    uint64_t copy_depth;
+    bool simple_copy;
+    bool io_phases;
+
+    uint64_t open_threads;
+
+    // Read/write isolation
+    uint64_t writers;
+    std::string read_placement;
+    uint64_t rw_fill_zones;
+
+    // Host-side write sequencing
+    uint64_t qd;
+    std::string schedulers;
+
+    // Zone lifecycle
+    uint64_t streams;
+    std::string finish_thresholds;
+    uint64_t idle_close_ms;
+
+    // Latency target search
+    SloController::Options slo_option;
+    uint64_t slo_interval_ms;
+
+    std::string read_dist;
+    double zipf_theta;
+    uint64_t cache_size;
+    std::string cache_policy;
+    uint64_t cache_shards;
+
+    std::string output;
+    std::string output_file;
+    std::string zone_stats;
+
+    bool precondition;
+    Preconditioner::Options precondition_option;
+
+    // Parity zone groups
+    uint64_t parity_k;
+
+    // Zone daemon
+    uint64_t clients;
+    std::string shm_name;
+    uint64_t daemon_workers;
+    uint64_t client_read_pct;
+
+    // Read path comparison
+    std::string read_paths;
+    std::string read_advice;
+    std::string read_pattern;
+    int64_t read_ahead_kb;
+    bool drop_cache;
+
+    // Restart from the zone journal
+    uint64_t journal_snapshot_records;
+    bool journal_crash;
+
+    // Host-side QoS scheduling
+    std::string qos_classes;
+    uint64_t qos_depth;
+    bool qos_read_priority;
+    uint64_t qos_read_burst;
+  };
+
+  // Some thread-local states
+  struct ThreadState {
+    // The method to be executed
+    void (*method)(ThreadState *) = nullptr;
+    // The device to be accessed
+    ZonedBlockDevice *zbd;
+    // configuration
+    Option option;
+    Statistics *statistic;
+    // CPU consumed by this thread
+    ThreadCpuCounter cpu;
+    // The benchmark, for state shared by all threads
+    Benchmark *bench;
+
+    // Id of this running thread
+    uint64_t id;
+  };
+
+public:
+  Benchmark(const Option &option) : option_(option) {
+    std::stringstream devs(option.dev);
+    std::string dev;
+    while (std::getline(devs, dev, ',')) {
+      auto zbd = std::make_shared<ZonedBlockDevice>(dev);
+      zbd->SetOpenThreads(option.open_threads);
+      // Only the zoneqd writers keep their writes in order themselves
+      zbd->SetHostSequencing(option.bench == "zoneqd");
+      // A new journal, replayed once the bench reopens the device
+      if (option.bench == "restart") {
+        zbd->EnableJournal(false, option.journal_snapshot_records);
+      }
+      if (!zbd->Open(false, true)) {
+        assert(false);
+      }
+      Log() << "[Open][Device: " << dev << "]"
+                << "[Zones: " << zbd->GetNrIOZones() << "]"
+                << "[Time: " << zbd->GetOpenMicros() << "us]\n";
+      zbds_.push_back(zbd);
+      device_stats_.push_back(new Statistics());
+    }
+    assert(!zbds_.empty());
+    // Single device benchmarks use the first device
+    zbd_ = zbds_[0];
+    statistic_ = new Statistics();
+
+    if (option.cache_size > 0) {
+      BlockCache::Options cache_option;
+      cache_option.capacity = option.cache_size;
+      cache_option.block_size = option.bs;
+      cache_option.zone_size = zbd_->GetZoneSize();
+      cache_option.nr_zones = zbd_->GetNrZones();
+      cache_option.shards = option.cache_shards;
+      if (!BlockCache::ParsePolicy(option.cache_policy,
+                                   &cache_option.policy)) {
+        printf("Unknown --cache_policy %s\n", option.cache_policy.c_str());
+        abort();
+      }
+      cache_ = std::make_unique<BlockCache>(cache_option);
+      zbd_->SetBlockCache(cache_.get());
+    }
+
+    if (!option.zone_stats.empty()) {
+      zone_stats_ = std::make_unique<ZoneStats>(zbd_->GetNrZones());
+      zbd_->SetZoneStats(zone_stats_.get());
+    }
+  }
+
+  ~Benchmark() {
+    delete statistic_;
+    delete baseline_stat_;
+    for (auto &result : placement_results_) {
+      delete result.statistic;
+    }
+    for (auto &result : rw_results_) {
+      delete result.statistic;
+    }
+    for (auto &result : qd_results_) {
+      delete result.statistic;
+    }
+    for (auto &result : finish_results_) {
+      delete result.statistic;
+    }
+    for (auto &result : daemon_results_) {
+      delete result.statistic;
+    }
+    for (auto &result : parity_results_) {
+      delete result.statistic;
+    }
+    for (auto &result : path_results_) {
+      delete result.statistic;
+    }
+    for (auto &result : qos_results_) {
+      delete result.statistic;
+    }
+    for (auto stat : device_stats_) {
+      delete stat;
+    }
+  }
+
+  void Run() {
+    if (option_.precondition && !Precondition()) {
+      return;
+    }
+
+    if (option_.bench == "placement") {
+      RunPlacement();
+      return;
+    } else if (option_.bench == "zonecopy") {
+      RunZoneCopy();
+      return;
+    } else if (option_.bench == "rwmix") {
+      RunReadWrite();
+      return;
+    } else if (option_.bench == "zoneqd") {
+      RunZoneQueueDepth();
+      return;
+    } else if (option_.bench == "slo") {
+      RunSlo();
+      return;
+    } else if (option_.bench == "zonefinish") {
+      RunZoneFinish();
+      return;
+    } else if (option_.bench == "daemon") {
+      RunDaemon();
+      return;
+    } else if (option_.bench == "serve") {
+      RunServe();
+      return;
+    } else if (option_.bench == "parity") {
+      RunParity();
+      return;
+    } else if (option_.bench == "restart") {
+      RunRestart();
+      return;
+    } else if (option_.bench == "readpath") {
+      RunReadPath();
+      return;
+    } else if (option_.bench == "qos") {
+      RunQos();
+      return;
+    }
+
+    Method method = nullptr;
+    if (option_.bench == "writeseq") {
+      method = &Benchmark::WriteSeq;
+    } else if (option_.bench == "readseq") {
+      method = &Benchmark::ReadSeq;
+    } else if (option_.bench == "readrandom") {
+      method = &Benchmark::ReadRandom;
+    } else if (option_.bench == "lifetime") {
+      method = &Benchmark::LifetimeWrite;
+    } else if (option_.bench == "stripe") {
+      method = &Benchmark::WriteStriped;
+    }
+    if (!method) {
+      printf("Unknown bench %s\n", option_.bench.c_str());
+      return;
+    }
+    RunThreads(method);
+  }
+
+  void Report() {
+    // Lost by a restart bench that could not reopen it
+    if (!zbd_) {
+      printf("No device left to report on\n");
+      return;
+    }
+    if (zone_stats_) {
+      WriteZoneStats();
+    }
+    if (option_.output == "json") {
+      ReportJson();
+      return;
+    }
+    if (option_.bench == "placement") {
+      ReportPlacement();
+      return;
+    }
+    if (option_.bench == "rwmix") {
+      ReportReadWrite();
+      return;
+    }
+    if (option_.bench == "zoneqd") {
+      ReportZoneQueueDepth();
+      return;
+    }
+    if (option_.bench == "zonefinish") {
+      ReportZoneFinish();
+      return;
+    }
+    if (option_.bench == "daemon" || option_.bench == "serve") {
+      ReportDaemon();
+      return;
+    }
+    if (option_.bench == "parity") {
+      ReportParity();
+      return;
+    }
+    if (option_.bench == "restart") {
+      statistic_->Report();
+      ReportRestart();
+      return;
+    }
+    if (option_.bench == "readpath") {
+      ReportReadPath();
+      return;
+    }
+    if (option_.bench == "qos") {
+      ReportQos();
+      return;
+    }
+    if (slo_) {
+      ReportSlo();
+    }
+    if (baseline_stat_) {
+      std::cout << "[Baseline]";
+      baseline_stat_->ReportLatency(kRead);
+    }
+    statistic_->Report();
+    if (cache_) {
+      std::cout << "[Cache]" << cache_->ToString() << "\n";
+    }
+    if (has_gc_stats_) {
+      std::cout << "[Space]" << gc_stats_.ToString() << "\n";
+    }
+    if (option_.bench == "stripe") {
+      for (size_t i = 0; i < zbds_.size(); ++i) {
+        std::cout << "[Device " << zbds_[i]->GetFilename() << "]\n";
+        device_stats_[i]->ReportThroughput(kWrite);
+        device_stats_[i]->ReportLatency(kWrite);
+      }
+    }
+  }
+
+private:
+  using Method = void (*)(ThreadState *);
+
+  // The end of the run of one thread: --duration, and its share of --ops
+  // and --bytes. The loops charge the I/Os they complete with Done()
+  static Duration RunLimit(ThreadState *state) {
+    auto &option = state->option;
+    // Spread the remainder so that the threads issue exactly `total`
+    auto share = [&](uint64_t total) {
+      return total / option.threads + (state->id < total % option.threads);
+    };
+    uint64_t ops = option.ops ? share(option.ops) : 0;
+    uint64_t bytes = 0;
+    if (option.bytes) {
+      bytes = share((option.bytes + option.bs - 1) / option.bs) * option.bs;
+    }
+    Duration dura(option.duration, ops, bytes);
+    // A thread without a share must not run unbounded
+    dura.ended = (option.ops && ops == 0) || (option.bytes && bytes == 0);
+    return dura;
+  }
+
+  // Run `method` on option_.threads threads until all of them exit
+  void RunThreads(Method method) {
+    // Do not support threads number great than 14
+    if (option_.threads > 14) {
+      abort();
+    }
+
+    for (uint64_t i = 0; i < option_.threads; ++i) {
+      auto thread_stat = &thread_stats_[i];
+
+      thread_stat->option = option_;
+      thread_stat->id = i;
+      thread_stat->statistic = statistic_;
+      thread_stat->zbd = zbd_.get();
+      thread_stat->bench = this;
+      thread_stat->method = method;
+
+      running_threads_.emplace_back(YieldThread(thread_stat));
+    }
+
+    auto start = Duration::NowTime();
+    std::thread monitor;
+    if (option_.report_interval > 0) {
+      finished_ = false;
+      monitor = std::thread([this]() { Monitor(); });
+    }
+
+    // Wait for exit
+    for (auto t : running_threads_) {
+      t->join();
+    }
+    running_threads_.clear();
+
+    auto wall = Duration::ElapseTimeMicro(start);
+    statistic_->AddWallMicros(wall);
+    for (auto stat : device_stats_) {
+      stat->AddWallMicros(wall);
+    }
+
+    if (monitor.joinable()) {
+      {
+        std::lock_guard<std::mutex> lck(monitor_mtx_);
+        finished_ = true;
+      }
+      monitor_cv_.notify_all();
+      monitor.join();
+    }
+  }
+
+  // Reset and fill every device, the measurement starts once all of them
+  // are done
+  bool Precondition() {
+    for (auto &zbd : zbds_) {
+      Preconditioner preconditioner(zbd.get(), option_.precondition_option);
+      if (!preconditioner.Run()) {
+        return false;
+      }
+      Log() << "[Precondition][Device: " << zbd->GetFilename() << "]"
+            << preconditioner.GetStats().ToString() << "\n";
+      precondition_stats_.push_back(preconditioner.GetStats());
+    }
+    return true;
+  }
+
+  // Run the lifetime workload once with every placement policy, each on
+  // freshly reset zones, to compare how well they group data that dies
+  // together
+  void RunPlacement() {
+    for (auto policy : {"random", "roundrobin", "hint"}) {
+      option_.placement = policy;
+      gc_stats_ = GcStats();
+      has_gc_stats_ = false;
+
+      RunThreads(&Benchmark::LifetimeWrite);
+
+      PlacementResult result;
+      result.policy = policy;
+      result.gc = gc_stats_;
+      result.statistic = statistic_;
+      statistic_->LatencyData(kWrite, &result.write_latency);
+      placement_results_.push_back(result);
+      statistic_ = new Statistics();
+    }
+  }
+
+  // Measure zone to zone copies and how much they slow down foreground
+  // reads: the readers first run alone, then next to a copy thread, for
+  // half of the duration each
+  void RunZoneCopy() {
+    if (option_.threads < 2) {
+      printf("zonecopy needs a copy thread and at least one reader\n");
+      return;
+    }
+    if (!PrepareCopySource()) {
+      return;
+    }
+
+    auto duration = option_.duration;
+    if (duration > 0) {
+      option_.duration = std::max<uint64_t>(duration / 2, 1);
+    }
+
+    copy_phase_ = false;
+    RunThreads(&Benchmark::ZoneCopyWorker);
+    baseline_stat_ = statistic_;
+    statistic_ = new Statistics();
+
+    copy_phase_ = true;
+    RunThreads(&Benchmark::ZoneCopyWorker);
+
+    option_.duration = duration;
+    copy_src_->CheckRelease();
+  }
+
+  // Fill the first zone, the source of every copy, and split the others:
+  // the zones that hold data are read, the empty ones are copied into. The
+  // readers only ever see the blocks written before the threads start
+  bool PrepareCopySource() {
+    copy_src_ = zbd_->GetIOZone(0);
+    copy_src_->LoopForAcquire();
+    if (!FillZone(copy_src_)) {
+      return false;
+    }
+
+    for (auto &zone : zbd_->io_zones_) {
+      auto blocks = (zone.wp_ - zone.start_) / option_.bs;
+      if (blocks > 0) {
+        readable_zones_.push_back(&zone);
+        copy_read_blocks_.push_back(blocks);
+      } else if (zone.IsEmpty()) {
+        copy_dsts_.push_back(&zone);
+      }
+    }
+    if (copy_dsts_.empty()) {
+      printf("zonecopy needs an empty zone to copy into\n");
+      return false;
+    }
+    return true;
+  }
+
+  // Append 1MiB chunks to an acquired zone until it is full
+  static bool FillZone(Zone *zone) {
+    const uint64_t chunk = 1024 * 1024;
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), chunk);
+    memset(buf, '1', chunk);
+    bool ok = true;
+    while (ok && zone->GetCapacityLeft() >= chunk) {
+      ok = zone->Append(buf, chunk);
+    }
+    free(buf);
+    return ok;
+  }
+
+  // Run writers and readers side by side once for every class of
+  // --read_placement. Writers append to the first half of the zones, the
+  // disjoint readers read zones of the second half that were filled up front
+  void RunReadWrite() {
+    if (option_.writers == 0 || option_.writers >= option_.threads) {
+      printf("rwmix needs at least one writer and one reader thread\n");
+      return;
+    }
+    auto half = zbd_->GetNrIOZones() / 2;
+    auto fill = std::min<uint64_t>(option_.rw_fill_zones, half);
+    rw_zones_.reset(new RwZone[zbd_->GetNrIOZones()]);
+    for (size_t i = 0; i < half; ++i) {
+      rw_write_zones_.push_back(zbd_->GetIOZone(i));
+    }
+    for (size_t i = 0; i < fill; ++i) {
+      auto zone = zbd_->GetIOZone(half + i);
+      zone->LoopForAcquire();
+      if (!zone->IsEmpty() && !zone->Reset()) {
+        assert(false);
+      }
+      bool ok = FillZone(zone);
+      zone->CheckRelease();
+      if (!ok) {
+        printf("Failed to fill the disjoint read zones\n");
+        return;
+      }
+      GetRwZone(zone).blocks.store((zone->wp_ - zone->start_) / option_.bs);
+      rw_read_zones_.push_back(zone);
+    }
+
+    std::stringstream classes(option_.read_placement);
+    std::string name;
+    while (std::getline(classes, name, ',')) {
+      if (name == "same") {
+        rw_placement_ = ReadPlacement::kSame;
+      } else if (name == "disjoint") {
+        rw_placement_ = ReadPlacement::kDisjoint;
+      } else if (name == "finished") {
+        rw_placement_ = ReadPlacement::kFinished;
+      } else {
+        printf("Unknown read placement %s\n", name.c_str());
+        continue;
+      }
+      if (rw_placement_ == ReadPlacement::kDisjoint && rw_read_zones_.empty()) {
+        printf("disjoint reads need --rw_fill_zones > 0\n");
+        continue;
+      }
+      for (auto &active : rw_active_) {
+        active.store(nullptr);
+      }
+      rw_finished_.clear();
+
+      RunThreads(&Benchmark::ReadWriteWorker);
+      rw_results_.push_back({name, statistic_});
+      statistic_ = new Statistics();
+    }
+  }
+
+  // Append with --qd writes in flight per zone through the host-side
+  // sequencer, once under every scheduler of --schedulers. The scheduler the
+  // device had before is restored at the end
+  void RunZoneQueueDepth() {
+    auto original = zbd_->GetScheduler();
+    std::stringstream names(option_.schedulers);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+      if (!zbd_->SetScheduler(name)) {
+        printf("Failed to switch %s to the %s scheduler\n",
+               zbd_->GetFilename().c_str(), name.c_str());
+        continue;
+      }
+      sequencer_stats_ = ZoneWriteSequencer::Stats();
+      RunThreads(&Benchmark::SequencedWrite);
+      qd_results_.push_back({name, statistic_, sequencer_stats_});
+      statistic_ = new Statistics();
+    }
+    if (!original.empty() && zbd_->GetScheduler() != original) {
+      zbd_->SetScheduler(original);
+    }
+  }
+
+  // Thread i fills zones i, i + threads, ... one after the other, keeping
+  // --qd writes in flight to the zone it is on
+  static void SequencedWrite(ThreadState *state) {
+    auto zbd = state->zbd;
+    auto &option = state->option;
+    ZoneWriteSequencer sequencer(zbd, option.qd, state->statistic);
+    if (option.io_phases) {
+      sequencer.SetPhaseStats(state->statistic);
+    }
+    if (!sequencer.Init()) {
+      printf("Failed to set up the zone write sequencer\n");
+      return;
+    }
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
+    memset(buf, '1', option.bs);
+
+    auto nr_zones = zbd->GetNrIOZones();
+    uint64_t next = state->id % nr_zones;
+    Zone *zone = nullptr;
+    bool ok = true;
+    auto dura = RunLimit(state);
+    while (ok && !dura.Ending()) {
+      if (zone && zone->GetCapacityLeft() >= option.bs) {
+        ok = sequencer.Write(buf, option.bs);
+        if (ok) {
+          dura.Done(option.bs);
+        }
+        continue;
+      }
+      if (zone) {
+        ok = sequencer.Flush();
+        zone->CheckRelease();
+        zone = nullptr;
+        continue;
+      }
+      zone = zbd->GetIOZone(next);
+      next = (next + option.threads) % nr_zones;
+      zone->LoopForAcquire();
+      if (!zone->IsEmpty() && !zone->Reset()) {
+        assert(false);
+      }
+      ok = sequencer.Open(zone);
+    }
+
+    if (!sequencer.Flush()) {
+      ok = false;
+    }
+    if (zone) {
+      zone->CheckRelease();
+    }
+    if (!ok) {
+      printf("Sequenced write failed\n");
+    }
+    state->bench->AddSequencerStats(sequencer.GetStats());
+    free(buf);
+  }
+
+  void AddSequencerStats(const ZoneWriteSequencer::Stats &stats) {
+    std::lock_guard<std::mutex> lck(sequencer_mtx_);
+    sequencer_stats_.Merge(stats);
+  }
+
+  void ReportZoneQueueDepth() {
+    for (auto &result : qd_results_) {
+      std::cout << "[Scheduler: " << result.scheduler << "][QD: "
+                << option_.qd << "]" << result.sequencer.ToString() << "\n";
+      result.statistic->ReportThroughput(kWrite);
+      result.statistic->ReportLatency(kWrite);
+    }
+  }
+
+  // Write --streams streams under every finish threshold, each run starting
+  // from empty zones, to see how finishing early trades capacity for active
+  // zones and write throughput
+  void RunZoneFinish() {
+    std::stringstream thresholds(option_.finish_thresholds);
+    std::string threshold;
+    while (std::getline(thresholds, threshold, ',')) {
+      if (!ResetAllZones(zbd_.get())) {
+        printf("Failed to reset the zones\n");
+        return;
+      }
+      auto percent = std::stoul(threshold);
+      zbd_->SetFinishThreshold(percent);
+      ZoneLifecycle::Options lifecycle_option;
+      lifecycle_option.idle_close_us = option_.idle_close_ms * 1000;
+      lifecycle_ = std::make_unique<ZoneLifecycle>(zbd_.get(),
+                                                   lifecycle_option);
+      auto finishes = zbd_->GetFinishes();
+      auto finish_failures = zbd_->GetFinishFailures();
+      auto waste = zbd_->GetFinishWaste();
+      auto closes = zbd_->GetCloses();
+
+      RunThreads(&Benchmark::ZoneFinishWrite);
+
+      ZoneFinishResult result;
+      result.threshold = percent;
+      result.statistic = statistic_;
+      result.lifecycle = lifecycle_->GetStats();
+      result.finishes = zbd_->GetFinishes() - finishes;
+      result.finish_failures = zbd_->GetFinishFailures() - finish_failures;
+      result.finish_waste = zbd_->GetFinishWaste() - waste;
+      result.closes = zbd_->GetCloses() - closes;
+      finish_results_.push_back(result);
+      statistic_ = new Statistics();
+    }
+    zbd_->SetFinishThreshold(0);
+    lifecycle_.reset();
+  }
+
+  bool ResetAllZones(ZonedBlockDevice *zbd) {
+    for (auto &zone : zbd->io_zones_) {
+      zone.LoopForAcquire();
+      bool ok = zone.IsEmpty() || zone.Reset();
+      zone.CheckRelease();
+      if (!ok) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Write the streams id, id + threads, ... round-robin. A stream takes a
+  // zone from the lifecycle and retires it once the next write no longer
+  // fits. Zones are only held around each write, so others can close them
+  static void ZoneFinishWrite(ThreadState *state) {
+    auto bench = state->bench;
+    auto &option = state->option;
+    auto &lifecycle = *bench->lifecycle_;
+    std::vector<Zone *> streams;
+    for (auto i = state->id; i < option.streams; i += option.threads) {
+      streams.push_back(nullptr);
+    }
+    if (streams.empty()) {
+      return;
+    }
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
+    memset(buf, '1', option.bs);
+
+    size_t next = 0;
+    auto dura = RunLimit(state);
+    while (!dura.Ending()) {
+      auto &zone = streams[next];
+      next = (next + 1) % streams.size();
+      if (!zone) {
+        // Comes back acquired. Without an active zone to spare the stream
+        // sits this round out, the other streams filling theirs free one
+        zone = lifecycle.TryAllocateZone();
+        if (!zone) {
+          continue;
+        }
+      } else {
+        zone->LoopForAcquire();
+      }
+
+      bool ok;
+      {
+        MetricsGuard guard(option.bs, state->statistic, kWrite);
+        ok = lifecycle.Append(zone, buf, option.bs);
+      }
+      if (ok) {
+        dura.Done(option.bs);
+      }
+      if (ok && zone->GetCapacityLeft() < option.bs) {
+        ok = lifecycle.Retire(zone);
+        zone->CheckRelease();
+        zone = nullptr;
+      } else {
+        zone->CheckRelease();
+      }
+      if (!ok) {
+        printf("Zone lifecycle write failed\n");
+        break;
+      }
+    }
+    free(buf);
+  }
+
+  void ReportZoneFinish() {
+    for (auto &result : finish_results_) {
+      std::cout << "[Finish threshold: " << result.threshold << "%]"
+                << "[Finishes: " << result.finishes << "]"
+                << "[Failed finishes: " << result.finish_failures << "]"
+                << "[Finish waste: " << ToMiB(result.finish_waste) << "MiB]"
+                << "[Closes: " << result.closes << "]"
+                << result.lifecycle.ToString() << "\n";
+      result.statistic->ReportThroughput(kWrite);
+      result.statistic->ReportLatency(kWrite);
+    }
+  }
+
+  // Zone operations of the daemon bench, served by the device in this
+  // process or through a zone daemon. Every client writes its own zones
+  class ZoneBackend {
+  public:
+    virtual ~ZoneBackend() = default;
+    // The one I/O buffer of the client
+    virtual char *Buffer() = 0;
+    virtual bool Allocate(uint32_t *zone, uint64_t *capacity) = 0;
+    virtual bool Append(uint32_t zone, uint32_t size) = 0;
+    virtual bool Read(uint32_t zone, uint64_t offset, uint32_t size) = 0;
+    virtual bool Reset(uint32_t zone) = 0;
+  };
+
+  // Straight to the zones of the device, what the daemon does on behalf of
+  // its clients
+  class DirectZones : public ZoneBackend {
+  public:
+    DirectZones(ZonedBlockDevice *zbd, uint64_t bs) : zbd_(zbd) {
+      posix_memalign((void **)&buf_, sysconf(_SC_PAGESIZE), bs);
+    }
+    ~DirectZones() {
+      for (auto zone : owned_) {
+        zone->CheckRelease();
+      }
+      free(buf_);
+    }
+    char *Buffer() override { return buf_; }
+    bool Allocate(uint32_t *zone, uint64_t *capacity) override {
+      // Stays acquired until the client is done, like a daemon client zone
+      auto z = zbd_->AcquireEmptyZone();
+      if (!z) {
+        return false;
+      }
+      owned_.push_back(z);
+      *zone = z - zbd_->GetIOZone(0);
+      *capacity = z->GetCapacityLeft();
+      return true;
+    }
+    bool Append(uint32_t zone, uint32_t size) override {
+      return zbd_->GetIOZone(zone)->Append(buf_, size);
+    }
+    bool Read(uint32_t zone, uint64_t offset, uint32_t size) override {
+      auto z = zbd_->GetIOZone(zone);
+      bool hit;
+      return z->Read(buf_, size, z->start_ + offset, &hit);
+    }
+    bool Reset(uint32_t zone) override {
+      return zbd_->GetIOZone(zone)->Reset();
+    }
+
+  private:
+    ZonedBlockDevice *zbd_;
+    char *buf_ = nullptr;
+    std::vector<Zone *> owned_;
+  };
+
+  class DaemonZones : public ZoneBackend {
+  public:
+    bool Attach(const std::string &name) {
+      // Client processes may start before the daemon is up
+      return client_.Attach(name, kAttachWaitMicros);
+    }
+    char *Buffer() override { return client_.Buffer(0); }
+    bool Allocate(uint32_t *zone, uint64_t *capacity) override {
+      return client_.AllocateZone(zone, capacity);
+    }
+    bool Append(uint32_t zone, uint32_t size) override {
+      uint64_t offset;
+      return client_.Append(zone, 0, size, &offset);
+    }
+    bool Read(uint32_t zone, uint64_t offset, uint32_t size) override {
+      return client_.Read(zone, offset, 0, size);
+    }
+    bool Reset(uint32_t zone) override { return client_.Reset(zone); }
+
+  private:
+    static constexpr uint64_t kAttachWaitMicros = 10 * 1000 * 1000;
+    ZoneClient client_;
+  };
+
+  // What one client process of the daemon phase measured, in memory it
+  // shares with the bench. Histograms have no pointers, so they work from
+  // any process
+  struct ClientResult {
+    HistogramStat latency[2];     // by kWrite and kRead
+    HistogramStat throughput[2];
+    std::atomic<uint64_t> bytes[2];
+    std::atomic<bool> ok;
+  };
+
+  // The same client workload, --clients of them, first as threads on the
+  // device of this process and then as processes served by a zone daemon
+  void RunDaemon() {
+    if (option_.clients == 0 || option_.clients > 14) {
+      printf("--clients must be within [1, 14]\n");
+      return;
+    }
+    auto threads = option_.threads;
+    option_.threads = option_.clients;
+    RunDaemonPhases();
+    option_.threads = threads;
+  }
+
+  void RunDaemonPhases() {
+    if (!ResetAllZones(zbd_.get())) {
+      printf("Failed to reset the zones\n");
+      return;
+    }
+    RunThreads(&Benchmark::DirectClient);
+    daemon_results_.push_back({"direct", statistic_});
+    statistic_ = new Statistics();
+
+    if (!ResetAllZones(zbd_.get())) {
+      printf("Failed to reset the zones\n");
+      return;
+    }
+    if (RunDaemonClients()) {
+      daemon_results_.push_back({"daemon", statistic_});
+      statistic_ = new Statistics();
+    }
+  }
+
+  bool RunDaemonClients() {
+    ZoneDaemon daemon(zbd_.get(), DaemonOptions());
+    if (!daemon.Create()) {
+      return false;
+    }
+
+    size_t size = option_.clients * sizeof(ClientResult);
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      printf("mmap: %s\n", strerror(errno));
+      return false;
+    }
+    auto results = static_cast<ClientResult *>(addr);
+    for (uint64_t i = 0; i < option_.clients; ++i) {
+      new (&results[i]) ClientResult();
+    }
+
+    // Fork before the daemon starts any thread, the clients then only touch
+    // the shared memory
+    std::vector<pid_t> pids;
+    for (uint64_t i = 0; i < option_.clients; ++i) {
+      auto pid = fork();
+      if (pid == 0) {
+        results[i].ok = RunClientProcess(option_, i, &results[i]);
+        fflush(stdout);
+        _exit(0);
+      }
+      if (pid < 0) {
+        printf("fork: %s\n", strerror(errno));
+        break;
+      }
+      pids.push_back(pid);
+    }
+
+    auto start = Duration::NowTime();
+    daemon.Start();
+    for (auto pid : pids) {
+      waitpid(pid, nullptr, 0);
+    }
+    statistic_->AddWallMicros(Duration::ElapseTimeMicro(start));
+    daemon.Stop();
+    daemon_stats_ = std::make_unique<ZoneDaemon::Stats>(daemon.GetStats());
+
+    bool ok = pids.size() == option_.clients;
+    for (uint64_t i = 0; i < option_.clients; ++i) {
+      auto &result = results[i];
+      ok = ok && result.ok;
+      for (auto type : {kWrite, kRead}) {
+        statistic_->Merge(type, result.latency[type], result.throughput[type],
+                          result.bytes[type]);
+      }
+      result.~ClientResult();
+    }
+    munmap(addr, size);
+    if (!ok) {
+      printf("A daemon client failed\n");
+    }
+    return ok;
+  }
+
+  ZoneDaemon::Options DaemonOptions() {
+    ZoneDaemon::Options daemon_option;
+    daemon_option.name = option_.shm_name;
+    daemon_option.buffer_size = option_.bs;
+    daemon_option.workers = option_.daemon_workers;
+    return daemon_option;
+  }
+
+  // Attach to the daemon and run the workload of client `id`
+  static bool RunDaemonClient(const Option &option, uint64_t id,
+                              Statistics *statistic) {
+    DaemonZones io;
+    if (!io.Attach(option.shm_name)) {
+      printf("Failed to attach to %s\n", option.shm_name.c_str());
+      return false;
+    }
+    ThreadState state;
+    state.option = option;
+    state.id = id;
+    state.statistic = statistic;
+    return ZoneClientWork(&state, &io);
+  }
+
+  // A forked client, leaving what it measured in `result`
+  static bool RunClientProcess(const Option &option, uint64_t id,
+                               ClientResult *result) {
+    Statistics statistic;
+    bool ok = RunDaemonClient(option, id, &statistic);
+    for (auto type : {kWrite, kRead}) {
+      result->latency[type].Merge(statistic.Latency(type));
+      result->throughput[type].Merge(statistic.Throughput(type));
+      result->bytes[type] = statistic.Bytes(type);
+    }
+    return ok;
+  }
+
+  static void DirectClient(ThreadState *state) {
+    DirectZones io(state->zbd, state->option.bs);
+    if (!ZoneClientWork(state, &io)) {
+      printf("Direct client %lu failed\n", state->id);
+    }
+  }
+
+  // Append blocks to a zone of the client and, --client_read_pct of the
+  // time, read a random block it wrote instead. A full zone is followed by
+  // a new one until the client holds its share of the zones, then by its
+  // oldest zone, reset
+  static bool ZoneClientWork(ThreadState *state, ZoneBackend *io) {
+    struct ClientZone {
+      uint32_t zone;
+      uint64_t capacity;
+      uint64_t written;
+    };
+    auto &option = state->option;
+    auto bs = option.bs;
+    size_t max_zones = SIZE_MAX;
+    if (option.zones) {
+      max_zones = std::max<size_t>(option.zones / option.threads, 2);
+    }
+    std::vector<ClientZone> zones;
+    size_t current = 0;
+    std::mt19937_64 rng(state->id);
+    memset(io->Buffer(), '1', bs);
+
+    auto next_zone = [&]() {
+      uint32_t zone;
+      uint64_t capacity;
+      if (zones.size() < max_zones && io->Allocate(&zone, &capacity)) {
+        zones.push_back({zone, capacity, 0});
+        current = zones.size() - 1;
+        return capacity >= bs;
+      }
+      if (zones.empty()) {
+        return false;
+      }
+      current = (current + 1) % zones.size();
+      zones[current].written = 0;
+      return io->Reset(zones[current].zone);
+    };
+    if (!next_zone()) {
+      return false;
+    }
+
+    auto dura = RunLimit(state);
+    while (!dura.Ending()) {
+      auto &cz = zones[rng() % zones.size()];
+      if (cz.written >= bs && rng() % 100 < option.client_read_pct) {
+        auto offset = rng() % (cz.written / bs) * bs;
+        MetricsGuard guard(bs, state->statistic, kRead);
+        if (!io->Read(cz.zone, offset, bs)) {
+          return false;
+        }
+        dura.Done(bs);
+        continue;
+      }
+
+      if (zones[current].written + bs > zones[current].capacity &&
+          !next_zone()) {
+        return false;
+      }
+      auto &zone = zones[current];
+      MetricsGuard guard(bs, state->statistic, kWrite);
+      if (!io->Append(zone.zone, bs)) {
+        return false;
+      }
+      dura.Done(bs);
+      zone.written += bs;
+    }
+    return true;
+  }
+
+  // Serve zones to client processes, started with --bench=client, until
+  // --duration ends or the daemon is interrupted
+  void RunServe() {
+    ZoneDaemon daemon(zbd_.get(), DaemonOptions());
+    if (!daemon.Create()) {
+      return;
+    }
+    signal(SIGINT, StopServing);
+    signal(SIGTERM, StopServing);
+    daemon.Start();
+    Log() << "[Daemon][Serving: " << option_.shm_name << "]\n";
+    auto start = Duration::NowTime();
+    while (!stop_serving_ &&
+           (option_.duration == 0 ||
+            Duration::ElapseTimeMicro(start) < option_.duration * 1000000)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    statistic_->AddWallMicros(Duration::ElapseTimeMicro(start));
+    daemon.Stop();
+    daemon_stats_ = std::make_unique<ZoneDaemon::Stats>(daemon.GetStats());
+  }
+
+  static void StopServing(int) { stop_serving_ = 1; }
+
+public:
+  // A client process of a daemon started with --bench=serve, it never
+  // opens the device itself
+  static int RunClient(Option option) {
+    option.threads = 1;
+    Statistics statistic;
+    auto start = Duration::NowTime();
+    bool ok = RunDaemonClient(option, getpid(), &statistic);
+    statistic.AddWallMicros(Duration::ElapseTimeMicro(start));
+    statistic.Report();
+    return ok ? 0 : 1;
+  }
+
+private:
+
+  void ReportDaemon() {
+    for (auto &result : daemon_results_) {
+      std::cout << "[Access: " << result.access << "][Clients: "
+                << option_.clients << "]\n";
+      result.statistic->Report();
+    }
+    if (daemon_stats_) {
+      std::cout << "[Daemon]" << daemon_stats_->ToString() << "\n";
+    }
+  }
+
+  void WriteDaemonStats(JsonWriter *writer) {
+    writer->BeginObject();
+    writer->Field("clients", option_.clients);
+    writer->Field("workers", option_.daemon_workers);
+    writer->Field("requests", daemon_stats_->requests);
+    writer->Field("allocations", daemon_stats_->allocations);
+    writer->Field("appends", daemon_stats_->appends);
+    writer->Field("reads", daemon_stats_->reads);
+    writer->Field("resets", daemon_stats_->resets);
+    writer->Field("errors", daemon_stats_->errors);
+    writer->Field("attaches", daemon_stats_->attaches);
+    writer->Field("reaped", daemon_stats_->reaped);
+    writer->EndObject();
+  }
+
+  // Stripe unit of the parity bench, --bs split over the data members and
+  // rounded down to the block size unless --stripe_size is given
+  uint64_t ParityStripe() const {
+    if (option_.stripe_size) {
+      return option_.stripe_size;
+    }
+    uint64_t block = zbd_->GetBlockSize();
+    return std::max<uint64_t>(block, option_.bs / option_.parity_k / block *
+                                         block);
+  }
+
+  // Write striped over --parity_k zones, then over --parity_k zones plus a
+  // parity zone, and read back the parity groups healthy and with their
+  // first data member failed. Members are spread over all devices
+  void RunParity() {
+    auto k = option_.parity_k;
+    if (k == 0) {
+      printf("--parity_k must be at least 1\n");
+      return;
+    }
+    uint64_t block = zbd_->GetBlockSize();
+    auto stripe = ParityStripe();
+    if (stripe % block) {
+      printf("--stripe_size must be a multiple of the block size %lu\n",
+             block);
+      return;
+    }
+    // Every request fills whole rows of stripe units. --bs is rounded to
+    // them, up to one row at least, which keeps ParityStripe() as it is
+    uint64_t row = stripe * k;
+    if (option_.bs % row) {
+      uint64_t bs = std::max<uint64_t>(row, option_.bs / row * row);
+      printf("--bs %lu is not a multiple of %lu stripe units of %lu, using "
+             "%lu\n",
+             option_.bs, k, stripe, bs);
+      option_.bs = bs;
+    }
+    for (auto &zbd : zbds_) {
+      if (!ResetAllZones(zbd.get())) {
+        printf("Failed to reset the zones\n");
+        return;
+      }
+    }
+
+    parity_phase_ = false;
+    RunThreads(&Benchmark::ParityWrite);
+    parity_results_.push_back({"striped", kWrite, statistic_});
+    statistic_ = new Statistics();
+    for (auto &zbd : zbds_) {
+      if (!ResetAllZones(zbd.get())) {
+        printf("Failed to reset the zones\n");
+        return;
+      }
+    }
+
+    parity_phase_ = true;
+    parity_groups_.resize(option_.threads);
+    RunThreads(&Benchmark::ParityWrite);
+    parity_results_.push_back({"parity", kWrite, statistic_});
+    statistic_ = new Statistics();
+
+    RunThreads(&Benchmark::ParityRead);
+    parity_results_.push_back({"healthy_read", kRead, statistic_});
+    statistic_ = new Statistics();
+
+    for (auto &group : parity_groups_) {
+      if (group) {
+        group->MarkFailed(0);
+      }
+    }
+    RunThreads(&Benchmark::ParityRead);
+    parity_results_.push_back({"degraded_read", kRead, statistic_});
+    statistic_ = new Statistics();
+
+    for (auto &group : parity_groups_) {
+      if (!group) {
+        continue;
+      }
+      parity_stats_.Merge(group->GetStats());
+      for (auto zone : group->Members()) {
+        zone->CheckRelease();
+      }
+    }
+    parity_groups_.clear();
+  }
+
+  // `nr` empty zones, member i on device i % devices. Empty if there are
+  // not enough of them
+  std::vector<Zone *> AcquireGroupZones(uint64_t nr) {
+    std::vector<Zone *> zones;
+    for (uint64_t i = 0; i < nr; ++i) {
+      auto zone = zbds_[i % zbds_.size()]->AcquireEmptyZone();
+      if (!zone) {
+        for (auto z : zones) {
+          z->CheckRelease();
+        }
+        return {};
+      }
+      zones.push_back(zone);
+    }
+    return zones;
+  }
+
+  // Append --bs at a time to a group of this thread, resetting it once
+  // full. The striped group is released at the end, the parity group kept
+  // for the read phases
+  static void ParityWrite(ThreadState *state) {
+    auto bench = state->bench;
+    auto &option = state->option;
+    auto parity = bench->parity_phase_;
+    auto zones = bench->AcquireGroupZones(option.parity_k + parity);
+    if (zones.empty()) {
+      printf("Not enough empty zones for the zone group\n");
+      return;
+    }
+    auto phase_stats = option.io_phases ? state->statistic : nullptr;
+
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
+    memset(buf, '1', option.bs);
+
+    if (parity) {
+      Zone *parity_zone = zones.back();
+      zones.pop_back();
+      auto group = std::make_unique<ParityZoneGroup>(
+          zones, parity_zone, bench->ParityStripe());
+      if (!group->Init(option.bs, phase_stats)) {
+        printf("Failed to set up the parity zone group\n");
+        free(buf);
+        return;
+      }
+      auto dura = RunLimit(state);
+      while (!dura.Ending()) {
+        if (group->GetCapacityLeft() < option.bs && !group->Reset()) {
+          break;
+        }
+        MetricsGuard guard(option.bs, state->statistic, kWrite);
+        if (!group->Append(buf, option.bs)) {
+          break;
+        }
+        dura.Done(option.bs);
+      }
+      bench->parity_groups_[state->id] = std::move(group);
+      free(buf);
+      return;
+    }
+
+    StripedZoneGroup group(zones, bench->ParityStripe());
+    if (!group.Init(option.bs, phase_stats)) {
+      printf("Failed to set up the striped zone group\n");
+    } else {
+      auto dura = RunLimit(state);
+      while (!dura.Ending()) {
+        if (group.GetCapacityLeft() < option.bs && !group.Reset()) {
+          break;
+        }
+        MetricsGuard guard(option.bs, state->statistic, kWrite);
+        if (!group.Append(buf, option.bs)) {
+          break;
+        }
+        dura.Done(option.bs);
+      }
+    }
+    for (auto zone : zones) {
+      zone->CheckRelease();
+    }
+    free(buf);
+  }
+
+  // Read one stripe unit at a time from the parity group of this thread.
+  // Once a member failed only its units are read, so that every read is
+  // rebuilt from the rest of its row
+  static void ParityRead(ThreadState *state) {
+    auto group = state->bench->parity_groups_[state->id].get();
+    if (!group || group->Written() == 0) {
+      return;
+    }
+    auto unit = group->StripeSize();
+    auto rows = group->Written() / group->RowSize();
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), unit);
+    std::mt19937_64 rng(state->id);
+
+    auto dura = RunLimit(state);
+    while (!dura.Ending()) {
+      uint64_t row = rng() % rows;
+      uint64_t member = group->Degraded() ? group->FailedMember()
+                                          : rng() % group->NrData();
+      MetricsGuard guard(unit, state->statistic, kRead);
+      if (!group->Read(buf, (row * group->NrData() + member) * unit, unit)) {
+        printf("Parity group read failed\n");
+        break;
+      }
+      dura.Done(unit);
+    }
+    free(buf);
+  }
+
+  // Statistics of the parity bench phase `name`, nullptr if it did not run
+  const Statistics *ParityPhase(const std::string &name) const {
+    for (auto &result : parity_results_) {
+      if (result.name == name) {
+        return result.statistic;
+      }
+    }
+    return nullptr;
+  }
+
+  // Loss of data write throughput to parity, 0 without both write phases
+  double ParityWriteOverhead() const {
+    auto striped = ParityPhase("striped");
+    auto parity = ParityPhase("parity");
+    if (!striped || !parity) {
+      return 0;
+    }
+    auto base = striped->AggregateThroughput(kWrite);
+    if (base == 0) {
+      return 0;
+    }
+    return 1 - parity->AggregateThroughput(kWrite) / base;
+  }
+
+  // P99 of reads rebuilt from parity over that of healthy reads
+  double DegradedReadRatio() const {
+    auto healthy = ParityPhase("healthy_read");
+    auto degraded = ParityPhase("degraded_read");
+    if (!healthy || !degraded) {
+      return 0;
+    }
+    auto base = healthy->Latency(kRead).Percentile(99);
+    if (base == 0) {
+      return 0;
+    }
+    return degraded->Latency(kRead).Percentile(99) / base;
+  }
+
+  void ReportParity() {
+    for (auto &result : parity_results_) {
+      std::cout << "[Phase: " << result.name << "]\n";
+      result.statistic->ReportThroughput(result.type);
+      result.statistic->ReportLatency(result.type);
+    }
+    auto &stats = parity_stats_;
+    double mib = ToMiB(stats.parity_bytes);
+    std::cout << "[Parity][K: " << option_.parity_k << "][Stripe: "
+              << ParityStripe() << "][Write overhead: "
+              << ParityWriteOverhead() * 100 << "%]"
+              << "[Parity CPU: "
+              << (mib > 0 ? stats.parity_micros / mib : 0) << "us/MiB]"
+              << "[Rebuilds: " << stats.rebuilds << "][Rebuild XOR: "
+              << (stats.rebuilds ? stats.rebuild_micros / stats.rebuilds : 0)
+              << "us][Degraded/healthy P99: " << DegradedReadRatio()
+              << "]\n";
+  }
+
+  void WriteParity(JsonWriter *writer) {
+    auto &stats = parity_stats_;
+    writer->BeginObject();
+    writer->Field("k", option_.parity_k);
+    writer->Field("stripe", ParityStripe());
+    writer->Field("rows", stats.rows);
+    writer->Field("parity_us", stats.parity_micros);
+    writer->Field("parity_bytes", stats.parity_bytes);
+    writer->Field("rebuilds", stats.rebuilds);
+    writer->Field("rebuild_us", stats.rebuild_micros);
+    writer->Field("write_overhead", ParityWriteOverhead());
+    writer->Field("degraded_p99_ratio", DegradedReadRatio());
+    writer->EndObject();
+  }
+
+  // Run the same reads once per --read_paths entry over the first --zones
+  // zones, filling them first where needed. Every path gets statistics of
+  // its own, CPU included
+  void RunReadPath() {
+    ReadAdvice advice;
+    if (!ZonedBlockDevice::ParseReadAdvice(option_.read_advice, &advice)) {
+      printf("Unknown --read_advice %s\n", option_.read_advice.c_str());
+      return;
+    }
+    if (option_.read_pattern != "random" && option_.read_pattern != "seq") {
+      printf("Unknown --read_pattern %s\n", option_.read_pattern.c_str());
+      return;
+    }
+    std::vector<ReadPath> paths;
+    std::stringstream names(option_.read_paths);
+    std::string name;
+    while (std::getline(names, name, ',')) {
+      ReadPath path;
+      if (!ZonedBlockDevice::ParseReadPath(name, &path)) {
+        printf("Unknown read path %s\n", name.c_str());
+        return;
+      }
+      paths.push_back(path);
+    }
+    if (!PrepareReadZones()) {
+      printf("Failed to fill the zones to read\n");
+      return;
+    }
+
+    auto read_ahead = zbd_->GetReadAheadKB();
+    if (option_.read_ahead_kb >= 0 &&
+        !zbd_->SetReadAheadKB(option_.read_ahead_kb)) {
+      printf("Failed to set the readahead of %s\n",
+             zbd_->GetFilename().c_str());
+    }
+    for (auto path : paths) {
+      if (!zbd_->SetReadPath(path, advice)) {
+        printf("Failed to switch to the %s read path\n",
+               ZonedBlockDevice::ReadPathName(path));
+        continue;
+      }
+      if (option_.drop_cache) {
+        DropReadCaches();
+      }
+      RunThreads(&Benchmark::PathRead);
+      path_results_.push_back(
+          {ZonedBlockDevice::ReadPathName(path), statistic_});
+      statistic_ = new Statistics();
+    }
+    zbd_->SetReadPath(ReadPath::kDirect);
+    if (option_.read_ahead_kb >= 0 && read_ahead >= 0) {
+      zbd_->SetReadAheadKB(read_ahead);
+    }
+  }
+
+  // The first --zones zones, filled where they hold less than a block
+  bool PrepareReadZones() {
+    uint64_t nr = zbd_->GetNrIOZones();
+    if (option_.zones) {
+      nr = std::min(nr, option_.zones);
+    }
+    readable_zones_.clear();
+    for (uint64_t i = 0; i < nr; ++i) {
+      auto zone = zbd_->GetIOZone(i);
+      if (zone->wp_ - zone->start_ < option_.bs) {
+        zone->LoopForAcquire();
+        // A zone finished before its first block has no room left
+        bool ok = (zone->IsEmpty() || zone->Reset()) && FillZone(zone);
+        zone->CheckRelease();
+        if (!ok) {
+          return false;
+        }
+      }
+      readable_zones_.push_back(zone);
+    }
+    return !readable_zones_.empty();
+  }
+
+  // Both the kernel and our own block cache, so a path does not start with
+  // what the one before it read
+  void DropReadCaches() {
+    if (!zbd_->DropCache()) {
+      printf("Failed to drop the page cache of %s\n",
+             zbd_->GetFilename().c_str());
+    }
+    if (cache_) {
+      for (auto zone : readable_zones_) {
+        cache_->InvalidateZone(zone->GetZoneNr());
+      }
+    }
+  }
+
+  // Read --bs blocks of the readpath zones through Zone::Read(), so through
+  // the read path of the device and the block cache if there is one.
+  // Random blocks follow --read_dist, seq streams through the zones from a
+  // different zone in every thread
+  static void PathRead(ThreadState *state) {
+    auto &option = state->option;
+    auto &zones = state->bench->readable_zones_;
+    KeyGenerator::Kind kind;
+    if (!KeyGenerator::ParseKind(option.read_dist, &kind)) {
+      printf("Unknown --read_dist %s\n", option.read_dist.c_str());
+      return;
+    }
+    auto block_num = zones[0]->max_capacity_ / option.bs;
+    KeyGenerator keys(kind, block_num * zones.size(), option.zipf_theta,
+                      state->id);
+    bool seq = option.read_pattern == "seq";
+    size_t zone_idx = state->id * zones.size() / option.threads;
+    uint64_t block = 0;
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
+
+    auto dura = RunLimit(state);
+    while (!dura.Ending()) {
+      Zone *zone;
+      if (seq) {
+        zone = zones[zone_idx];
+        if (block >= (zone->wp_ - zone->start_) / option.bs) {
+          zone_idx = (zone_idx + 1) % zones.size();
+          block = 0;
+          continue;
+        }
+      } else {
+        auto key = keys.Next();
+        zone = zones[key / block_num];
+        block = key % block_num % ((zone->wp_ - zone->start_) / option.bs);
+      }
+      bool hit;
+      MetricsGuard guard(option.bs, state->statistic, kRead);
+      if (!zone->Read(buf, option.bs, zone->start_ + block * option.bs,
+                      &hit)) {
+        printf("Read through the %s path failed\n",
+               ZonedBlockDevice::ReadPathName(state->zbd->GetReadPath()));
+        break;
+      }
+      dura.Done(option.bs);
+      block++;
+    }
+    free(buf);
+  }
+
+  void ReportReadPath() {
+    for (auto &result : path_results_) {
+      std::cout << "[Path: " << result.path << "][Advice: "
+                << option_.read_advice << "][Pattern: "
+                << option_.read_pattern << "]\n";
+      result.statistic->Report();
+    }
+    if (cache_) {
+      std::cout << "[Cache]" << cache_->ToString() << "\n";
+    }
+  }
+
+  // Parse --qos_classes, the thread count of the bench becomes the sum of
+  // the threads of the classes
+  bool ParseQosClasses() {
+    qos_classes_.clear();
+    qos_thread_class_.clear();
+    std::stringstream classes(option_.qos_classes);
+    std::string spec;
+    while (std::getline(classes, spec, ',')) {
+      std::vector<std::string> fields;
+      std::stringstream parts(spec);
+      std::string field;
+      while (std::getline(parts, field, ':')) {
+        fields.push_back(field);
+      }
+      if (fields.size() < 4 || fields.size() > 5 ||
+          (fields[1] != "read" && fields[1] != "append")) {
+        printf("Bad qos class %s\n", spec.c_str());
+        return false;
+      }
+      QosClass qos_class;
+      qos_class.name = fields[0];
+      qos_class.kind =
+          fields[1] == "read" ? QosScheduler::kRead : QosScheduler::kAppend;
+      qos_class.threads = strtoull(fields[2].c_str(), nullptr, 10);
+      qos_class.weight = strtoul(fields[3].c_str(), nullptr, 10);
+      qos_class.rate = fields.size() == 5
+                           ? strtoull(fields[4].c_str(), nullptr, 10) << 20
+                           : 0;
+      if (qos_class.threads == 0 || qos_class.weight == 0) {
+        printf("Bad qos class %s\n", spec.c_str());
+        return false;
+      }
+      for (uint64_t i = 0; i < qos_class.threads; ++i) {
+        qos_thread_class_.push_back(qos_classes_.size());
+      }
+      qos_classes_.push_back(qos_class);
+    }
+    if (qos_classes_.empty() || qos_thread_class_.size() > 14) {
+      printf("The qos classes need 1 to 14 threads\n");
+      return false;
+    }
+    option_.threads = qos_thread_class_.size();
+    return true;
+  }
+
+  // Run the tenant classes of --qos_classes side by side twice: issuing
+  // their I/O straight to the device, then through the QoS scheduler. Read
+  // classes read random blocks of the first --zones zones, append classes
+  // write zones of their own and reset them once full
+  void RunQos() {
+    if (!ParseQosClasses()) {
+      return;
+    }
+    if (!PrepareReadZones()) {
+      printf("Failed to fill the zones to read\n");
+      return;
+    }
+    for (bool scheduled : {false, true}) {
+      if (scheduled) {
+        QosScheduler::Options options;
+        options.depth = option_.qos_depth;
+        options.read_priority = option_.qos_read_priority;
+        options.read_burst = option_.qos_read_burst;
+        for (auto &qos_class : qos_classes_) {
+          QosScheduler::ClassOptions class_options;
+          class_options.name = qos_class.name;
+          class_options.weight = qos_class.weight;
+          class_options.rate = qos_class.rate;
+          // 10ms worth of the cap, and at least one I/O
+          class_options.burst =
+              std::max<uint64_t>(option_.bs, qos_class.rate / 100);
+          options.classes.push_back(class_options);
+        }
+        qos_scheduler_ = std::make_unique<QosScheduler>(options);
+      }
+      qos_stats_.clear();
+      for (size_t i = 0; i < qos_classes_.size(); ++i) {
+        qos_stats_.push_back(new Statistics());
+      }
+
+      RunThreads(&Benchmark::QosWorker);
+
+      const char *phase = scheduled ? "scheduled" : "unscheduled";
+      qos_results_.push_back({phase, "", statistic_, kRead, {}});
+      statistic_ = new Statistics();
+      for (size_t i = 0; i < qos_classes_.size(); ++i) {
+        auto &qos_class = qos_classes_[i];
+        QosScheduler::Stats stats;
+        if (scheduled) {
+          stats = qos_scheduler_->GetStats(i);
+        }
+        qos_results_.push_back(
+            {phase, qos_class.name, qos_stats_[i],
+             qos_class.kind == QosScheduler::kRead ? kRead : kWrite, stats});
+      }
+      qos_stats_.clear();
+      qos_scheduler_.reset();
+    }
+  }
+
+  // One thread of a qos class. Every I/O counts towards both the statistics
+  // of all classes and those of its own class
+  static void QosWorker(ThreadState *state) {
+    auto bench = state->bench;
+    auto &option = state->option;
+    auto cls = bench->qos_thread_class_[state->id];
+    auto &zones = bench->readable_zones_;
+    auto scheduler = bench->qos_scheduler_.get();
+    auto class_stat = bench->qos_stats_[cls];
+    bool read = bench->qos_classes_[cls].kind == QosScheduler::kRead;
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
+    memset(buf, '1', option.bs);
+    std::mt19937_64 rng(state->id);
+
+    Zone *zone = nullptr;
+    if (!read) {
+      zone = state->zbd->AcquireEmptyZone();
+      if (!zone) {
+        printf("No empty zone for the %s class\n",
+               bench->qos_classes_[cls].name.c_str());
+        free(buf);
+        return;
+      }
+    }
+
+    auto dura = RunLimit(state);
+    while (!dura.Ending()) {
+      bool ok;
+      if (read) {
+        auto target = zones[rng() % zones.size()];
+        auto off = target->start_ +
+                   rng() % ((target->wp_ - target->start_) / option.bs) *
+                       option.bs;
+        bool hit;
+        MetricsGuard guard(option.bs, state->statistic, kRead);
+        MetricsGuard class_guard(option.bs, class_stat, kRead);
+        ok = scheduler
+                 ? scheduler->Read(cls, target, buf, option.bs, off, &hit)
+                 : target->Read(buf, option.bs, off, &hit);
+      } else {
+        MetricsGuard guard(option.bs, state->statistic, kWrite);
+        MetricsGuard class_guard(option.bs, class_stat, kWrite);
+        ok = scheduler ? scheduler->Append(cls, zone, buf, option.bs)
+                       : zone->Append(buf, option.bs);
+      }
+      if (!ok) {
+        printf("%s of the %s class failed\n", read ? "Read" : "Append",
+               bench->qos_classes_[cls].name.c_str());
+        break;
+      }
+      dura.Done(option.bs);
+      if (zone && zone->GetCapacityLeft() < option.bs && !zone->Reset()) {
+        printf("Failed to reset zone %lu\n", zone->GetZoneNr());
+        break;
+      }
+    }
+
+    // Empty again for the next phase
+    if (zone) {
+      if (!zone->IsEmpty()) {
+        zone->Reset();
+      }
+      zone->CheckRelease();
+    }
+    free(buf);
+  }
+
+  // One phase of the qos bench, of all classes or of one
+  struct QosResult {
+    std::string phase;
+    // Empty for the result of all classes
+    std::string cls;
+    Statistics *statistic;
+    MetricsType type;
+    QosScheduler::Stats scheduler;
+  };
+
+  static std::string QosPhaseName(const QosResult &result) {
+    return result.cls.empty() ? result.phase
+                              : result.phase + ":" + result.cls;
+  }
+
+  void ReportQos() {
+    for (auto &result : qos_results_) {
+      std::cout << "[Phase: " << QosPhaseName(result) << "]\n";
+      if (result.cls.empty()) {
+        result.statistic->Report();
+        continue;
+      }
+      result.statistic->ReportThroughput(result.type);
+      result.statistic->ReportLatency(result.type);
+      auto &stats = result.scheduler;
+      if (stats.ops) {
+        std::cout << "[Scheduler][Wait: " << stats.wait_micros / stats.ops
+                  << "us avg, " << stats.max_wait_micros
+                  << "us max][Throttled: " << stats.throttled << "]\n";
+      }
+    }
+  }
+
+  void WriteQos(JsonWriter *writer) {
+    writer->BeginObject();
+    writer->Field("depth", option_.qos_depth);
+    writer->Field("read_priority", option_.qos_read_priority);
+    writer->Field("read_burst", option_.qos_read_burst);
+    writer->Key("classes");
+    writer->BeginArray();
+    for (size_t i = 0; i < qos_classes_.size(); ++i) {
+      auto &qos_class = qos_classes_[i];
+      writer->BeginObject();
+      writer->Field("name", qos_class.name);
+      writer->Field("job",
+                    qos_class.kind == QosScheduler::kRead ? "read" : "append");
+      writer->Field("threads", qos_class.threads);
+      writer->Field("weight", (uint64_t)qos_class.weight);
+      writer->Field("rate", qos_class.rate);
+      for (auto &result : qos_results_) {
+        if (result.cls != qos_class.name || result.phase != "scheduled") {
+          continue;
+        }
+        auto &stats = result.scheduler;
+        writer->Key("scheduler");
+        writer->BeginObject();
+        writer->Field("ops", stats.ops);
+        writer->Field("bytes", stats.bytes);
+        writer->Field("wait_us", stats.wait_micros);
+        writer->Field("max_wait_us", stats.max_wait_micros);
+        writer->Field("throttled", stats.throttled);
+        writer->EndObject();
+      }
+      writer->EndObject();
+    }
+    writer->EndArray();
+    writer->EndObject();
+  }
+
+  // One reopen of the restart bench
+  struct RestartResult {
+    std::string mode;
+    bool replayed = false;
+    uint64_t open_micros = 0;
+    uint64_t zones = 0;
+    uint64_t reported_zones = 0;
+    // Zones whose state or write pointer differs from before the restart
+    uint64_t wp_mismatches = 0;
+    // Zones whose valid bytes, owner or generation did not survive it
+    uint64_t lost = 0;
+    ZoneJournal::Stats journal;
   };
 
-  // Some thread-local states
-  struct ThreadState {
-    // The method to be executed
-    void (*method)(ThreadState *) = nullptr;
-    // The device to be accessed
-    ZonedBlockDevice *zbd;
-    // configuration
-    Option option;
-    Statistics *statistic;
+  // Write zones with the journal of the device on, then reopen the device
+  // twice: replaying the journal and scanning every zone. Both zone tables
+  // are checked against the one the writes left behind
+  void RunRestart() {
+    auto journal = zbd_->GetJournal();
+    if (zbds_.size() != 1 || !journal) {
+      printf("The restart bench needs one device with a zone journal\n");
+      return;
+    }
+    RunThreads(&Benchmark::JournalWrite);
+    if (!option_.journal_crash && !journal->Sync()) {
+      printf("Failed to sync the zone journal\n");
+      return;
+    }
+    journal_stats_ = journal->GetStats();
+    std::vector<ZoneJournal::Entry> expected;
+    for (size_t i = 0; i < zbd_->GetNrIOZones(); ++i) {
+      expected.push_back(ZoneJournal::EntryOf(zbd_.get(), zbd_->GetIOZone(i)));
+    }
+
+    auto name = zbd_->GetFilename();
+    for (bool replay : {true, false}) {
+      // Closed first, the device is opened exclusively. Should it not open
+      // again, Report() finds no device and bails out
+      zbd_.reset();
+      zbds_[0].reset();
+      auto zbd = std::make_shared<ZonedBlockDevice>(name);
+      zbd->SetOpenThreads(option_.open_threads);
+      if (replay) {
+        zbd->EnableJournal(true, option_.journal_snapshot_records);
+      }
+      if (!zbd->Open(false, true)) {
+        printf("Failed to reopen %s\n", name.c_str());
+        return;
+      }
+      // A new device object, --cache_size and --zone_stats carry over
+      if (cache_) {
+        zbd->SetBlockCache(cache_.get());
+      }
+      if (zone_stats_) {
+        zbd->SetZoneStats(zone_stats_.get());
+      }
+      restart_results_.push_back(
+          CheckRestart(replay ? "replay" : "scan", zbd.get(), expected));
+      zbd_ = zbds_[0] = zbd;
+    }
+  }
+
+  // Take an empty zone for writer `id`, or recycle the zone with the
+  // fewest valid bytes, which bumps its generation
+  static Zone *AcquireJournalZone(ZonedBlockDevice *zbd, uint32_t id) {
+    auto zone = zbd->AcquireEmptyZone();
+    if (!zone) {
+      zone = zbd->AcquireLeastUsedZone();
+      if (!zone) {
+        return nullptr;
+      }
+      // Whatever it still holds is dropped
+      zone->used_capacity_ = 0;
+      zone->owner_ = Zone::kNoOwner;
+      if (!zone->Reset()) {
+        zone->CheckRelease();
+        return nullptr;
+      }
+    }
+    zone->owner_ = id;
+    zbd->GetJournal()->Log(zone);
+    return zone;
+  }
+
+  // Append --bs at a time and journal the valid bytes of the zone after
+  // every write, as a store keeping track of its live data would
+  static void JournalWrite(ThreadState *state) {
+    auto &option = state->option;
+    auto zbd = state->zbd;
+    auto journal = zbd->GetJournal();
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
+    memset(buf, '1', option.bs);
+
+    Zone *zone = nullptr;
+    auto dura = RunLimit(state);
+    while (!dura.Ending()) {
+      if (!zone && !(zone = AcquireJournalZone(zbd, state->id))) {
+        printf("No zone left for the journal writer\n");
+        break;
+      }
+      // Counted first, so that the record of a zone filling up has it
+      zone->used_capacity_ += option.bs;
+      {
+        MetricsGuard guard(option.bs, state->statistic, kWrite);
+        if (!zone->Append(buf, option.bs)) {
+          printf("Zone append failed\n");
+          zone->used_capacity_ -= option.bs;
+          break;
+        }
+      }
+      dura.Done(option.bs);
+      if (zone->GetCapacityLeft() >= option.bs) {
+        journal->Log(zone);
+        continue;
+      }
+      // Full zones journal themselves, so do finished ones
+      if (!zone->IsFull()) {
+        zone->Finish();
+      }
+      zone->CheckRelease();
+      zone = nullptr;
+    }
+    if (zone) {
+      zone->CheckRelease();
+    }
+    free(buf);
+  }
+
+  // Compare the zone table of the reopened `zbd` with `expected`, by zone
+  // number since a scan also lists the metadata zones
+  RestartResult CheckRestart(const std::string &mode, ZonedBlockDevice *zbd,
+                             const std::vector<ZoneJournal::Entry> &expected) {
+    RestartResult result;
+    result.mode = mode;
+    result.open_micros = zbd->GetOpenMicros();
+    result.zones = zbd->GetNrIOZones();
+    result.reported_zones = zbd->GetReportedZones();
+    if (zbd->GetJournal()) {
+      result.journal = zbd->GetJournal()->GetStats();
+      // Epochs start at 1, a journal started by a scan never replayed one
+      result.replayed = result.journal.replay_epoch > 0;
+    }
+
+    std::unordered_map<uint64_t, Zone *> zones;
+    for (auto &zone : zbd->io_zones_) {
+      zones[zone.GetZoneNr()] = &zone;
+    }
+    for (auto &entry : expected) {
+      auto it = zones.find(entry.zone_nr);
+      if (it == zones.end()) {
+        result.wp_mismatches++;
+        continue;
+      }
+      auto zone = it->second;
+      // Devices report full zones with the write pointer at the zone end
+      bool full = entry.state == ZoneJournal::kFull;
+      if (zone->IsFull() != full ||
+          (!full && zone->wp_ - zone->start_ != entry.wp)) {
+        result.wp_mismatches++;
+      }
+      if (zone->used_capacity_ != entry.valid ||
+          zone->owner_ != entry.owner ||
+          zone->generation_ != entry.generation) {
+        result.lost++;
+      }
+    }
+    return result;
+  }
+
+  void ReportRestart() {
+    std::cout << "[Journal]" << journal_stats_.ToString() << "\n";
+    for (auto &result : restart_results_) {
+      std::cout << "[Restart: " << result.mode << "][Open: "
+                << result.open_micros << "us][Zones: " << result.zones
+                << "][Reported: " << result.reported_zones
+                << "][Write pointer mismatches: " << result.wp_mismatches
+                << "][Metadata lost: " << result.lost << "]";
+      if (result.replayed) {
+        std::cout << "[Replay: " << result.journal.replay_micros
+                  << "us][Replay bytes: " << result.journal.replay_bytes
+                  << "][Replay records: " << result.journal.replay_records
+                  << "][Torn: " << result.journal.torn << "]";
+      }
+      std::cout << "\n";
+    }
+  }
+
+  void WriteRestart(JsonWriter *writer) {
+    writer->BeginObject();
+    writer->Field("crash", option_.journal_crash);
+    writer->Field("snapshot_records", option_.journal_snapshot_records);
+    writer->Key("journal");
+    writer->BeginObject();
+    writer->Field("records", journal_stats_.records);
+    writer->Field("blocks", journal_stats_.blocks);
+    writer->Field("syncs", journal_stats_.syncs);
+    writer->Field("snapshots", journal_stats_.snapshots);
+    writer->Field("bytes", journal_stats_.bytes);
+    writer->EndObject();
+    writer->Key("opens");
+    writer->BeginArray();
+    for (auto &result : restart_results_) {
+      writer->BeginObject();
+      writer->Field("mode", result.mode);
+      writer->Field("replayed", result.replayed);
+      writer->Field("open_us", result.open_micros);
+      writer->Field("zones", result.zones);
+      writer->Field("reported_zones", result.reported_zones);
+      writer->Field("wp_mismatches", result.wp_mismatches);
+      writer->Field("metadata_lost", result.lost);
+      if (result.replayed) {
+        writer->Field("replay_us", result.journal.replay_micros);
+        writer->Field("replay_bytes", result.journal.replay_bytes);
+        writer->Field("replay_records", result.journal.replay_records);
+        writer->Field("torn", result.journal.torn);
+      }
+      writer->EndObject();
+    }
+    writer->EndArray();
+    writer->EndObject();
+  }
+
+  // Issue random reads to the zones that hold data from one thread, with the
+  // queue depth driven by the SLO controller
+  void RunSlo() {
+    for (auto &zone : zbd_->io_zones_) {
+      if (zone.wp_ - zone.start_ >= option_.bs) {
+        readable_zones_.push_back(&zone);
+      }
+    }
+    if (readable_zones_.empty()) {
+      printf("slo reads written zones, fill some first, e.g. with "
+             "--precondition\n");
+      return;
+    }
+    slo_ = std::make_unique<SloController>(option_.slo_option);
+    auto threads = option_.threads;
+    option_.threads = 1;
+    RunThreads(&Benchmark::SloRead);
+    option_.threads = threads;
+  }
+
+  static void SloRead(ThreadState *state) {
+    auto bench = state->bench;
+    auto &option = state->option;
+    auto &zones = bench->readable_zones_;
+    auto &slo = *bench->slo_;
+    uint32_t max_depth = slo.GetOptions().max_depth;
+
+    AsyncIOQueue queue(max_depth);
+    if (!queue.Init()) {
+      printf("Failed to set up the slo read queue\n");
+      return;
+    }
+    // Submission time of the read in flight in every slot
+    struct Slot {
+      char *buf = nullptr;
+      uint64_t start = 0;
+    };
+    std::vector<Slot> slots(max_depth);
+    std::vector<Slot *> free_slots;
+    for (auto &slot : slots) {
+      posix_memalign((void **)&slot.buf, sysconf(_SC_PAGESIZE), option.bs);
+      free_slots.push_back(&slot);
+    }
+    std::vector<io_event> events(max_depth);
+    auto read_f = state->zbd->GetReadDirectFD();
+    std::mt19937_64 rng(state->id);
+
+    HistogramStat interval;
+    uint64_t interval_bytes = 0;
+    uint64_t interval_start = FastClock::Now();
+    auto dura = RunLimit(state);
+    bool ending = false;
+    while (!ending || queue.InFlight() > 0) {
+      // The depth may have been cut below what is in flight, those reads
+      // just drain
+      while (!ending && queue.InFlight() < slo.Depth()) {
+        if (dura.Ending()) {
+          ending = true;
+          break;
+        }
+        auto zone = zones[rng() % zones.size()];
+        auto blocks = (zone->wp_ - zone->start_) / option.bs;
+        auto off = zone->start_ + rng() % blocks * option.bs;
+        auto slot = free_slots.back();
+        slot->start = FastClock::Now();
+        if (!queue.SubmitRead(read_f, slot->buf, option.bs, off, slot)) {
+          printf("Failed to submit a slo read\n");
+          ending = true;
+          break;
+        }
+        free_slots.pop_back();
+      }
+      if (queue.InFlight() == 0) {
+        break;
+      }
+
+      int n = queue.Reap(1, events.size(), events.data());
+      if (n < 0) {
+        break;
+      }
+      auto now = FastClock::Now();
+      for (int i = 0; i < n; ++i) {
+        auto slot = static_cast<Slot *>(events[i].data);
+        free_slots.push_back(slot);
+        if (static_cast<int64_t>(events[i].res) !=
+            static_cast<int64_t>(option.bs)) {
+          printf("Slo read failed: %ld\n",
+                 static_cast<int64_t>(events[i].res));
+          ending = true;
+          continue;
+        }
+        // Charged once completed, so the reads in flight when the limit is
+        // reached run past it by at most the queue depth
+        dura.Done(option.bs);
+        auto latency = FastClock::ToMicros(now - slot->start);
+        interval.Add(latency);
+        interval_bytes += option.bs;
+        state->statistic->AddLatency(kRead, latency);
+        state->statistic->AddBytes(kRead, option.bs);
+      }
+
+      auto micros = FastClock::ToMicros(now - interval_start);
+      if (micros >= option.slo_interval_ms * 1000) {
+        auto depth = slo.Depth();
+        slo.Update(micros, interval_bytes, interval);
+        auto &sample = slo.Trace().back();
+        bench->Log() << "[SLO][QD: " << depth << "][P99: " << sample.p99
+                     << "us][IOPS: " << sample.ops * 1e6 / micros
+                     << "][Next QD: " << slo.Depth() << "]\n";
+        interval.Clear();
+        interval_bytes = 0;
+        interval_start = now;
+      }
+    }
+
+    for (auto &slot : slots) {
+      free(slot.buf);
+    }
+  }
+
+  void ReportSlo() {
+    auto &options = slo_->GetOptions();
+    std::cout << "[SLO: P99 <= " << options.target_p99_us << "us]"
+              << slo_->Sustained().ToString() << "\n";
+    for (auto &sample : slo_->Trace()) {
+      std::cout << "  [QD: " << sample.depth << "][P99: " << sample.p99
+                << "us][IOPS: " << sample.ops * 1e6 / sample.micros
+                << "][Throughput: "
+                << ToMiB(sample.bytes) * 1e6 / sample.micros << "MiB/s]"
+                << (sample.met ? "" : "[Missed]") << "\n";
+    }
+  }
+
+  void WriteSlo(JsonWriter *writer) {
+    auto &options = slo_->GetOptions();
+    auto best = slo_->Sustained();
+    writer->BeginObject();
+    writer->Field("target_p99_us", options.target_p99_us);
+    writer->Field("found", best.found);
+    if (best.found) {
+      writer->Field("depth", (uint64_t)best.depth);
+      writer->Field("intervals", (uint64_t)best.intervals);
+      writer->Field("iops", best.iops);
+      writer->Field("throughput_mibs", ToMiB(best.throughput));
+      writer->Field("p99_us", best.p99);
+    }
+    writer->Key("trace");
+    writer->BeginArray();
+    for (auto &sample : slo_->Trace()) {
+      writer->BeginObject();
+      writer->Field("us", sample.micros);
+      writer->Field("depth", (uint64_t)sample.depth);
+      writer->Field("ops", sample.ops);
+      writer->Field("bytes", sample.bytes);
+      writer->Field("p99_us", sample.p99);
+      writer->Field("met", sample.met);
+      writer->EndObject();
+    }
+    writer->EndArray();
+    writer->EndObject();
+  }
+
+  // Thread 0 copies the source zone to every other zone in turn, the rest
+  // issue random reads to the zones that hold data
+  static void ZoneCopyWorker(ThreadState *state) {
+    auto bench = state->bench;
+    auto &option = state->option;
+    if (state->id != 0) {
+      RandomReads(state, bench->readable_zones_, bench->copy_read_blocks_);
+      return;
+    }
+    if (!bench->copy_phase_) {
+      return;
+    }
+
+    auto zbd = state->zbd;
+    ZoneCopier::Options copy_option;
+    copy_option.chunk_size = option.copy_chunk;
+    copy_option.depth = option.copy_depth;
+    copy_option.simple_copy = option.simple_copy;
+    if (option.io_phases) {
+      copy_option.phase_stats = state->statistic;
+    }
+    ZoneCopier copier(zbd, copy_option);
+    if (!copier.Init()) {
+      printf("Failed to set up the zone copier\n");
+      return;
+    }
+
+    // Only into zones the readers never pick
+    auto &dsts = bench->copy_dsts_;
+    auto dura = RunLimit(state);
+    uint64_t next = 0;
+    while (!dura.Ending()) {
+      auto dst = dsts[next];
+      next = (next + 1) % dsts.size();
+      if (!dst->Acquire()) {
+        continue;
+      }
+      if (!dst->IsEmpty() && !dst->Reset()) {
+        assert(false);
+      }
+
+      uint64_t copied = 0;
+      auto start = Duration::NowTime();
+      bool ok = copier.Copy(bench->copy_src_, dst, &copied);
+      auto us = std::max<uint64_t>(Duration::ElapseTimeMicro(start), 1);
+      if (ok) {
+        state->statistic->AddLatency(kCopy, us);
+        state->statistic->AddThroughput(kCopy, (double)copied * 1e6 / us);
+        state->statistic->AddBytes(kCopy, copied);
+        dura.Done(copied);
+      }
+
+      // Leave the copy behind empty for the next round
+      dst->Reset();
+      dst->CheckRelease();
+      if (!ok) {
+        printf("Zone copy failed\n");
+        break;
+      }
+    }
+  }
+
+  // Read random blocks of `zones` until the duration ends, below the
+  // `blocks` of each that were written before the threads started. wp_ is
+  // not read here, a writer may move it concurrently
+  static void RandomReads(ThreadState *state,
+                          const std::vector<Zone *> &zones,
+                          const std::vector<uint64_t> &blocks) {
+    auto &option = state->option;
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
+    auto read_f = state->zbd->GetReadDirectFD();
+    std::mt19937_64 rng(state->id);
 
-    // Id of this running thread
-    uint64_t id;
-  };
+    auto dura = RunLimit(state);
+    while (!dura.Ending()) {
+      auto idx = rng() % zones.size();
+      auto zone = zones[idx];
+      if (blocks[idx] == 0) {
+        continue;
+      }
+      auto off = zone->start_ + rng() % blocks[idx] * option.bs;
+      MetricsGuard guard(option.bs, state->statistic, kRead);
+      DirectRead(state, zone, read_f, buf, off);
+      dura.Done(option.bs);
+    }
+    free(buf);
+  }
+
+  // pread() of one block, counted for its zone when --zone_stats is on since
+  // it bypasses Zone::Read()
+  static void DirectRead(ThreadState *state, Zone *zone, int read_f,
+                         char *buf, uint64_t off) {
+    auto bs = state->option.bs;
+    auto zone_stats = state->zbd->GetZoneStats();
+    if (!zone_stats) {
+      pread(read_f, buf, bs, off);
+      return;
+    }
+    auto start = FastClock::Now();
+    pread(read_f, buf, bs, off);
+    zone_stats->AddRead(zone->GetZoneNr(), bs,
+                        FastClock::ToMicros(FastClock::Now() - start));
+  }
+
+  // Threads below --writers append, the others read from the zones of the
+  // current read placement
+  static void ReadWriteWorker(ThreadState *state) {
+    if (state->id < state->option.writers) {
+      ReadWriteAppend(state);
+    } else {
+      ReadWriteRead(state);
+    }
+  }
+
+  static void ReadWriteAppend(ThreadState *state) {
+    auto bench = state->bench;
+    auto &option = state->option;
+    auto &zones = bench->rw_write_zones_;
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
+    memset(buf, '1', option.bs);
+    std::mt19937_64 rng(state->id);
+
+    auto dura = RunLimit(state);
+    Zone *zone = nullptr;
+    while (!dura.Ending()) {
+      if (!zone) {
+        zone = zones[rng() % zones.size()];
+        if (!zone->Acquire()) {
+          zone = nullptr;
+          continue;
+        }
+        // No reader may be in the zone while it is reset
+        bench->ForgetFinishedZone(zone);
+        bench->RetireReadZone(zone);
+        if (!zone->IsEmpty() && !zone->Reset()) {
+          assert(false);
+        }
+        bench->rw_active_[state->id].store(zone);
+      }
+      {
+        MetricsGuard guard(option.bs, state->statistic, kWrite);
+        if (!zone->Append(buf, option.bs)) {
+          break;
+        }
+      }
+      // Readers only go by this count, never by wp_
+      auto &readable = bench->GetRwZone(zone).blocks;
+      readable.store(readable.load() + 1);
+      dura.Done(option.bs);
+      if (zone->GetCapacityLeft() < option.bs) {
+        bench->rw_active_[state->id].store(nullptr);
+        bench->AddFinishedZone(zone);
+        zone->CheckRelease();
+        zone = nullptr;
+      }
+    }
+
+    bench->rw_active_[state->id].store(nullptr);
+    if (zone) {
+      zone->CheckRelease();
+    }
+    free(buf);
+  }
 
-  struct Duration {
-    using TimePoint = decltype(std::chrono::steady_clock::now());
-    TimePoint start;
-    uint64_t limit;
+  static void ReadWriteRead(ThreadState *state) {
+    auto bench = state->bench;
+    auto &option = state->option;
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
+    auto read_f = state->zbd->GetReadDirectFD();
+    std::mt19937_64 rng(state->id);
 
-    Duration(const uint64_t seconds) : start(NowTime()), limit(seconds) {}
+    auto dura = RunLimit(state);
+    while (!dura.Ending()) {
+      auto zone = bench->PickReadZone(&rng);
+      if (!zone) {
+        std::this_thread::yield();
+        continue;
+      }
+      // Registered as a reader before the count is loaded, so that a writer
+      // that zeroed the count waits for this read before resetting the zone
+      auto &rz = bench->GetRwZone(zone);
+      rz.readers.fetch_add(1);
+      auto blocks = rz.blocks.load();
+      if (blocks == 0) {
+        // Nothing written yet, or about to be reset
+        rz.readers.fetch_sub(1);
+        std::this_thread::yield();
+        continue;
+      }
+      auto off = zone->start_ + rng() % blocks * option.bs;
+      {
+        MetricsGuard guard(option.bs, state->statistic, kRead);
+        DirectRead(state, zone, read_f, buf, off);
+      }
+      rz.readers.fetch_sub(1);
+      dura.Done(option.bs);
+    }
+    free(buf);
+  }
 
-    bool Ending() { return ElapseTimeMicro(start) >= limit * 1000000; }
+  struct RwZone;
 
-    static TimePoint NowTime() { return std::chrono::steady_clock::now(); }
+  RwZone &GetRwZone(Zone *zone) {
+    return rw_zones_[zone - zbd_->GetIOZone(0)];
+  }
 
-    static uint64_t ElapseTimeMicro(TimePoint _start) {
-      auto dura = std::chrono::duration_cast<std::chrono::microseconds>(
-          NowTime() - _start);
-      return dura.count();
+  // Hide the blocks of `zone` from new reads and wait for those in flight
+  void RetireReadZone(Zone *zone) {
+    auto &rz = GetRwZone(zone);
+    rz.blocks.store(0);
+    while (rz.readers.load()) {
+      std::this_thread::yield();
     }
-  };
+  }
 
-  struct MetricsGuard {
-    using TimePoint = decltype(std::chrono::steady_clock::now());
-    TimePoint start;
-    uint64_t sz;
-    MetricsType type;
-    Statistics *statistic;
+  Zone *PickReadZone(std::mt19937_64 *rng) {
+    switch (rw_placement_) {
+    case ReadPlacement::kSame:
+      return rw_active_[(*rng)() % option_.writers].load();
+    case ReadPlacement::kDisjoint:
+      return rw_read_zones_[(*rng)() % rw_read_zones_.size()];
+    case ReadPlacement::kFinished: {
+      std::lock_guard<std::mutex> lck(rw_mtx_);
+      if (rw_finished_.empty()) {
+        return nullptr;
+      }
+      return rw_finished_[(*rng)() % rw_finished_.size()];
+    }
+    }
+    return nullptr;
+  }
+
+  // Remember the most recently filled zones for the finished readers
+  void AddFinishedZone(Zone *zone) {
+    std::lock_guard<std::mutex> lck(rw_mtx_);
+    rw_finished_.push_back(zone);
+    if (rw_finished_.size() > kMaxFinishedZones) {
+      rw_finished_.pop_front();
+    }
+  }
 
-    MetricsGuard(uint64_t _sz, Statistics *_statistic, MetricsType _type)
-        : start(Duration::NowTime()), sz(_sz), statistic(_statistic),
-          type(_type) {}
+  void ForgetFinishedZone(Zone *zone) {
+    std::lock_guard<std::mutex> lck(rw_mtx_);
+    auto it = std::find(rw_finished_.begin(), rw_finished_.end(), zone);
+    if (it != rw_finished_.end()) {
+      rw_finished_.erase(it);
+    }
+  }
 
-    ~MetricsGuard() {
-      auto dura = Duration::ElapseTimeMicro(start);
-      auto thpt = (double)sz * 1e6 / dura;
-      statistic->AddThroughput(type, thpt);
-      statistic->AddLatency(type, dura);
+  void ReportReadWrite() {
+    for (auto &result : rw_results_) {
+      std::cout << "[Read placement: " << result.placement << "]\n";
+      std::cout << "[Read]";
+      result.statistic->ReportLatency(kRead);
+      std::cout << "[Write]";
+      result.statistic->ReportLatency(kWrite);
     }
+  }
+
+  struct ZoneFinishResult;
+
+  // Statistics of one run of the bench, e.g. one placement policy
+  struct Phase {
+    std::string name;
+    Statistics *statistic;
+    const GcStats *gc;
+    const ZoneWriteSequencer::Stats *sequencer = nullptr;
+    const ZoneFinishResult *finish = nullptr;
   };
 
-public:
-  Benchmark(const Option &option)
-      : option_(option), zbd_(std::make_shared<ZonedBlockDevice>(option.dev)) {
-    if (!zbd_->Open(false, true)) {
-      assert(false);
+  std::vector<Phase> Phases() {
+    std::vector<Phase> phases;
+    if (option_.bench == "placement") {
+      for (auto &result : placement_results_) {
+        phases.push_back({result.policy, result.statistic, &result.gc});
+      }
+      return phases;
     }
-    statistic_ = new Statistics();
+    if (option_.bench == "rwmix") {
+      for (auto &result : rw_results_) {
+        phases.push_back({result.placement, result.statistic, nullptr});
+      }
+      return phases;
+    }
+    if (option_.bench == "zonefinish") {
+      for (auto &result : finish_results_) {
+        phases.push_back({"threshold:" + std::to_string(result.threshold),
+                          result.statistic, nullptr, nullptr, &result});
+      }
+      return phases;
+    }
+    if (option_.bench == "parity") {
+      for (auto &result : parity_results_) {
+        phases.push_back({result.name, result.statistic, nullptr});
+      }
+      return phases;
+    }
+    if (option_.bench == "readpath") {
+      for (auto &result : path_results_) {
+        phases.push_back({result.path, result.statistic, nullptr});
+      }
+      return phases;
+    }
+    if (option_.bench == "qos") {
+      for (auto &result : qos_results_) {
+        phases.push_back({QosPhaseName(result), result.statistic, nullptr});
+      }
+      return phases;
+    }
+    if (option_.bench == "daemon") {
+      for (auto &result : daemon_results_) {
+        phases.push_back({result.access, result.statistic, nullptr});
+      }
+      return phases;
+    }
+    if (option_.bench == "zoneqd") {
+      for (auto &result : qd_results_) {
+        phases.push_back(
+            {result.scheduler, result.statistic, nullptr, &result.sequencer});
+      }
+      return phases;
+    }
+    if (baseline_stat_) {
+      phases.push_back({"baseline", baseline_stat_, nullptr});
+    }
+    phases.push_back(
+        {option_.bench, statistic_, has_gc_stats_ ? &gc_stats_ : nullptr});
+    if (option_.bench == "stripe") {
+      for (size_t i = 0; i < zbds_.size(); ++i) {
+        phases.push_back({"device:" + zbds_[i]->GetFilename(),
+                          device_stats_[i], nullptr});
+      }
+    }
+    return phases;
   }
 
-  ~Benchmark() { delete statistic_; }
+  void ReportJson() {
+    std::ofstream file;
+    if (!option_.output_file.empty()) {
+      file.open(option_.output_file);
+      if (!file) {
+        printf("Failed to open %s\n", option_.output_file.c_str());
+        return;
+      }
+    }
+    std::ostream &out = file.is_open() ? file : std::cout;
+
+    JsonWriter writer(out);
+    writer.BeginObject();
+    writer.Key("metadata");
+    WriteMetadata(&writer);
 
-  void Run() {
-    // Do not support threads number great than 14
-    if (option_.threads > 14) {
-      abort();
+    writer.Key("phases");
+    writer.BeginArray();
+    for (auto &phase : Phases()) {
+      writer.BeginObject();
+      writer.Field("name", phase.name);
+      writer.Key("stats");
+      phase.statistic->WriteJson(&writer);
+      if (phase.gc) {
+        writer.Key("space");
+        WriteGcStats(&writer, *phase.gc);
+      }
+      if (phase.finish) {
+        auto finish = phase.finish;
+        writer.Key("zones");
+        writer.BeginObject();
+        writer.Field("finish_threshold", finish->threshold);
+        writer.Field("finishes", finish->finishes);
+        writer.Field("finish_failures", finish->finish_failures);
+        writer.Field("finish_waste", finish->finish_waste);
+        writer.Field("closes", finish->closes);
+        writer.Field("idle_closes", finish->lifecycle.idle_closes);
+        writer.Field("over_open", finish->lifecycle.over_open);
+        writer.Field("allocations", finish->lifecycle.allocations);
+        writer.Field("deferred_allocations", finish->lifecycle.deferred);
+        writer.Field("max_active", (uint64_t)finish->lifecycle.max_active);
+        writer.Field("max_open", (uint64_t)finish->lifecycle.max_open);
+        writer.EndObject();
+      }
+      if (phase.sequencer) {
+        writer.Key("sequencer");
+        writer.BeginObject();
+        writer.Field("writes", phase.sequencer->writes);
+        writer.Field("bytes", phase.sequencer->bytes);
+        writer.Field("retries", phase.sequencer->retries);
+        writer.Field("recoveries", phase.sequencer->recoveries);
+        writer.EndObject();
+      }
+      writer.EndObject();
     }
+    writer.EndArray();
 
-    for (uint64_t i = 0; i < option_.threads; ++i) {
-      auto thread_stat = &thread_stats_[i];
+    if (!precondition_stats_.empty()) {
+      writer.Key("precondition");
+      writer.BeginArray();
+      for (size_t i = 0; i < precondition_stats_.size(); ++i) {
+        auto &stats = precondition_stats_[i];
+        writer.BeginObject();
+        writer.Field("device", zbds_[i]->GetFilename());
+        writer.Field("zones_full", stats.zones_full);
+        writer.Field("zones_partial", stats.zones_partial);
+        writer.Field("zones_empty", stats.zones_empty);
+        writer.Field("resets", stats.resets);
+        writer.Field("bytes", stats.bytes);
+        writer.Field("reset_us", stats.reset_micros);
+        writer.Field("fill_us", stats.fill_micros);
+        writer.EndObject();
+      }
+      writer.EndArray();
+    }
 
-      thread_stat->option = option_;
-      thread_stat->id = i;
-      thread_stat->statistic = statistic_;
-      thread_stat->zbd = zbd_.get();
+    if (slo_) {
+      writer.Key("slo");
+      WriteSlo(&writer);
+    }
+
+    if (daemon_stats_) {
+      writer.Key("daemon");
+      WriteDaemonStats(&writer);
+    }
+
+    if (option_.bench == "parity") {
+      writer.Key("parity");
+      WriteParity(&writer);
+    }
+
+    if (option_.bench == "restart") {
+      writer.Key("restart");
+      WriteRestart(&writer);
+    }
+
+    if (option_.bench == "qos") {
+      writer.Key("qos");
+      WriteQos(&writer);
+    }
+
+    if (cache_) {
+      writer.Key("cache");
+      writer.BeginObject();
+      writer.Field("hits", cache_->Hits());
+      writer.Field("misses", cache_->Misses());
+      writer.Field("hit_ratio", cache_->HitRatio());
+      writer.EndObject();
+    }
+    writer.EndObject();
+    out << "\n";
+  }
 
-      if (option_.bench == "writeseq") {
-        thread_stat->method = &Benchmark::WriteSeq;
-      } else if (option_.bench == "readseq") {
-        thread_stat->method = &Benchmark::ReadSeq;
-      } else if (option_.bench == "readrandom") {
-        thread_stat->method = &Benchmark::ReadRandom;
+  // Everything needed to tell two result files apart: when and where the
+  // run happened, the flags it ran with, and the devices with their firmware
+  void WriteMetadata(JsonWriter *writer) {
+    writer->BeginObject();
+    char now[32];
+    time_t t = time(nullptr);
+    strftime(now, sizeof(now), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    writer->Field("time", now);
+    char host[256] = {};
+    gethostname(host, sizeof(host) - 1);
+    writer->Field("host", host);
+    struct utsname uts;
+    if (uname(&uts) == 0) {
+      writer->Field("kernel", std::string(uts.release) + " " + uts.version);
+    }
+    writer->Field("command_line", google::GetArgv());
+    writer->Field("clock", FastClock::UsesTsc() ? "tsc" : "steady_clock");
+
+    writer->Key("flags");
+    writer->BeginObject();
+    std::vector<google::CommandLineFlagInfo> flags;
+    google::GetAllFlags(&flags);
+    for (auto &flag : flags) {
+      if (flag.filename.find("zns_bench") != std::string::npos) {
+        writer->Field(flag.name, flag.current_value);
       }
+    }
+    writer->EndObject();
 
-      running_threads_.emplace_back(YieldThread(thread_stat));
+    writer->Key("devices");
+    writer->BeginArray();
+    for (auto &zbd : zbds_) {
+      auto name = zbd->GetFilename();
+      auto sysfs = "/sys/block/" + name.substr(name.rfind('/') + 1) +
+                   "/device/";
+      writer->BeginObject();
+      writer->Field("name", name);
+      writer->Field("model", ReadSysfs(sysfs + "model"));
+      writer->Field("firmware", ReadSysfs(sysfs + "firmware_rev"));
+      writer->Field("zones", (uint64_t)zbd->GetNrIOZones());
+      writer->Field("zone_size", zbd->GetZoneSize());
+      writer->Field("zone_capacity", zbd->GetIOZone(0)->max_capacity_);
+      writer->Field("block_size", (uint64_t)zbd->GetBlockSize());
+      writer->EndObject();
     }
+    writer->EndArray();
+    writer->EndObject();
+  }
 
-    // Wait for exit
-    for (auto t : running_threads_) {
-      t->join();
+  // First line of a sysfs attribute, empty if it does not exist
+  static std::string ReadSysfs(const std::string &path) {
+    std::ifstream file(path);
+    std::string value;
+    std::getline(file, value);
+    while (!value.empty() && isspace((unsigned char)value.back())) {
+      value.pop_back();
     }
+    return value;
   }
 
-  void Report() { statistic_->Report(); }
+  static void WriteGcStats(JsonWriter *writer, const GcStats &gc) {
+    writer->BeginObject();
+    writer->Field("objects", gc.objects);
+    writer->Field("user_bytes", gc.user_bytes);
+    writer->Field("gc_bytes", gc.gc_bytes);
+    writer->Field("gc_us", gc.gc_micros);
+    writer->Field("gc_runs", gc.gc_runs);
+    writer->Field("resets", gc.resets);
+    writer->Field("write_amplification", gc.WriteAmplification());
+    writer->Key("victim_valid_hist");
+    writer->BeginArray();
+    for (auto count : gc.victim_valid_hist) {
+      writer->Uint(count);
+    }
+    writer->EndArray();
+    writer->EndObject();
+  }
+
+  // Where progress lines go, away from json results printed to stdout
+  std::ostream &Log() {
+    if (option_.output == "json" && option_.output_file.empty()) {
+      return std::cerr;
+    }
+    return std::cout;
+  }
+
+  void ReportPlacement() {
+    for (auto &result : placement_results_) {
+      auto &gc = result.gc;
+      double resets_per_gib =
+          gc.user_bytes ? gc.resets / (ToMiB(gc.user_bytes) / 1024) : 0;
+      std::cout << "[Placement: " << result.policy << "]" << gc.ToString()
+                << "[Resets/GiB: " << resets_per_gib << "]"
+                << "[Write P99: " << result.write_latency.percentile99
+                << "us][Write Max: " << result.write_latency.max << "us]\n"
+                << "  [Victim valid distribution] " << gc.VictimHistogram()
+                << "\n";
+    }
+  }
+
+  // Print the operations and CPU cost of every report interval until all
+  // benchmark threads exit
+  void Monitor() {
+    auto interval = std::chrono::seconds(option_.report_interval);
+    uint64_t last_ops = statistic_->OpCount();
+    uint64_t last_read = statistic_->Bytes(kRead);
+    uint64_t last_write = statistic_->Bytes(kWrite);
+    auto last_time = Duration::NowTime();
+    CpuUsage last_cpu = SampleCpu();
+    std::vector<ZoneStats::Counters> last_zones;
+    if (zone_stats_) {
+      last_zones = zone_stats_->Snapshot();
+    }
+    uint64_t tick = 0;
+
+    std::unique_lock<std::mutex> lck(monitor_mtx_);
+    while (!monitor_cv_.wait_for(lck, interval, [this] { return finished_; })) {
+      ++tick;
+      auto ops = statistic_->OpCount();
+      auto read = statistic_->Bytes(kRead);
+      auto write = statistic_->Bytes(kWrite);
+      auto now = Duration::NowTime();
+      auto cpu = SampleCpu();
+      auto delta_ops = ops - last_ops;
+      auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+          now - last_time);
+      statistic_->AddInterval({(uint64_t)micros.count(), delta_ops,
+                               read - last_read, write - last_write});
+      if (zone_stats_) {
+        AddZoneInterval(micros.count(), &last_zones);
+      }
+      Log() << "[Interval " << tick * option_.report_interval << "s]"
+            << "[IOPS: " << delta_ops / option_.report_interval << "]"
+            << cpu.Since(last_cpu).ToString(delta_ops) << "\n";
+      last_ops = ops;
+      last_read = read;
+      last_write = write;
+      last_time = now;
+      last_cpu = cpu;
+    }
+  }
+
+  // Keep what every zone did since `last`, and move `last` to now
+  void AddZoneInterval(uint64_t micros,
+                       std::vector<ZoneStats::Counters> *last) {
+    auto zones = zone_stats_->Snapshot();
+    std::vector<ZoneStats::Counters> delta(zones.size());
+    for (size_t i = 0; i < zones.size(); ++i) {
+      delta[i] = zones[i].Since((*last)[i]);
+    }
+    zone_export_.intervals.push_back(std::move(delta));
+    zone_export_.interval_micros.push_back(micros);
+    *last = std::move(zones);
+  }
+
+  void WriteZoneStats() {
+    auto &path = option_.zone_stats;
+    std::ofstream file(path);
+    if (!file) {
+      printf("Failed to open %s\n", path.c_str());
+      return;
+    }
+    zone_export_.total = zone_stats_->Snapshot();
+    zone_export_.run_micros = statistic_->WallMicros();
+    auto ext = path.rfind('.');
+    if (ext != std::string::npos && path.substr(ext) == ".json") {
+      ZoneStats::WriteJson(file, zone_export_);
+    } else {
+      ZoneStats::WriteCsv(file, zone_export_);
+    }
+    Log() << "[Zone stats][Zones: " << zone_export_.total.size()
+          << "][Intervals: " << zone_export_.intervals.size() << "]["
+          << path << "]\n";
+  }
+
+  // Process wide user/sys time plus the hardware counters of all running
+  // benchmark threads
+  CpuUsage SampleCpu() {
+    auto usage = ThreadCpuCounter::ReadProcess();
+    CpuUsage counters;
+    for (uint64_t i = 0; i < option_.threads; ++i) {
+      if (thread_stats_[i].cpu.IsOpen()) {
+        counters.Merge(thread_stats_[i].cpu.ReadCounters());
+      }
+    }
+    usage.cycles = counters.cycles;
+    usage.instructions = counters.instructions;
+    return usage;
+  }
 
-private:
   static void WriteSeq(ThreadState *state) {
     auto zbd = state->zbd;
+    // Writes of this bench carry no lifetime hint
+    auto placement = PlacementPolicy::Create(
+        state->option.placement,
+        state->id * zbd->GetNrIOZones() / state->option.threads);
+    if (!placement || state->option.placement == "hint") {
+      printf("writeseq supports random or roundrobin placement\n");
+      return;
+    }
     // Prepare some data to write, Note that the allocated buf needs to be
     // aligned
     char *buf = nullptr;
@@ -132,13 +3044,13 @@ private:
     for (size_t i = 0; i < state->option.bs; ++i) {
       buf[i] = '1';
     }
-    auto dura = Duration(state->option.duration);
+    auto dura = RunLimit(state);
     Zone *zone = nullptr;
 
     while (!dura.Ending()) {
       while (!zone) {
-        auto zone_id = rand() % zbd->GetNrZones();
-        zone = zbd->io_zones_[zone_id].get();
+        auto zone_id = placement->Pick(0, zbd->GetNrIOZones());
+        zone = zbd->GetIOZone(zone_id);
         if (!zone->Acquire()) {
           zone = nullptr;
           continue;
@@ -153,6 +3065,7 @@ private:
         MetricsGuard guard(state->option.bs, state->statistic, kWrite);
         zone->Append(buf, state->option.bs);
       }
+      dura.Done(state->option.bs);
     }
 
     if (zone) {
@@ -164,55 +3077,342 @@ private:
 
   static void ReadRandom(ThreadState *state) {
     auto zbd = state->zbd;
+    auto &option = state->option;
     // Prepare some data to write, Note that the allocated buf needs to be
     // aligned
     char *buf = nullptr;
-    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), state->option.bs);
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
 
-    for (size_t i = 0; i < state->option.bs; ++i) {
+    for (size_t i = 0; i < option.bs; ++i) {
       buf[i] = '1';
     }
-    auto dura = Duration(state->option.duration);
-    Zone *zone = nullptr;
+    auto dura = RunLimit(state);
+
+    // Blocks of all zones form one key space, so skewed distributions pick
+    // hot blocks across the device
+    auto block_num = zbd->GetIOZone(0)->max_capacity_ / option.bs;
+    KeyGenerator::Kind kind;
+    if (!KeyGenerator::ParseKind(option.read_dist, &kind)) {
+      printf("Unknown --read_dist %s\n", option.read_dist.c_str());
+      free(buf);
+      return;
+    }
+    KeyGenerator keys(kind, block_num * zbd->GetNrIOZones(), option.zipf_theta,
+                      state->id);
+
+    while (!dura.Ending()) {
+      auto block = keys.Next();
+      auto zone = zbd->GetIOZone(block / block_num);
+      auto off = zone->start_ + block % block_num * option.bs;
+
+      bool hit;
+      auto start = Duration::NowTime();
+      {
+        MetricsGuard guard(option.bs, state->statistic, kRead);
+        zone->Read(buf, option.bs, off, &hit);
+      }
+      dura.Done(option.bs);
+      if (zbd->GetBlockCache()) {
+        state->statistic->AddLatency(hit ? kCacheHit : kCacheMiss,
+                                     Duration::ElapseTimeMicro(start));
+      }
+    }
+    free(buf);
+  }
+
+  static void ReadSeq(ThreadState *state) {}
 
-    auto block_num = zbd->GetZoneSize() / state->option.bs;
-    auto read_f = zbd->GetReadDirectFD();
+  // Write objects with random lifetimes to a private set of zones, let a
+  // host-side collector reclaim the space and account for the write
+  // amplification it causes
+  static void LifetimeWrite(ThreadState *state) {
+    auto zbd = state->zbd;
+    auto &option = state->option;
+
+    uint64_t nr_zones = option.zones ? option.zones : zbd->GetNrIOZones();
+    nr_zones = std::min<uint64_t>(nr_zones, zbd->GetNrIOZones());
+    uint64_t per_thread = nr_zones / option.threads;
+    std::vector<Zone *> zones;
+    for (uint64_t i = 0; i < per_thread; ++i) {
+      zones.push_back(zbd->GetIOZone(state->id * per_thread + i));
+    }
+
+    ObjectStore::Options store_option;
+    store_option.object_size = option.bs;
+    store_option.open_zones = option.open_zones;
+    store_option.gc_free_zones = option.gc_free_zones;
+    store_option.placement = option.placement;
+    store_option.seed = state->id;
+    LifetimeGenerator::Kind kind;
+    if (!LifetimeGenerator::ParseKind(option.lifetime_dist, &kind)) {
+      printf("Unknown --lifetime_dist %s\n", option.lifetime_dist.c_str());
+      return;
+    }
+
+    // With a constant write rate the expected amount of live data is the
+    // mean lifetime times the object size
+    uint64_t mean = option.lifetime_mean;
+    if (mean == 0) {
+      auto capacity = per_thread * zbd->GetIOZone(0)->max_capacity_;
+      mean = option.utilization * capacity / option.bs;
+    }
+    LifetimeGenerator lifetime(kind, mean, option.hot_ratio, state->id);
+
+    ObjectStore store(zbd, zones, state->statistic, store_option);
+    if (!store.Init()) {
+      return;
+    }
+
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
+    memset(buf, '1', option.bs);
 
+    auto dura = RunLimit(state);
     while (!dura.Ending()) {
-      // Pick a zone
+      // The writer knows how long its data lives, like an LSM knows the
+      // level of a table, and passes that as the hint
+      auto life = lifetime.Next();
+      MetricsGuard guard(option.bs, state->statistic, kWrite);
+      if (!store.Put(buf, life, life)) {
+        break;
+      }
+      dura.Done(option.bs);
+    }
+
+    state->bench->AddGcStats(store.Stats());
+    free(buf);
+  }
+
+  // Append to a group of zones striped over all devices given by --dev.
+  // Every request is cut into stripe units that are written in parallel
+  static void WriteStriped(ThreadState *state) {
+    auto bench = state->bench;
+    auto &option = state->option;
+    auto &zbds = bench->zbds_;
+
+    // Stripe units must stay aligned to the zoned blocks
+    uint64_t block = zbds[0]->GetBlockSize();
+    uint64_t stripe = option.stripe_size;
+    if (stripe == 0) {
+      stripe = std::max<uint64_t>(block, option.bs / zbds.size() / block *
+                                             block);
+    }
+    if (stripe % block) {
+      printf("--stripe_size must be a multiple of the block size %lu\n",
+             block);
+      return;
+    }
+    if (option.bs % stripe) {
+      printf("--bs must be a multiple of the stripe size %lu\n", stripe);
+      return;
+    }
+
+    // One zone on every device, picked the same way WriteSeq does
+    std::vector<Zone *> members;
+    for (auto &zbd : zbds) {
+      auto placement = PlacementPolicy::Create(
+          "random", state->id * zbd->GetNrIOZones() / option.threads);
+      Zone *zone = nullptr;
       while (!zone) {
-        auto zone_id = rand() % zbd->GetNrZones();
-        zone = zbd->io_zones_[zone_id].get();
+        zone = zbd->GetIOZone(placement->Pick(0, zbd->GetNrIOZones()));
         if (!zone->Acquire()) {
           zone = nullptr;
-          continue;
         }
       }
-      // Randomly pick a block to read
-      auto random_block_idx = rand() % block_num;
-      auto off = random_block_idx * state->option.bs;
-      {
-        MetricsGuard guard(state->option.bs, state->statistic, kRead);
-        pread(read_f, buf, state->option.bs, off);
+      members.push_back(zone);
+    }
+
+    StripedZoneGroup group(members, stripe, bench->device_stats_);
+    if (!group.Init(option.bs,
+                    option.io_phases ? state->statistic : nullptr)) {
+      printf("Failed to set up the striped zone group\n");
+      return;
+    }
+
+    char *buf = nullptr;
+    posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), option.bs);
+    memset(buf, '1', option.bs);
+
+    auto dura = RunLimit(state);
+    while (!dura.Ending()) {
+      if (group.GetCapacityLeft() < option.bs) {
+        if (!group.Reset()) {
+          assert(false);
+        }
+      }
+      MetricsGuard guard(option.bs, state->statistic, kWrite);
+      if (!group.Append(buf, option.bs)) {
+        break;
       }
+      dura.Done(option.bs);
+    }
+
+    for (auto zone : members) {
+      zone->CheckRelease();
     }
+    free(buf);
   }
 
-  static void ReadSeq(ThreadState *state) {}
+  void AddGcStats(const GcStats &stats) {
+    std::lock_guard<std::mutex> lck(gc_mtx_);
+    gc_stats_.Merge(stats);
+    has_gc_stats_ = true;
+  }
 
   using RunningThread = std::shared_ptr<std::thread>;
   RunningThread YieldThread(ThreadState *t_state) {
-    auto t = new std::thread([=]() { t_state->method(t_state); });
+    auto t = new std::thread([=]() {
+      if (t_state->option.cpu_stats) {
+        t_state->cpu.Open();
+      }
+      t_state->method(t_state);
+      if (t_state->option.cpu_stats) {
+        t_state->statistic->AddCpuUsage(t_state->cpu.ReadSelf());
+      }
+    });
     return std::shared_ptr<std::thread>(t);
   }
 
 private:
   Option option_;
   std::shared_ptr<ZonedBlockDevice> zbd_;
+  // All devices given by --dev, and the statistics of each of them
+  std::vector<std::shared_ptr<ZonedBlockDevice>> zbds_;
+  std::vector<Statistics *> device_stats_;
+  std::unique_ptr<BlockCache> cache_;
+  // Per-zone counters of zbd_ for --zone_stats, and what Monitor() kept of
+  // every interval
+  std::unique_ptr<ZoneStats> zone_stats_;
+  ZoneStats::Export zone_export_;
 
   ThreadState thread_stats_[kMaxThreadNum];
   std::vector<RunningThread> running_threads_;
   Statistics *statistic_;
+
+  std::mutex monitor_mtx_;
+  std::condition_variable monitor_cv_;
+  bool finished_ = false;
+
+  std::mutex gc_mtx_;
+  GcStats gc_stats_;
+  bool has_gc_stats_ = false;
+
+  struct PlacementResult {
+    std::string policy;
+    GcStats gc;
+    HistogramData write_latency;
+    Statistics *statistic;
+  };
+  std::vector<PlacementResult> placement_results_;
+
+  // Zone copy bench
+  Zone *copy_src_ = nullptr;
+  std::vector<Zone *> readable_zones_;
+  // Readable blocks of every readable zone, and the zones copied into
+  std::vector<uint64_t> copy_read_blocks_;
+  std::vector<Zone *> copy_dsts_;
+  bool copy_phase_ = false;
+  Statistics *baseline_stat_ = nullptr;
+
+  // Read/write isolation bench
+  enum class ReadPlacement { kSame, kDisjoint, kFinished };
+  static constexpr size_t kMaxFinishedZones = 16;
+  ReadPlacement rw_placement_ = ReadPlacement::kSame;
+  std::vector<Zone *> rw_write_zones_;
+  std::vector<Zone *> rw_read_zones_;
+  // Blocks of an I/O zone readers may pick, published by whoever wrote
+  // them, and the reads in flight in it
+  struct RwZone {
+    std::atomic<uint64_t> blocks{0};
+    std::atomic<uint32_t> readers{0};
+  };
+  std::unique_ptr<RwZone[]> rw_zones_;
+  // The zone each writer is appending to, nullptr between zones
+  std::atomic<Zone *> rw_active_[kMaxThreadNum];
+  std::mutex rw_mtx_;
+  std::deque<Zone *> rw_finished_;
+  struct ReadWriteResult {
+    std::string placement;
+    Statistics *statistic;
+  };
+  std::vector<ReadWriteResult> rw_results_;
+
+  // Host-side write sequencing bench, one result per scheduler
+  std::mutex sequencer_mtx_;
+  ZoneWriteSequencer::Stats sequencer_stats_;
+  struct QueueDepthResult {
+    std::string scheduler;
+    Statistics *statistic;
+    ZoneWriteSequencer::Stats sequencer;
+  };
+  std::vector<QueueDepthResult> qd_results_;
+
+  // Latency target search
+  std::unique_ptr<SloController> slo_;
+
+  // Zone lifecycle bench, one result per finish threshold
+  std::unique_ptr<ZoneLifecycle> lifecycle_;
+  struct ZoneFinishResult {
+    uint64_t threshold;
+    Statistics *statistic;
+    ZoneLifecycle::Stats lifecycle;
+    uint64_t finishes;
+    uint64_t finish_failures;
+    uint64_t finish_waste;
+    uint64_t closes;
+  };
+  std::vector<ZoneFinishResult> finish_results_;
+
+  // Zone daemon bench, direct access first and then through the daemon
+  struct DaemonResult {
+    std::string access;
+    Statistics *statistic;
+  };
+  std::vector<DaemonResult> daemon_results_;
+  std::unique_ptr<ZoneDaemon::Stats> daemon_stats_;
+  inline static volatile sig_atomic_t stop_serving_ = 0;
+
+  // Parity zone group bench, the groups of every thread live across the
+  // write and read phases
+  bool parity_phase_ = false;
+  std::vector<std::unique_ptr<ParityZoneGroup>> parity_groups_;
+  struct ParityResult {
+    std::string name;
+    MetricsType type;
+    Statistics *statistic;
+  };
+  std::vector<ParityResult> parity_results_;
+  ParityZoneGroup::Stats parity_stats_;
+
+  // Read path bench, one result per path
+  struct PathResult {
+    std::string path;
+    Statistics *statistic;
+  };
+  std::vector<PathResult> path_results_;
+
+  // QoS bench, one result per phase for all classes and one per class
+  struct QosClass {
+    std::string name;
+    QosScheduler::IoKind kind;
+    uint64_t threads;
+    uint32_t weight;
+    uint64_t rate;  // bytes per second, 0 for no cap
+  };
+  std::vector<QosClass> qos_classes_;
+  // Class of every thread
+  std::vector<uint32_t> qos_thread_class_;
+  // Of the running phase, the scheduler only in the scheduled one
+  std::unique_ptr<QosScheduler> qos_scheduler_;
+  std::vector<Statistics *> qos_stats_;
+  std::vector<QosResult> qos_results_;
+
+  // Restart bench, the journal of the writes and one result per reopen
+  ZoneJournal::Stats journal_stats_;
+  std::vector<RestartResult> restart_results_;
+
+  // One entry per device
+  std::vector<Preconditioner::Stats> precondition_stats_;
 };
 
 int zns_bench(int argc, char *argv[]) {
@@ -223,7 +3423,93 @@ int zns_bench(int argc, char *argv[]) {
   option.bs = FLAGS_bs;
   option.dev = FLAGS_dev;
   option.duration = FLAGS_duration;
+  option.ops = FLAGS_ops;
+  option.bytes = FLAGS_bytes;
+  if (!option.duration && !option.ops && !option.bytes) {
+    printf("One of --duration, --ops and --bytes must bound the run\n");
+    return 1;
+  }
+  FastClock::SetUseTsc(FLAGS_tsc);
   option.threads = FLAGS_threads;
+  option.cpu_stats = FLAGS_cpu_stats;
+  option.report_interval = FLAGS_report_interval;
+  option.zones = FLAGS_zones;
+  option.lifetime_dist = FLAGS_lifetime_dist;
+  option.lifetime_mean = FLAGS_lifetime_mean;
+  option.utilization = FLAGS_utilization;
+  option.hot_ratio = FLAGS_hot_ratio;
+  option.open_zones = FLAGS_open_zones;
+  option.placement = FLAGS_placement;
+  option.gc_free_zones = FLAGS_gc_free_zones;
+  option.stripe_size = FLAGS_stripe_size;
+  option.parity_k = FLAGS_parity_k;
+  option.copy_chunk = FLAGS_copy_chunk;
+  option.copy_depth = FLAGS_copy_depth;
+  option.simple_copy = FLAGS_simple_copy;
+  option.io_phases = FLAGS_io_phases;
+  option.open_threads = FLAGS_open_threads;
+  option.writers = FLAGS_writers;
+  option.read_placement = FLAGS_read_placement;
+  option.rw_fill_zones = FLAGS_rw_fill_zones;
+  option.qd = FLAGS_qd;
+  option.schedulers = FLAGS_schedulers;
+  option.slo_option.target_p99_us = FLAGS_slo_p99_us;
+  option.slo_option.max_depth = FLAGS_slo_max_qd;
+  option.slo_option.min_intervals = FLAGS_slo_min_intervals;
+  option.slo_interval_ms = FLAGS_slo_interval_ms;
+  option.streams = FLAGS_streams;
+  option.finish_thresholds = FLAGS_finish_thresholds;
+  option.idle_close_ms = FLAGS_idle_close_ms;
+  option.output = FLAGS_output;
+  option.output_file = FLAGS_output_file;
+  option.zone_stats = FLAGS_zone_stats;
+  option.clients = FLAGS_clients;
+  option.shm_name = FLAGS_shm_name;
+  option.daemon_workers = FLAGS_daemon_workers;
+  option.client_read_pct = FLAGS_client_read_pct;
+  option.journal_snapshot_records = FLAGS_journal_snapshot_records;
+  option.journal_crash = FLAGS_journal_crash;
+  option.read_paths = FLAGS_read_paths;
+  option.read_advice = FLAGS_read_advice;
+  option.read_pattern = FLAGS_read_pattern;
+  option.read_ahead_kb = FLAGS_read_ahead_kb;
+  option.drop_cache = FLAGS_drop_cache;
+  option.qos_classes = FLAGS_qos_classes;
+  option.qos_depth = FLAGS_qos_depth;
+  option.qos_read_priority = FLAGS_qos_read_priority;
+  option.qos_read_burst = FLAGS_qos_read_burst;
+  if (option.output != "text" && option.output != "json") {
+    printf("Unknown --output %s\n", option.output.c_str());
+    return 1;
+  }
+  option.precondition = FLAGS_precondition;
+  auto &precondition = option.precondition_option;
+  precondition.fill = FLAGS_precondition_fill;
+  precondition.partial = FLAGS_precondition_partial;
+  precondition.chunk_size = FLAGS_precondition_bs;
+  precondition.depth = FLAGS_precondition_depth;
+  precondition.threads = FLAGS_precondition_threads;
+  if (!Preconditioner::ParsePattern(FLAGS_precondition_pattern,
+                                    &precondition.pattern)) {
+    printf("Unknown --precondition_pattern %s\n",
+           FLAGS_precondition_pattern.c_str());
+    return 1;
+  }
+  option.read_dist = FLAGS_read_dist;
+  option.zipf_theta = FLAGS_zipf_theta;
+  // The zipf generator divides by 1 - theta
+  if (!(option.zipf_theta > 0 && option.zipf_theta < 1)) {
+    printf("--zipf_theta must be within (0, 1)\n");
+    return 1;
+  }
+  option.cache_size = FLAGS_cache_size;
+  option.cache_policy = FLAGS_cache_policy;
+  option.cache_shards = FLAGS_cache_shards;
+
+  // Clients leave the device to the daemon
+  if (option.bench == "client") {
+    return Benchmark::RunClient(option);
+  }
 
   auto b = Benchmark(option);
   b.Run();
@@ -0,0 +1,188 @@
+#include "zone_copy.h"
+
+#include <linux/nvme_ioctl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+namespace {
+// NVM command set Copy, source range entries in descriptor format 0
+constexpr uint8_t kNvmeCmdCopy = 0x19;
+
+struct CopySourceRange {
+  uint8_t rsvd0[8];
+  uint64_t slba;
+  uint16_t nlb;  // 0's based
+  uint8_t rsvd18[14];
+};
+static_assert(sizeof(CopySourceRange) == 32, "Copy range descriptor");
+} // namespace
+
+ZoneCopier::ZoneCopier(ZonedBlockDevice *zbd, const Options &options)
+    : zbd_(zbd), options_(options), slots_(options.depth),
+      events_(options.depth), simple_copy_supported_(options.simple_copy) {}
+
+ZoneCopier::~ZoneCopier() {
+  for (auto &slot : slots_) {
+    free(slot.buf);
+  }
+}
+
+bool ZoneCopier::Init() {
+  assert((options_.chunk_size % zbd_->GetBlockSize()) == 0);
+  for (auto &slot : slots_) {
+    if (posix_memalign((void **)&slot.buf, sysconf(_SC_PAGESIZE),
+                       options_.chunk_size)) {
+      return false;
+    }
+  }
+  queue_ = std::make_unique<AsyncIOQueue>(options_.depth);
+  queue_->SetPhaseStats(options_.phase_stats);
+  if (!queue_->Init()) {
+    return false;
+  }
+
+  if (simple_copy_supported_) {
+    nsid_ = ioctl(zbd_->GetWriteFD(), NVME_IOCTL_ID);
+    if (nsid_ <= 0) {
+      // Not an NVMe namespace, or passthrough is not allowed
+      simple_copy_supported_ = false;
+    }
+  }
+  return true;
+}
+
+bool ZoneCopier::Copy(Zone *src, Zone *dst, uint64_t *copied) {
+  *copied = 0;
+  used_simple_copy_ = false;
+  if (src->wp_ - src->start_ > dst->GetCapacityLeft()) {
+    return false;
+  }
+
+  if (simple_copy_supported_) {
+    if (SimpleCopy(src, dst, copied)) {
+      used_simple_copy_ = true;
+      return true;
+    }
+    simple_copy_supported_ = false;
+    printf("[ZoneCopier] Simple Copy failed, falling back to host copy\n");
+  }
+  return HostCopy(src, dst, copied);
+}
+
+bool ZoneCopier::SimpleCopy(Zone *src, Zone *dst, uint64_t *copied) {
+  auto lblock = zbd_->GetLogicalBlockSize();
+  // One source range per command, a range holds at most 64Ki blocks
+  auto max_chunk = std::min<uint64_t>(options_.chunk_size, 65536ULL * lblock);
+  CopySourceRange range;
+
+  while (src->start_ + *copied < src->wp_) {
+    uint64_t src_off = src->start_ + *copied;
+    uint64_t size = std::min(max_chunk, src->wp_ - src_off);
+
+    std::memset(&range, 0, sizeof(range));
+    range.slba = src_off / lblock;
+    range.nlb = size / lblock - 1;
+
+    nvme_passthru_cmd cmd;
+    std::memset(&cmd, 0, sizeof(cmd));
+    cmd.opcode = kNvmeCmdCopy;
+    cmd.nsid = nsid_;
+    cmd.addr = reinterpret_cast<uint64_t>(&range);
+    cmd.data_len = sizeof(range);
+    uint64_t sdlba = dst->wp_ / lblock;
+    cmd.cdw10 = sdlba & 0xffffffff;
+    cmd.cdw11 = sdlba >> 32;
+    // Number of ranges (0's based) and descriptor format 0
+    cmd.cdw12 = 0;
+
+    if (ioctl(zbd_->GetWriteFD(), NVME_IOCTL_IO_CMD, &cmd) != 0) {
+      return false;
+    }
+    uint64_t offset;
+    if (!dst->Reserve(size, &offset)) {
+      return false;
+    }
+    *copied += size;
+  }
+  return true;
+}
+
+bool ZoneCopier::HostCopy(Zone *src, Zone *dst, uint64_t *copied) {
+  auto read_f = zbd_->GetReadDirectFD();
+  auto write_f = zbd_->GetWriteFD();
+  uint64_t read_off = src->start_ + *copied;
+  uint64_t end = src->wp_;
+  // Chunk `seq` lives in slot seq % depth. Reads may complete in any order
+  // but writes are submitted in chunk order to keep the zone sequential
+  uint64_t next_read = 0, next_write = 0;
+  bool ok = true;
+
+  while (true) {
+    while (ok && read_off < end) {
+      auto &slot = slots_[next_read % slots_.size()];
+      if (slot.state != kIdle) {
+        break;
+      }
+      slot.src_off = read_off;
+      slot.size = std::min(options_.chunk_size, end - read_off);
+      if (!queue_->SubmitRead(read_f, slot.buf, slot.size, slot.src_off,
+                              &slot)) {
+        ok = false;
+        break;
+      }
+      slot.state = kReading;
+      read_off += slot.size;
+      next_read++;
+    }
+
+    while (ok && next_write < next_read) {
+      auto &slot = slots_[next_write % slots_.size()];
+      if (slot.state != kRead) {
+        break;
+      }
+      uint64_t dst_off;
+      if (!dst->Reserve(slot.size, &dst_off) ||
+          !queue_->SubmitWrite(write_f, slot.buf, slot.size, dst_off,
+                               &slot)) {
+        ok = false;
+        break;
+      }
+      slot.state = kWriting;
+      next_write++;
+    }
+
+    if (queue_->InFlight() == 0) {
+      break;
+    }
+    int n = queue_->Reap(1, events_.size(), events_.data());
+    if (n < 0) {
+      return false;
+    }
+    for (int i = 0; i < n; ++i) {
+      auto slot = static_cast<Slot *>(events_[i].data);
+      if (static_cast<int64_t>(events_[i].res) !=
+          static_cast<int64_t>(slot->size)) {
+        printf("[ZoneCopier] I/O of chunk at %lu failed: %ld\n",
+               slot->src_off, static_cast<int64_t>(events_[i].res));
+        ok = false;
+      }
+      if (slot->state == kReading) {
+        slot->state = kRead;
+      } else {
+        slot->state = kIdle;
+        *copied += slot->size;
+      }
+    }
+  }
+
+  // Chunks read but never written after an error
+  for (auto &slot : slots_) {
+    slot.state = kIdle;
+  }
+  return ok && src->start_ + *copied == end;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "zbd_fs.h"
+
+// Copy the written part of a zone to the write pointer of another zone, the
+// core operation of zone garbage collection. If the device supports the NVMe
+// Simple Copy command the copy is offloaded to the drive; otherwise the host
+// reads chunks from the source and appends them to the destination, keeping
+// up to `depth` chunks in flight so that reads overlap with writes. The
+// caller owns (has acquired) both zones.
+class ZoneCopier {
+public:
+  struct Options {
+    uint64_t chunk_size = 1024 * 1024;
+    uint32_t depth = 4;
+    // Try NVMe Simple Copy before falling back to the host copy
+    bool simple_copy = true;
+    // Receives the submit/device/complete phases of the host copy I/O
+    Statistics *phase_stats = nullptr;
+  };
+
+  ZoneCopier(ZonedBlockDevice *zbd, const Options &options);
+  ~ZoneCopier();
+
+  // Allocate the chunk buffers and set up the I/O queue
+  bool Init();
+
+  // Copy [src->start_, src->wp_) to the write pointer of `dst`. Return
+  // false on error, `copied` holds the number of bytes moved
+  bool Copy(Zone *src, Zone *dst, uint64_t *copied);
+
+  // Whether the last copy was done by the device
+  bool UsedSimpleCopy() const { return used_simple_copy_; }
+
+private:
+  enum SlotState { kIdle, kReading, kRead, kWriting };
+
+  struct Slot {
+    char *buf = nullptr;
+    SlotState state = kIdle;
+    uint64_t src_off = 0;
+    uint64_t size = 0;
+  };
+
+  // Both copy [src->start_ + *copied, src->wp_) and advance `copied`.
+  // SimpleCopy returns false as soon as the device rejects a command, the
+  // host copy picks up from there
+  bool HostCopy(Zone *src, Zone *dst, uint64_t *copied);
+  bool SimpleCopy(Zone *src, Zone *dst, uint64_t *copied);
+
+  ZonedBlockDevice *zbd_;
+  Options options_;
+  std::unique_ptr<AsyncIOQueue> queue_;
+  std::vector<Slot> slots_;
+  std::vector<io_event> events_;
+
+  int nsid_ = -1;
+  bool simple_copy_supported_;
+  bool used_simple_copy_ = false;
+};
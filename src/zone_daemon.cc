@@ -0,0 +1,586 @@
+#include "zone_daemon.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+namespace {
+// Polls without work before a poller yields, and before it sleeps
+const uint64_t kSpinPolls = 1000;
+const uint64_t kYieldPolls = 10000;
+const auto kIdleSleep = std::chrono::microseconds(20);
+// How often the daemon looks for clients that died attached
+const auto kReapInterval = std::chrono::milliseconds(100);
+
+bool ProcessAlive(pid_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+// Back off from busy polling the longer nothing turns up
+void Backoff(uint64_t idle_polls) {
+  if (idle_polls < kSpinPolls) {
+    return;
+  }
+  if (idle_polls < kYieldPolls) {
+    std::this_thread::yield();
+  } else {
+    std::this_thread::sleep_for(kIdleSleep);
+  }
+}
+
+uint64_t AlignUp(uint64_t value, uint64_t align) {
+  return (value + align - 1) / align * align;
+}
+
+// Whether the region `name` belongs to a daemon that is still running
+bool RegionInUse(const std::string &name) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  bool in_use = false;
+  if (fstat(fd, &st) == 0 &&
+      (size_t)st.st_size >= sizeof(ZoneDaemon::Header)) {
+    void *addr = mmap(nullptr, sizeof(ZoneDaemon::Header), PROT_READ,
+                      MAP_SHARED, fd, 0);
+    if (addr != MAP_FAILED) {
+      auto header = static_cast<ZoneDaemon::Header *>(addr);
+      in_use = header->magic == ZoneDaemon::kMagic &&
+               ProcessAlive(header->pid);
+      munmap(addr, sizeof(ZoneDaemon::Header));
+    }
+  }
+  close(fd);
+  return in_use;
+}
+} // namespace
+
+std::string ZoneDaemon::Stats::ToString() const {
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           "[Requests: %" PRIu64 "][Allocations: %" PRIu64 "]"
+           "[Appends: %" PRIu64 "][Reads: %" PRIu64 "][Resets: %" PRIu64 "]"
+           "[Finishes: %" PRIu64 "][Errors: %" PRIu64 "]"
+           "[Attaches: %" PRIu64 "][Reaped: %" PRIu64 "]",
+           requests, allocations, appends, reads, resets, finishes, errors,
+           attaches, reaped);
+  return buf;
+}
+
+ZoneDaemon::ZoneDaemon(ZonedBlockDevice *zbd, const Options &options)
+    : zbd_(zbd), options_(options),
+      owner_(new std::atomic<int32_t>[zbd->GetNrIOZones()]),
+      readable_(new std::atomic<uint64_t>[zbd->GetNrIOZones()]) {
+  for (size_t i = 0; i < zbd_->GetNrIOZones(); ++i) {
+    auto zone = zbd_->GetIOZone(i);
+    owner_[i] = -1;
+    readable_[i] = zone->wp_ - zone->start_;
+  }
+  options_.buffers = std::min(std::max(options_.buffers, 1U), kRingEntries);
+  options_.workers = std::max(options_.workers, 1U);
+}
+
+ZoneDaemon::~ZoneDaemon() {
+  Stop();
+  if (!base_) {
+    return;
+  }
+  for (size_t i = 0; i < zbd_->GetNrIOZones(); ++i) {
+    if (owner_[i] >= 0) {
+      owner_[i] = -1;
+      zbd_->GetIOZone(i)->CheckRelease();
+    }
+  }
+  munmap(base_, header_->total_size);
+  if (created_) {
+    shm_unlink(options_.name.c_str());
+  }
+}
+
+bool ZoneDaemon::Create() {
+  uint64_t page = sysconf(_SC_PAGESIZE);
+  uint64_t slots_offset = AlignUp(sizeof(Header), page);
+  uint64_t buffers_offset =
+      AlignUp(slots_offset + options_.slots * sizeof(Slot), page);
+  // Page aligned buffers can go to the O_DIRECT descriptors as they are
+  uint64_t buffer_size = AlignUp(options_.buffer_size, page);
+  uint64_t total_size = buffers_offset + (uint64_t)options_.slots *
+                                             options_.buffers * buffer_size;
+
+  auto name = options_.name.c_str();
+  int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0 && errno == EEXIST && !RegionInUse(options_.name)) {
+    // Left behind by a daemon that did not exit cleanly
+    shm_unlink(name);
+    fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  }
+  if (fd < 0) {
+    printf("shm_open %s: %s\n", name, strerror(errno));
+    return false;
+  }
+  // Unlinked here on failure, the destructor only cleans up a mapped region
+  if (ftruncate(fd, total_size) != 0) {
+    printf("ftruncate %s: %s\n", name, strerror(errno));
+    close(fd);
+    shm_unlink(name);
+    return false;
+  }
+  void *addr =
+      mmap(nullptr, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    printf("mmap %s: %s\n", name, strerror(errno));
+    shm_unlink(name);
+    return false;
+  }
+  created_ = true;
+
+  base_ = static_cast<char *>(addr);
+  header_ = new (base_) Header();
+  header_->magic = kMagic;
+  header_->version = kVersion;
+  header_->pid = getpid();
+  header_->nr_slots = options_.slots;
+  header_->buffers = options_.buffers;
+  header_->buffer_size = buffer_size;
+  header_->slots_offset = slots_offset;
+  header_->buffers_offset = buffers_offset;
+  header_->total_size = total_size;
+  header_->zone_size = zbd_->GetZoneSize();
+  header_->block_size = zbd_->GetBlockSize();
+  header_->nr_zones = zbd_->GetNrIOZones();
+  for (uint32_t i = 0; i < options_.slots; ++i) {
+    new (SlotAt(i)) Slot();
+  }
+  generation_.assign(options_.slots, 0);
+  pidless_claim_.assign(options_.slots, 0);
+  return true;
+}
+
+void ZoneDaemon::Start() {
+  stop_ = false;
+  header_->ready.store(1, std::memory_order_release);
+  for (uint32_t i = 0; i < options_.workers; ++i) {
+    workers_.emplace_back([this, i]() { Work(i); });
+  }
+}
+
+void ZoneDaemon::Stop() {
+  stop_ = true;
+  for (auto &t : workers_) {
+    t.join();
+  }
+  workers_.clear();
+  if (header_) {
+    header_->ready.store(0, std::memory_order_release);
+  }
+}
+
+void ZoneDaemon::Work(uint32_t worker) {
+  uint64_t idle = 0;
+  auto last_reap = std::chrono::steady_clock::now();
+  while (!stop_.load(std::memory_order_relaxed)) {
+    bool busy = false;
+    for (uint32_t i = worker; i < header_->nr_slots; i += options_.workers) {
+      auto slot = SlotAt(i);
+      if (slot->state.load(std::memory_order_acquire) != kSlotAttached) {
+        continue;
+      }
+      auto generation = slot->generation.load(std::memory_order_relaxed);
+      if (generation != generation_[i]) {
+        generation_[i] = generation;
+        counters_.attaches++;
+      }
+      // A request waits in the submission ring until its completion fits
+      ZoneRequest req;
+      for (uint32_t n = 0; n < kRingEntries && !slot->cq.Full() &&
+                           slot->sq.Pop(&req);
+           ++n) {
+        ZoneCompletion cpl;
+        Handle(i, req, &cpl);
+        slot->cq.Push(cpl);
+        busy = true;
+      }
+    }
+
+    if (busy) {
+      idle = 0;
+      continue;
+    }
+    Backoff(++idle);
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_reap >= kReapInterval) {
+      ReapSlots(worker);
+      last_reap = now;
+    }
+  }
+}
+
+Zone *ZoneDaemon::Owned(uint32_t slot, uint32_t zone) {
+  if (zone >= zbd_->GetNrIOZones() ||
+      owner_[zone].load(std::memory_order_relaxed) != (int32_t)slot) {
+    return nullptr;
+  }
+  return zbd_->GetIOZone(zone);
+}
+
+void ZoneDaemon::Handle(uint32_t slot, const ZoneRequest &req,
+                        ZoneCompletion *cpl) {
+  *cpl = ZoneCompletion();
+  cpl->tag = req.tag;
+  cpl->zone = req.zone;
+  counters_.requests++;
+
+  // Data requests must stay within one buffer of the slot and in whole
+  // blocks, the device is opened with O_DIRECT
+  bool data = req.op == kZoneAppend || req.op == kZoneRead;
+  if (data && (req.buffer >= header_->buffers ||
+               req.size > header_->buffer_size || req.size == 0 ||
+               req.size % header_->block_size != 0 ||
+               req.offset % header_->block_size != 0)) {
+    cpl->status = -EINVAL;
+    counters_.errors++;
+    return;
+  }
+
+  int status = 0;
+  Zone *zone = nullptr;
+  switch (req.op) {
+  case kZoneAllocate:
+    // Stays acquired while the client owns it, so nobody else takes it
+    zone = zbd_->AcquireEmptyZone();
+    if (!zone) {
+      status = -ENOSPC;
+      break;
+    }
+    cpl->zone = zone - zbd_->GetIOZone(0);
+    cpl->offset = zone->GetCapacityLeft();
+    owner_[cpl->zone].store(slot, std::memory_order_relaxed);
+    counters_.allocations++;
+    break;
+  case kZoneAppend:
+    zone = Owned(slot, req.zone);
+    if (!zone) {
+      status = -EPERM;
+    } else if (zone->GetCapacityLeft() < req.size) {
+      status = -ENOSPC;
+    } else {
+      cpl->offset = zone->wp_ - zone->start_;
+      status = zone->Append(BufferAt(slot, req.buffer), req.size) ? 0 : -EIO;
+      if (status == 0) {
+        readable_[req.zone].store(zone->wp_ - zone->start_,
+                                  std::memory_order_release);
+      }
+      counters_.appends++;
+    }
+    break;
+  case kZoneRead: {
+    if (req.zone >= zbd_->GetNrIOZones()) {
+      status = -EINVAL;
+      break;
+    }
+    zone = zbd_->GetIOZone(req.zone);
+    bool hit;
+    // The owner of the zone may be appending to it on another worker, so
+    // its wp_ is not looked at
+    if (req.offset + req.size >
+        readable_[req.zone].load(std::memory_order_acquire)) {
+      status = -EINVAL;
+    } else if (!zone->Read(BufferAt(slot, req.buffer), req.size,
+                           zone->start_ + req.offset, &hit, true)) {
+      status = -EIO;
+    }
+    counters_.reads++;
+    break;
+  }
+  case kZoneReset:
+    zone = Owned(slot, req.zone);
+    if (!zone) {
+      status = -EPERM;
+    } else if (!zone->IsEmpty()) {
+      // Nothing is read from the zone from here on
+      readable_[req.zone].store(0, std::memory_order_release);
+      if (!zone->Reset()) {
+        status = -EIO;
+      }
+    }
+    counters_.resets++;
+    break;
+  case kZoneFinish:
+    zone = Owned(slot, req.zone);
+    if (!zone) {
+      status = -EPERM;
+    } else if (!zone->IsFull() && !zone->Finish()) {
+      status = -EIO;
+    }
+    counters_.finishes++;
+    break;
+  case kZoneRelease:
+    zone = Owned(slot, req.zone);
+    if (!zone) {
+      status = -EPERM;
+      break;
+    }
+    owner_[req.zone].store(-1, std::memory_order_relaxed);
+    zone->CheckRelease();
+    break;
+  case kZoneDetach:
+    ReleaseAll(slot);
+    break;
+  default:
+    status = -EINVAL;
+  }
+  cpl->status = status;
+  if (status < 0) {
+    counters_.errors++;
+  }
+}
+
+void ZoneDaemon::ReleaseAll(uint32_t slot) {
+  for (size_t i = 0; i < zbd_->GetNrIOZones(); ++i) {
+    if (owner_[i].load(std::memory_order_relaxed) == (int32_t)slot) {
+      owner_[i].store(-1, std::memory_order_relaxed);
+      zbd_->GetIOZone(i)->CheckRelease();
+    }
+  }
+}
+
+void ZoneDaemon::ReapSlots(uint32_t worker) {
+  for (uint32_t i = worker; i < header_->nr_slots; i += options_.workers) {
+    auto slot = SlotAt(i);
+    auto state = slot->state.load(std::memory_order_acquire);
+    auto pid = slot->pid.load(std::memory_order_relaxed);
+    if (state == kSlotClaimed) {
+      // A client that died in Attach(). One without a pid yet is given a
+      // whole reap interval to store it
+      bool stale = pid ? !ProcessAlive(pid) : pidless_claim_[i];
+      pidless_claim_[i] = pid == 0;
+      uint32_t expected = kSlotClaimed;
+      if (stale && slot->state.compare_exchange_strong(
+                       expected, kSlotFree, std::memory_order_acq_rel)) {
+        pidless_claim_[i] = 0;
+        counters_.reaped++;
+      }
+      continue;
+    }
+    pidless_claim_[i] = 0;
+    if (state != kSlotAttached || ProcessAlive(pid)) {
+      continue;
+    }
+    ReleaseAll(i);
+    slot->pid.store(0, std::memory_order_relaxed);
+    slot->state.store(kSlotFree, std::memory_order_release);
+    counters_.reaped++;
+  }
+}
+
+ZoneDaemon::Stats ZoneDaemon::GetStats() {
+  Stats stats;
+  stats.requests = counters_.requests.load();
+  stats.allocations = counters_.allocations.load();
+  stats.appends = counters_.appends.load();
+  stats.reads = counters_.reads.load();
+  stats.resets = counters_.resets.load();
+  stats.finishes = counters_.finishes.load();
+  stats.errors = counters_.errors.load();
+  stats.attaches = counters_.attaches.load();
+  stats.reaped = counters_.reaped.load();
+  return stats;
+}
+
+ZoneClient::~ZoneClient() { Detach(); }
+
+bool ZoneClient::Attach(const std::string &name, uint64_t wait_micros) {
+  auto start = std::chrono::steady_clock::now();
+  auto waited = [&]() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  };
+
+  // The region shows up before the daemon has set it up, wait for ready
+  while (true) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 &&
+        (size_t)st.st_size >= sizeof(ZoneDaemon::Header)) {
+      void *addr = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+      if (addr != MAP_FAILED) {
+        auto header = static_cast<ZoneDaemon::Header *>(addr);
+        if (header->magic == ZoneDaemon::kMagic &&
+            header->version == ZoneDaemon::kVersion &&
+            header->ready.load(std::memory_order_acquire) &&
+            header->total_size == (uint64_t)st.st_size) {
+          base_ = static_cast<char *>(addr);
+          size_ = st.st_size;
+          header_ = header;
+        } else {
+          munmap(addr, st.st_size);
+        }
+      }
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (header_) {
+      break;
+    }
+    if (waited() >= wait_micros) {
+      return false;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  auto slots = reinterpret_cast<ZoneDaemon::Slot *>(base_ +
+                                                     header_->slots_offset);
+  for (uint32_t i = 0; i < header_->nr_slots; ++i) {
+    uint32_t expected = ZoneDaemon::kSlotFree;
+    if (!slots[i].state.compare_exchange_strong(
+            expected, ZoneDaemon::kSlotClaimed, std::memory_order_acquire)) {
+      continue;
+    }
+    slot_ = &slots[i];
+    // First, so the daemon can tell a live claim from one of a dead client
+    slot_->pid.store(getpid(), std::memory_order_relaxed);
+    slot_->sq.head = slot_->sq.tail = 0;
+    slot_->cq.head = slot_->cq.tail = 0;
+    slot_->generation.fetch_add(1, std::memory_order_relaxed);
+    slot_->state.store(ZoneDaemon::kSlotAttached, std::memory_order_release);
+    buffers_ = base_ + header_->buffers_offset +
+               (uint64_t)i * header_->buffers * header_->buffer_size;
+    return true;
+  }
+
+  printf("No free slot in %s\n", name.c_str());
+  munmap(base_, size_);
+  base_ = nullptr;
+  header_ = nullptr;
+  return false;
+}
+
+void ZoneClient::Detach() {
+  if (!base_) {
+    return;
+  }
+  if (slot_) {
+    ZoneRequest req = {};
+    req.op = kZoneDetach;
+    ZoneCompletion cpl;
+    Call(req, &cpl);
+    slot_->pid.store(0, std::memory_order_relaxed);
+    slot_->state.store(ZoneDaemon::kSlotFree, std::memory_order_release);
+    slot_ = nullptr;
+  }
+  munmap(base_, size_);
+  base_ = nullptr;
+  header_ = nullptr;
+}
+
+bool ZoneClient::Submit(const ZoneRequest &req) { return slot_->sq.Push(req); }
+
+bool ZoneClient::Reap(ZoneCompletion *cpl) { return slot_->cq.Pop(cpl); }
+
+bool ZoneClient::Call(ZoneRequest req, ZoneCompletion *cpl) {
+  req.tag = next_tag_++;
+  uint64_t idle = 0;
+  while (!Submit(req)) {
+    Backoff(++idle);
+  }
+  idle = 0;
+  while (!Reap(cpl)) {
+    // Do not wait forever on a daemon that went away
+    if (!header_->ready.load(std::memory_order_acquire)) {
+      last_error_ = -ESHUTDOWN;
+      return false;
+    }
+    Backoff(++idle);
+  }
+  // The completion of a request queued with Submit(), which must not be
+  // mixed with the synchronous calls
+  if (cpl->tag != req.tag) {
+    last_error_ = -EPROTO;
+    return false;
+  }
+  if (cpl->status < 0) {
+    last_error_ = cpl->status;
+    return false;
+  }
+  return true;
+}
+
+bool ZoneClient::AllocateZone(uint32_t *zone, uint64_t *capacity) {
+  ZoneRequest req = {};
+  req.op = kZoneAllocate;
+  ZoneCompletion cpl;
+  if (!Call(req, &cpl)) {
+    return false;
+  }
+  *zone = cpl.zone;
+  if (capacity) {
+    *capacity = cpl.offset;
+  }
+  return true;
+}
+
+bool ZoneClient::Append(uint32_t zone, uint32_t buffer, uint32_t size,
+                        uint64_t *offset) {
+  ZoneRequest req = {};
+  req.op = kZoneAppend;
+  req.zone = zone;
+  req.buffer = buffer;
+  req.size = size;
+  ZoneCompletion cpl;
+  if (!Call(req, &cpl)) {
+    return false;
+  }
+  *offset = cpl.offset;
+  return true;
+}
+
+bool ZoneClient::Read(uint32_t zone, uint64_t offset, uint32_t buffer,
+                      uint32_t size) {
+  ZoneRequest req = {};
+  req.op = kZoneRead;
+  req.zone = zone;
+  req.offset = offset;
+  req.buffer = buffer;
+  req.size = size;
+  ZoneCompletion cpl;
+  return Call(req, &cpl);
+}
+
+bool ZoneClient::Reset(uint32_t zone) {
+  ZoneRequest req = {};
+  req.op = kZoneReset;
+  req.zone = zone;
+  ZoneCompletion cpl;
+  return Call(req, &cpl);
+}
+
+bool ZoneClient::Finish(uint32_t zone) {
+  ZoneRequest req = {};
+  req.op = kZoneFinish;
+  req.zone = zone;
+  ZoneCompletion cpl;
+  return Call(req, &cpl);
+}
+
+bool ZoneClient::Release(uint32_t zone) {
+  ZoneRequest req = {};
+  req.op = kZoneRelease;
+  req.zone = zone;
+  ZoneCompletion cpl;
+  return Call(req, &cpl);
+}
@@ -0,0 +1,269 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "zbd_fs.h"
+
+// One process owns the device and hands out zones to local client
+// processes. Requests and completions travel through a pair of single
+// producer, single consumer rings per client in a POSIX shared memory
+// region, and the data through buffers in the same region: the daemon
+// writes and reads the client buffers directly, nothing is copied.
+//
+//   header | slot 0 ... slot n-1 | buffers of slot 0 | ... | slot n-1
+//
+// Every slot serves one attached client. The daemon polls the submission
+// rings of the slots, each slot always by the same worker thread so that
+// the requests of a client run in order.
+
+enum ZoneOp : uint32_t {
+  kZoneAllocate,  // take an empty zone, now owned by the client
+  kZoneAppend,    // append a buffer to an owned zone
+  kZoneRead,      // read into a buffer from any zone below its write pointer
+  kZoneReset,     // reset an owned zone
+  kZoneFinish,    // finish an owned zone
+  kZoneRelease,   // give an owned zone back
+  kZoneDetach,    // release every owned zone, the client is leaving
+};
+
+// Zones are indexes into the I/O zones of the device and offsets are
+// relative to the start of the zone
+struct ZoneRequest {
+  uint64_t tag;
+  uint32_t op;
+  uint32_t zone;
+  uint64_t offset;
+  uint32_t buffer;
+  uint32_t size;
+};
+
+struct ZoneCompletion {
+  uint64_t tag;
+  int32_t status;  // 0 or -errno
+  uint32_t zone;   // the zone of kZoneAllocate
+  // Where kZoneAppend wrote, the capacity of the zone of kZoneAllocate
+  uint64_t offset;
+  uint64_t pad;
+};
+
+// Fixed size ring living in shared memory, indexes only ever grow
+template <typename T, uint32_t N>
+struct ShmRing {
+  static_assert((N & (N - 1)) == 0, "ring size must be a power of 2");
+
+  alignas(kCacheLineSize) std::atomic<uint32_t> head{0};  // next to pop
+  alignas(kCacheLineSize) std::atomic<uint32_t> tail{0};  // next to push
+  alignas(kCacheLineSize) T entries[N];
+
+  bool Push(const T &entry) {
+    auto t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == N) {
+      return false;
+    }
+    entries[t & (N - 1)] = entry;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Only meaningful to the producer
+  bool Full() const {
+    return tail.load(std::memory_order_relaxed) -
+               head.load(std::memory_order_acquire) ==
+           N;
+  }
+
+  bool Pop(T *entry) {
+    auto h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *entry = entries[h & (N - 1)];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+class ZoneDaemon {
+public:
+  static constexpr uint32_t kRingEntries = 64;
+  static constexpr uint32_t kMagic = 0x5a4e5344;  // "ZNSD"
+  static constexpr uint32_t kVersion = 1;
+
+  enum SlotState : uint32_t { kSlotFree, kSlotClaimed, kSlotAttached };
+
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    pid_t pid;
+    std::atomic<uint32_t> ready;
+    uint32_t nr_slots;
+    uint32_t buffers;  // per slot
+    uint64_t buffer_size;
+    uint64_t slots_offset;
+    uint64_t buffers_offset;
+    uint64_t total_size;
+    uint64_t zone_size;
+    uint32_t block_size;
+    uint32_t nr_zones;
+  };
+
+  struct alignas(kCacheLineSize) Slot {
+    std::atomic<uint32_t> state;
+    std::atomic<pid_t> pid;
+    // Bumped by every client that attaches to the slot
+    std::atomic<uint32_t> generation;
+    ShmRing<ZoneRequest, kRingEntries> sq;
+    ShmRing<ZoneCompletion, kRingEntries> cq;
+  };
+
+  static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+                    std::atomic<pid_t>::is_always_lock_free,
+                "shared memory atomics must be lock free");
+
+  struct Options {
+    // Name of the shared memory region, see shm_open(3)
+    std::string name = "/zns_bench";
+    uint32_t slots = 16;
+    // Buffers per slot, at most kRingEntries
+    uint32_t buffers = 4;
+    uint64_t buffer_size = 1 << 20;
+    uint32_t workers = 2;
+  };
+
+  struct Stats {
+    uint64_t requests = 0;
+    uint64_t allocations = 0;
+    uint64_t appends = 0;
+    uint64_t reads = 0;
+    uint64_t resets = 0;
+    uint64_t finishes = 0;
+    uint64_t errors = 0;
+    uint64_t attaches = 0;
+    // Clients that exited without detaching
+    uint64_t reaped = 0;
+
+    std::string ToString() const;
+  };
+
+  ZoneDaemon(ZonedBlockDevice *zbd, const Options &options);
+  ~ZoneDaemon();
+
+  // Create the shared memory region. Clients can attach once Start() runs
+  // the workers. Fails if another live daemon uses the name
+  bool Create();
+  void Start();
+  // Stop the workers, clients still attached get no more completions
+  void Stop();
+
+  Stats GetStats();
+
+private:
+  struct Counters {
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> appends{0};
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> resets{0};
+    std::atomic<uint64_t> finishes{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> attaches{0};
+    std::atomic<uint64_t> reaped{0};
+  };
+
+  void Work(uint32_t worker);
+  void Handle(uint32_t slot, const ZoneRequest &req, ZoneCompletion *cpl);
+  // The zone `slot` owns, nullptr if it does not own it
+  Zone *Owned(uint32_t slot, uint32_t zone);
+  void ReleaseAll(uint32_t slot);
+  // Free the slots of clients that are gone, attached or still attaching
+  void ReapSlots(uint32_t worker);
+
+  Slot *SlotAt(uint32_t i) {
+    return reinterpret_cast<Slot *>(base_ + header_->slots_offset) + i;
+  }
+  char *BufferAt(uint32_t slot, uint32_t i) {
+    return base_ + header_->buffers_offset +
+           ((uint64_t)slot * header_->buffers + i) * header_->buffer_size;
+  }
+
+  ZonedBlockDevice *zbd_;
+  Options options_;
+  char *base_ = nullptr;
+  Header *header_ = nullptr;
+  bool created_ = false;
+
+  // Slot that owns each I/O zone, -1 for none
+  std::unique_ptr<std::atomic<int32_t>[]> owner_;
+  // Bytes of each I/O zone that may be read, published by the worker of
+  // its owner after every append
+  std::unique_ptr<std::atomic<uint64_t>[]> readable_;
+  // Generation of each slot at the last poll of its worker
+  std::vector<uint32_t> generation_;
+  // Slot was claimed without a pid at the last reap of its worker. Not a
+  // vector<bool>, the workers write neighbouring entries
+  std::vector<uint8_t> pidless_claim_;
+
+  std::atomic<bool> stop_{false};
+  std::vector<std::thread> workers_;
+  Counters counters_;
+};
+
+// A client process of the daemon. Not thread safe, every thread of a client
+// attaches on its own
+class ZoneClient {
+public:
+  ZoneClient() = default;
+  ~ZoneClient();
+
+  ZoneClient(const ZoneClient &) = delete;
+  ZoneClient &operator=(const ZoneClient &) = delete;
+
+  // Map the region of a running daemon and claim a free slot, waiting up to
+  // `wait_micros` for the daemon to come up
+  bool Attach(const std::string &name, uint64_t wait_micros = 0);
+  void Detach();
+
+  char *Buffer(uint32_t i) { return buffers_ + i * header_->buffer_size; }
+  uint32_t NrBuffers() const { return header_->buffers; }
+  uint64_t BufferSize() const { return header_->buffer_size; }
+  uint64_t ZoneSize() const { return header_->zone_size; }
+  uint32_t BlockSize() const { return header_->block_size; }
+  uint32_t NrZones() const { return header_->nr_zones; }
+
+  // Queue a request, false if kRingEntries are in flight already
+  bool Submit(const ZoneRequest &req);
+  // Take one completion if there is any
+  bool Reap(ZoneCompletion *cpl);
+
+  // Submit one request and wait for its completion, false on failure. Not
+  // to be mixed with Submit() and Reap(): another completion showing up
+  // first fails the call with -EPROTO
+  bool AllocateZone(uint32_t *zone, uint64_t *capacity = nullptr);
+  bool Append(uint32_t zone, uint32_t buffer, uint32_t size,
+              uint64_t *offset);
+  bool Read(uint32_t zone, uint64_t offset, uint32_t buffer, uint32_t size);
+  bool Reset(uint32_t zone);
+  bool Finish(uint32_t zone);
+  bool Release(uint32_t zone);
+
+  // -errno of the last failed request
+  int LastError() const { return last_error_; }
+
+private:
+  bool Call(ZoneRequest req, ZoneCompletion *cpl);
+
+  char *base_ = nullptr;
+  uint64_t size_ = 0;
+  ZoneDaemon::Header *header_ = nullptr;
+  ZoneDaemon::Slot *slot_ = nullptr;
+  char *buffers_ = nullptr;
+  uint64_t next_tag_ = 0;
+  int last_error_ = 0;
+};
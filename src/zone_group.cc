@@ -0,0 +1,437 @@
+#include "zone_group.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace {
+// XOR of bytes [begin, end) of the sources, 8 bytes at a time
+void XorRange(char *dst, const char *const *srcs, uint32_t n, uint64_t begin,
+              uint64_t end) {
+  uint64_t i = begin;
+  for (; i + 8 <= end; i += 8) {
+    uint64_t acc;
+    memcpy(&acc, srcs[0] + i, 8);
+    for (uint32_t s = 1; s < n; ++s) {
+      uint64_t word;
+      memcpy(&word, srcs[s] + i, 8);
+      acc ^= word;
+    }
+    memcpy(dst + i, &acc, 8);
+  }
+  for (; i < end; ++i) {
+    char acc = srcs[0][i];
+    for (uint32_t s = 1; s < n; ++s) {
+      acc ^= srcs[s][i];
+    }
+    dst[i] = acc;
+  }
+}
+
+#if defined(__x86_64__)
+// Four 32 byte lanes per step, every source read and dst written once
+__attribute__((target("avx2"))) void
+XorAvx2(char *dst, const char *const *srcs, uint32_t n, uint64_t size) {
+  uint64_t i = 0;
+  for (; i + 128 <= size; i += 128) {
+    auto src = reinterpret_cast<const __m256i *>(srcs[0] + i);
+    __m256i a0 = _mm256_loadu_si256(src);
+    __m256i a1 = _mm256_loadu_si256(src + 1);
+    __m256i a2 = _mm256_loadu_si256(src + 2);
+    __m256i a3 = _mm256_loadu_si256(src + 3);
+    for (uint32_t s = 1; s < n; ++s) {
+      src = reinterpret_cast<const __m256i *>(srcs[s] + i);
+      a0 = _mm256_xor_si256(a0, _mm256_loadu_si256(src));
+      a1 = _mm256_xor_si256(a1, _mm256_loadu_si256(src + 1));
+      a2 = _mm256_xor_si256(a2, _mm256_loadu_si256(src + 2));
+      a3 = _mm256_xor_si256(a3, _mm256_loadu_si256(src + 3));
+    }
+    auto out = reinterpret_cast<__m256i *>(dst + i);
+    _mm256_storeu_si256(out, a0);
+    _mm256_storeu_si256(out + 1, a1);
+    _mm256_storeu_si256(out + 2, a2);
+    _mm256_storeu_si256(out + 3, a3);
+  }
+  XorRange(dst, srcs, n, i, size);
+}
+
+bool HasAvx2() {
+  static const bool has = __builtin_cpu_supports("avx2");
+  return has;
+}
+#endif
+} // namespace
+
+StripedZoneGroup::StripedZoneGroup(std::vector<Zone *> members,
+                                   uint64_t stripe_sz,
+                                   std::vector<Statistics *> member_stats)
+    : members_(std::move(members)), stripe_sz_(stripe_sz),
+      member_stats_(std::move(member_stats)) {}
+
+bool StripedZoneGroup::Init(uint64_t max_append, Statistics *phase_stats) {
+  assert(!members_.empty() && stripe_sz_ > 0);
+  uint32_t depth = std::max<uint64_t>(max_append / stripe_sz_, 1);
+  queue_ = std::make_unique<AsyncIOQueue>(depth);
+  queue_->SetPhaseStats(phase_stats);
+  units_.resize(depth);
+  events_.resize(depth);
+  return queue_->Init();
+}
+
+uint64_t StripedZoneGroup::GetCapacityLeft() const {
+  // Units go to the members in turn, so the fullest member bounds the group
+  uint64_t min_left = members_[0]->GetCapacityLeft();
+  for (auto zone : members_) {
+    min_left = std::min(min_left, zone->GetCapacityLeft());
+  }
+  return min_left / stripe_sz_ * stripe_sz_ * members_.size();
+}
+
+bool StripedZoneGroup::Append(const char *data, uint64_t size) {
+  assert((size % stripe_sz_) == 0);
+  if (GetCapacityLeft() < size) {
+    return false;
+  }
+
+  uint64_t nr_units = size / stripe_sz_;
+  uint64_t submitted = 0;
+  bool ok = true;
+
+  std::vector<Unit *> free_units;
+  for (auto &unit : units_) {
+    free_units.push_back(&unit);
+  }
+
+  while (submitted < nr_units || queue_->InFlight() > 0) {
+    // Keep the queue full, units of one append go to distinct members as
+    // long as there are more members than units
+    while (ok && submitted < nr_units &&
+           queue_->InFlight() < queue_->Depth()) {
+      uint32_t member = (next_member_ + submitted) % members_.size();
+      Zone *zone = members_[member];
+      uint64_t offset;
+      if (!zone->Reserve(stripe_sz_, &offset)) {
+        ok = false;
+        break;
+      }
+      auto unit = free_units.back();
+      unit->member = member;
+      unit->start = std::chrono::steady_clock::now();
+      auto buf = const_cast<char *>(data + submitted * stripe_sz_);
+      if (!queue_->SubmitWrite(zone->GetDevice()->GetWriteFD(), buf,
+                               stripe_sz_, offset, unit)) {
+        ok = false;
+        break;
+      }
+      free_units.pop_back();
+      submitted++;
+    }
+
+    if (queue_->InFlight() == 0) {
+      break;
+    }
+    int n = queue_->Reap(1, events_.size(), events_.data());
+    if (n < 0) {
+      return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+      auto unit = static_cast<Unit *>(events_[i].data);
+      free_units.push_back(unit);
+      if (static_cast<int64_t>(events_[i].res) !=
+          static_cast<int64_t>(stripe_sz_)) {
+        printf("[StripedZoneGroup] Write to member %u failed: %ld\n",
+               unit->member, static_cast<int64_t>(events_[i].res));
+        ok = false;
+      }
+      if (unit->member < member_stats_.size()) {
+        auto dura = std::chrono::duration_cast<std::chrono::microseconds>(
+                        now - unit->start)
+                        .count();
+        dura = std::max<int64_t>(dura, 1);
+        auto stat = member_stats_[unit->member];
+        stat->AddLatency(kWrite, dura);
+        stat->AddThroughput(kWrite, (double)stripe_sz_ * 1e6 / dura);
+        stat->AddBytes(kWrite, stripe_sz_);
+      }
+    }
+  }
+
+  next_member_ = (next_member_ + nr_units) % members_.size();
+  return ok;
+}
+
+bool StripedZoneGroup::Reset() {
+  for (auto zone : members_) {
+    if (!zone->Reset()) {
+      return false;
+    }
+  }
+  next_member_ = 0;
+  return true;
+}
+
+void ParityZoneGroup::Stats::Merge(const Stats &other) {
+  rows += other.rows;
+  parity_micros += other.parity_micros;
+  parity_bytes += other.parity_bytes;
+  rebuilds += other.rebuilds;
+  rebuild_micros += other.rebuild_micros;
+}
+
+void ParityZoneGroup::XorBlocks(char *dst, const char *const *srcs,
+                                uint32_t n, uint64_t size, bool simd) {
+  assert(n > 0);
+#if defined(__x86_64__)
+  if (simd && HasAvx2()) {
+    XorAvx2(dst, srcs, n, size);
+    return;
+  }
+#endif
+  XorRange(dst, srcs, n, 0, size);
+}
+
+ParityZoneGroup::ParityZoneGroup(std::vector<Zone *> data, Zone *parity,
+                                 uint64_t stripe_sz)
+    : members_(std::move(data)), nr_data_(members_.size()),
+      stripe_sz_(stripe_sz) {
+  members_.push_back(parity);
+}
+
+ParityZoneGroup::~ParityZoneGroup() {
+  free(parity_buf_);
+  for (auto buf : rebuild_bufs_) {
+    free(buf);
+  }
+}
+
+bool ParityZoneGroup::Init(uint64_t max_append, Statistics *phase_stats) {
+  assert(nr_data_ > 0 && stripe_sz_ > 0);
+  max_rows_ = std::max<uint64_t>(max_append / RowSize(), 1);
+  // A rebuild reads every other member at once
+  uint32_t depth = max_rows_ * members_.size();
+  queue_ = std::make_unique<AsyncIOQueue>(depth);
+  queue_->SetPhaseStats(phase_stats);
+  units_.resize(depth);
+  events_.resize(depth);
+
+  auto page = sysconf(_SC_PAGESIZE);
+  if (posix_memalign((void **)&parity_buf_, page, max_rows_ * stripe_sz_)) {
+    return false;
+  }
+  rebuild_bufs_.resize(members_.size() - 1, nullptr);
+  for (auto &buf : rebuild_bufs_) {
+    if (posix_memalign((void **)&buf, page, stripe_sz_)) {
+      return false;
+    }
+  }
+  return queue_->Init();
+}
+
+uint64_t ParityZoneGroup::GetCapacityLeft() const {
+  uint64_t min_left = members_[0]->GetCapacityLeft();
+  for (auto zone : members_) {
+    min_left = std::min(min_left, zone->GetCapacityLeft());
+  }
+  return min_left / stripe_sz_ * RowSize();
+}
+
+bool ParityZoneGroup::InLockstep() const {
+  auto written = members_[0]->wp_ - members_[0]->start_;
+  for (auto zone : members_) {
+    if (zone->wp_ - zone->start_ != written) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename Next>
+bool ParityZoneGroup::RunUnits(uint64_t nr, bool write, uint64_t size,
+                               Next next) {
+  std::vector<Unit *> free_units;
+  for (auto &unit : units_) {
+    free_units.push_back(&unit);
+  }
+
+  uint64_t i = 0;
+  bool ok = true;
+  while (i < nr || queue_->InFlight() > 0) {
+    while (ok && i < nr && queue_->InFlight() < queue_->Depth()) {
+      uint32_t member;
+      char *buf;
+      uint64_t offset;
+      if (!next(i++, &member, &buf, &offset)) {
+        continue;
+      }
+      auto unit = free_units.back();
+      unit->member = member;
+      auto zbd = members_[member]->GetDevice();
+      bool submitted =
+          write ? queue_->SubmitWrite(zbd->GetWriteFD(), buf, size, offset,
+                                      unit)
+                : queue_->SubmitRead(zbd->GetReadDirectFD(), buf, size,
+                                     offset, unit);
+      if (!submitted) {
+        ok = false;
+        break;
+      }
+      free_units.pop_back();
+    }
+
+    if (queue_->InFlight() == 0) {
+      break;
+    }
+    int n = queue_->Reap(1, events_.size(), events_.data());
+    if (n < 0) {
+      return false;
+    }
+    for (int j = 0; j < n; ++j) {
+      auto unit = static_cast<Unit *>(events_[j].data);
+      free_units.push_back(unit);
+      if (static_cast<int64_t>(events_[j].res) !=
+          static_cast<int64_t>(size)) {
+        printf("[ParityZoneGroup] %s of member %u failed: %ld\n",
+               write ? "Write" : "Read", unit->member,
+               static_cast<int64_t>(events_[j].res));
+        ok = false;
+      }
+    }
+  }
+  return ok;
+}
+
+bool ParityZoneGroup::Append(const char *data, uint64_t size) {
+  assert((size % RowSize()) == 0);
+  uint64_t rows = size / RowSize();
+  if (rows > max_rows_ || GetCapacityLeft() < size || !InLockstep()) {
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<const char *> srcs(nr_data_);
+  for (uint64_t r = 0; r < rows; ++r) {
+    for (uint32_t k = 0; k < nr_data_; ++k) {
+      srcs[k] = data + r * RowSize() + k * stripe_sz_;
+    }
+    XorBlocks(parity_buf_ + r * stripe_sz_, srcs.data(), nr_data_,
+              stripe_sz_);
+  }
+  stats_.parity_micros += MicrosSince(start);
+  stats_.parity_bytes += size;
+
+  // Reserve row by row, so that every member takes the same offsets. A
+  // failed member is reserved as well to stay in step, but not written
+  uint32_t width = members_.size();
+  std::vector<uint64_t> offsets(rows * width);
+  for (uint64_t i = 0; i < offsets.size(); ++i) {
+    if (!members_[i % width]->Reserve(stripe_sz_, &offsets[i])) {
+      return false;
+    }
+  }
+
+  bool ok = RunUnits(offsets.size(), true, stripe_sz_,
+                     [&](uint64_t i, uint32_t *member, char **buf,
+                         uint64_t *offset) {
+                       uint64_t r = i / width;
+                       uint32_t m = i % width;
+                       if ((int)m == failed_) {
+                         return false;
+                       }
+                       *member = m;
+                       *buf = m < nr_data_ ? const_cast<char *>(
+                                                 data + r * RowSize() +
+                                                 m * stripe_sz_)
+                                           : parity_buf_ + r * stripe_sz_;
+                       *offset = offsets[i];
+                       return true;
+                     });
+  rows_ += rows;
+  stats_.rows += rows;
+  return ok;
+}
+
+bool ParityZoneGroup::Read(char *buf, uint64_t offset, uint64_t size) {
+  if (offset + size > Written()) {
+    return false;
+  }
+  while (size > 0) {
+    uint64_t unit = offset / stripe_sz_;
+    uint64_t in_unit = offset % stripe_sz_;
+    uint64_t n = std::min(size, stripe_sz_ - in_unit);
+    uint32_t member = unit % nr_data_;
+    uint64_t zone_offset = unit / nr_data_ * stripe_sz_ + in_unit;
+    bool ok = (int)member == failed_
+                  ? Rebuild(member, zone_offset, buf, n)
+                  : ReadMember(member, zone_offset, buf, n);
+    if (!ok) {
+      return false;
+    }
+    buf += n;
+    offset += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool ParityZoneGroup::ReadMember(uint32_t member, uint64_t zone_offset,
+                                 char *buf, uint64_t size) {
+  auto zone = members_[member];
+  auto ret = pread(zone->GetDevice()->GetReadDirectFD(), buf, size,
+                   zone->start_ + zone_offset);
+  return ret == (ssize_t)size;
+}
+
+bool ParityZoneGroup::Rebuild(uint32_t member, uint64_t zone_offset,
+                              char *buf, uint64_t size) {
+  // The same range of every other member of the row, parity included
+  std::vector<uint32_t> others;
+  for (uint32_t m = 0; m < members_.size(); ++m) {
+    if (m != member) {
+      others.push_back(m);
+    }
+  }
+  bool ok = RunUnits(others.size(), false, size,
+                     [&](uint64_t i, uint32_t *m, char **dst,
+                         uint64_t *offset) {
+                       *m = others[i];
+                       *dst = rebuild_bufs_[i];
+                       *offset = members_[others[i]]->start_ + zone_offset;
+                       return true;
+                     });
+  if (!ok) {
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  XorBlocks(buf, rebuild_bufs_.data(), others.size(), size);
+  stats_.rebuild_micros += MicrosSince(start);
+  stats_.rebuilds++;
+  return true;
+}
+
+bool ParityZoneGroup::MarkFailed(uint32_t member) {
+  if (member >= members_.size() ||
+      (failed_ >= 0 && failed_ != (int)member)) {
+    return false;
+  }
+  failed_ = member;
+  return true;
+}
+
+bool ParityZoneGroup::Reset() {
+  for (auto zone : members_) {
+    if (!zone->Reset()) {
+      return false;
+    }
+  }
+  rows_ = 0;
+  failed_ = -1;
+  return true;
+}
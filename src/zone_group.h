@@ -0,0 +1,159 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "histogram.h"
+#include "zbd_fs.h"
+
+// A logical append stream striped over a group of zones, usually one zone on
+// each of several devices. An append is cut into stripe units that go to the
+// members round-robin and are written in parallel through one AsyncIOQueue,
+// so the write pointers of the members advance together. The caller owns
+// (has acquired) the member zones.
+class StripedZoneGroup {
+public:
+  // `member_stats`, if given, receives the latency and throughput of every
+  // stripe unit written to the member with the same index
+  StripedZoneGroup(std::vector<Zone *> members, uint64_t stripe_sz,
+                   std::vector<Statistics *> member_stats = {});
+
+  // Set up the I/O queue for appends of at most `max_append` bytes.
+  // `phase_stats`, if given, receives the submit/device/complete phases of
+  // every stripe unit
+  bool Init(uint64_t max_append, Statistics *phase_stats = nullptr);
+
+  // Append `size` bytes, a multiple of the stripe size. Return false on I/O
+  // error or if the group cannot fit the data
+  bool Append(const char *data, uint64_t size);
+
+  // Reset every member zone
+  bool Reset();
+
+  // Bytes that can still be appended to the group
+  uint64_t GetCapacityLeft() const;
+
+  uint64_t StripeSize() const { return stripe_sz_; }
+  const std::vector<Zone *> &Members() const { return members_; }
+
+private:
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  struct Unit {
+    uint32_t member;
+    TimePoint start;
+  };
+
+  std::vector<Zone *> members_;
+  uint64_t stripe_sz_;
+  std::vector<Statistics *> member_stats_;
+  uint32_t next_member_ = 0;
+
+  std::unique_ptr<AsyncIOQueue> queue_;
+  std::vector<Unit> units_;
+  std::vector<io_event> events_;
+};
+
+// K data zones and one parity zone written in lockstep, a RAID 4 stripe
+// with a dedicated parity member. An append covers whole rows, one stripe
+// unit on every data member, and the XOR of the units of a row goes to the
+// parity member at the same offset. So the write pointers of all members
+// stay equal and logical unit u always lives on data member u % K at row
+// u / K. Reads of a member marked failed are rebuilt from the other members
+// of the row. The caller owns the member zones; the group itself is not
+// thread safe.
+class ParityZoneGroup {
+public:
+  struct Stats {
+    uint64_t rows = 0;
+    // Computing parity, over `parity_bytes` of data
+    uint64_t parity_micros = 0;
+    uint64_t parity_bytes = 0;
+    // Reads of a failed member and the XOR time spent rebuilding them
+    uint64_t rebuilds = 0;
+    uint64_t rebuild_micros = 0;
+
+    void Merge(const Stats &other);
+  };
+
+  ParityZoneGroup(std::vector<Zone *> data, Zone *parity, uint64_t stripe_sz);
+  ~ParityZoneGroup();
+
+  ParityZoneGroup(const ParityZoneGroup &) = delete;
+  ParityZoneGroup &operator=(const ParityZoneGroup &) = delete;
+
+  // Set up the I/O queue and buffers for appends of at most `max_append`
+  // bytes, see StripedZoneGroup::Init()
+  bool Init(uint64_t max_append, Statistics *phase_stats = nullptr);
+
+  // Append `size` bytes, a multiple of RowSize(). Return false on I/O
+  // error, if the group cannot fit the data or its members are out of step
+  bool Append(const char *data, uint64_t size);
+
+  // Read `size` bytes at logical `offset` of what was appended. Both and
+  // `buf` must suit O_DIRECT
+  bool Read(char *buf, uint64_t offset, uint64_t size);
+
+  // Stop using `member`, K being the parity zone. Reads of a failed data
+  // member are rebuilt and appends skip it. Only one member can fail
+  bool MarkFailed(uint32_t member);
+  bool Degraded() const { return failed_ >= 0; }
+  int FailedMember() const { return failed_; }
+
+  // Reset every member zone, which also brings a failed member back
+  bool Reset();
+
+  // Data bytes that can still be appended to the group
+  uint64_t GetCapacityLeft() const;
+  // Data bytes appended since the last reset
+  uint64_t Written() const { return rows_ * RowSize(); }
+  uint64_t RowSize() const { return stripe_sz_ * nr_data_; }
+  uint64_t StripeSize() const { return stripe_sz_; }
+  uint32_t NrData() const { return nr_data_; }
+  const std::vector<Zone *> &Members() const { return members_; }
+
+  // Whether the write pointers of all members are at the same offset
+  bool InLockstep() const;
+
+  const Stats &GetStats() const { return stats_; }
+
+  // dst = srcs[0] ^ ... ^ srcs[n - 1] in one pass, with AVX2 when the CPU
+  // has it and `simd` is set
+  static void XorBlocks(char *dst, const char *const *srcs, uint32_t n,
+                        uint64_t size, bool simd = true);
+
+private:
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  struct Unit {
+    uint32_t member;
+  };
+
+  // Submit `nr` writes or reads from `next(i, &member, &buf, &offset)` at
+  // the queue depth and wait for all of them
+  template <typename Next>
+  bool RunUnits(uint64_t nr, bool write, uint64_t size, Next next);
+  bool ReadMember(uint32_t member, uint64_t zone_offset, char *buf,
+                  uint64_t size);
+  bool Rebuild(uint32_t member, uint64_t zone_offset, char *buf,
+               uint64_t size);
+
+  // Data members first, the parity member last
+  std::vector<Zone *> members_;
+  uint32_t nr_data_;
+  uint64_t stripe_sz_;
+  uint64_t max_rows_ = 0;
+  uint64_t rows_ = 0;
+  int failed_ = -1;
+
+  std::unique_ptr<AsyncIOQueue> queue_;
+  std::vector<Unit> units_;
+  std::vector<io_event> events_;
+  // Parity of max_rows_ rows, and one unit per member to rebuild from
+  char *parity_buf_ = nullptr;
+  std::vector<char *> rebuild_bufs_;
+
+  Stats stats_;
+};
@@ -0,0 +1,409 @@
+#include "zone_journal.h"
+
+#include <libzbd/zbd.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+// CRC-32C, one table lookup per byte. Extends `crc`, 0 to start
+uint32_t Crc32c(uint32_t crc, const char *data, uint64_t size) {
+  static const auto table = []() {
+    std::vector<uint32_t> t(256);
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int b = 0; b < 8; ++b) {
+        crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+      }
+      t[i] = crc;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (uint64_t i = 0; i < size; ++i) {
+    crc = table[(crc ^ (uint8_t)data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+} // namespace
+
+static_assert(sizeof(ZoneJournal::Entry) == 48, "entries are packed");
+
+std::string ZoneJournal::Stats::ToString() const {
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           "[Records: %" PRIu64 "][Blocks: %" PRIu64 "][Syncs: %" PRIu64 "]"
+           "[Snapshots: %" PRIu64 "][Bytes: %" PRIu64 "]"
+           "[Replay: %" PRIu64 "us][Replay bytes: %" PRIu64 "]"
+           "[Replay records: %" PRIu64 "][Epoch: %" PRIu64 "][Torn: %d]",
+           records, blocks, syncs, snapshots, bytes, replay_micros,
+           replay_bytes, replay_records, replay_epoch, torn);
+  return buf;
+}
+
+ZoneJournal::ZoneJournal(ZonedBlockDevice *zbd, const struct zbd_zone *meta,
+                         const Options &options)
+    : zbd_(zbd), options_(options), block_sz_(zbd->GetBlockSize()) {
+  for (int i = 0; i < 2; ++i) {
+    meta_[i].start = zbd_zone_start(&meta[i]);
+    meta_[i].capacity = zbd_zone_capacity(&meta[i]);
+    meta_[i].wp = zbd_zone_full(&meta[i])
+                      ? meta_[i].start + meta_[i].capacity
+                      : zbd_zone_wp(&meta[i]);
+  }
+  // Whole blocks, so that replay never reads half a block
+  options_.read_size = std::max<uint64_t>(
+      options_.read_size / block_sz_ * block_sz_, block_sz_);
+  if (posix_memalign((void **)&block_, sysconf(_SC_PAGESIZE), block_sz_)) {
+    block_ = nullptr;
+    error_ = true;
+    return;
+  }
+  memset(block_, 0, block_sz_);
+}
+
+ZoneJournal::~ZoneJournal() { free(block_); }
+
+ZoneJournal::Entry ZoneJournal::EntryOf(ZonedBlockDevice *zbd, Zone *zone) {
+  Entry entry = {};
+  entry.index = zone - zbd->GetIOZone(0);
+  entry.zone_nr = zone->GetZoneNr();
+  entry.state = zone->IsEmpty() ? kEmpty : zone->IsFull() ? kFull : kOpen;
+  entry.generation = zone->generation_;
+  entry.owner = zone->owner_;
+  entry.wp = zone->wp_ - zone->start_;
+  entry.valid = zone->used_capacity_;
+  entry.capacity = zone->max_capacity_;
+  return entry;
+}
+
+void ZoneJournal::Seal(char *block, uint32_t type, uint32_t count,
+                       uint32_t part, uint32_t parts) {
+  auto header = reinterpret_cast<BlockHeader *>(block);
+  header->magic = kMagic;
+  header->crc = 0;
+  header->epoch = epoch_;
+  header->seq = seq_++;
+  header->type = type;
+  header->count = count;
+  header->part = part;
+  header->parts = parts;
+  header->crc = Crc32c(0, block, block_sz_);
+}
+
+bool ZoneJournal::Valid(const char *block, uint64_t epoch,
+                        uint64_t seq) const {
+  BlockHeader header;
+  memcpy(&header, block, sizeof(header));
+  if (header.magic != kMagic || header.epoch != epoch || header.seq != seq ||
+      header.count > PerBlock() ||
+      (header.type == kSnapshotBlock && header.part >= header.parts)) {
+    return false;
+  }
+  // The crc was taken with its own field zeroed
+  const char zero[sizeof(header.crc)] = {};
+  auto at = offsetof(BlockHeader, crc);
+  auto crc = Crc32c(0, block, at);
+  crc = Crc32c(crc, zero, sizeof(zero));
+  at += sizeof(zero);
+  return Crc32c(crc, block + at, block_sz_ - at) == header.crc;
+}
+
+bool ZoneJournal::WriteAt(const char *buf, uint64_t size, uint64_t offset) {
+  while (size) {
+    auto ret = pwrite(zbd_->GetWriteFD(), buf, size, offset);
+    if (ret <= 0) {
+      printf("Zone journal write failed: %s\n", strerror(errno));
+      error_ = true;
+      return false;
+    }
+    buf += ret;
+    offset += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+void ZoneJournal::Add(const Entry &entry) {
+  table_[entry.index] = entry;
+  auto entries = reinterpret_cast<Entry *>(block_ + sizeof(BlockHeader));
+  entries[pending_++] = entry;
+  since_snapshot_++;
+  stats_.records++;
+  if (pending_ == PerBlock()) {
+    Flush(false);
+  }
+}
+
+bool ZoneJournal::Flush(bool sync) {
+  if (error_) {
+    return false;
+  }
+  if (pending_ == 0) {
+    return true;
+  }
+  auto &meta = meta_[active_];
+  // The snapshot carries the pending records along
+  if (since_snapshot_ >= options_.snapshot_records ||
+      meta.wp + block_sz_ > meta.start + meta.capacity) {
+    return Rollover();
+  }
+
+  Seal(block_, kRecordBlock, pending_, 0, 0);
+  if (!WriteAt(block_, block_sz_, meta.wp)) {
+    return false;
+  }
+  meta.wp += block_sz_;
+  stats_.blocks++;
+  stats_.bytes += block_sz_;
+  if (sync && pending_ < PerBlock()) {
+    stats_.syncs++;
+  }
+  pending_ = 0;
+  memset(block_, 0, block_sz_);
+  return true;
+}
+
+bool ZoneJournal::Rollover() {
+  auto next = 1 - active_;
+  auto &meta = meta_[next];
+  uint64_t parts = SnapshotBlocks();
+  uint64_t size = parts * block_sz_;
+  if (size > meta.capacity) {
+    printf("Zone journal snapshot of %zu zones does not fit a zone\n",
+           table_.size());
+    error_ = true;
+    return false;
+  }
+
+  if (meta.wp != meta.start) {
+    if (zbd_reset_zones(zbd_->GetWriteFD(), meta.start,
+                        zbd_->GetZoneSize())) {
+      error_ = true;
+      return false;
+    }
+    meta.wp = meta.start;
+  }
+
+  char *buf = nullptr;
+  if (posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE), size)) {
+    error_ = true;
+    return false;
+  }
+  memset(buf, 0, size);
+  epoch_++;
+  seq_ = 0;
+  for (uint64_t part = 0; part < parts; ++part) {
+    char *block = buf + part * block_sz_;
+    auto begin = part * PerBlock();
+    uint32_t count = std::min<uint64_t>(PerBlock(), table_.size() - begin);
+    memcpy(block + sizeof(BlockHeader), &table_[begin], count * sizeof(Entry));
+    Seal(block, kSnapshotBlock, count, part, parts);
+  }
+  bool ok = WriteAt(buf, size, meta.start);
+  free(buf);
+  if (!ok) {
+    return false;
+  }
+  meta.wp += size;
+  stats_.snapshots++;
+  stats_.blocks += parts;
+  stats_.bytes += size;
+
+  // Only now the old zone is no longer needed by replay. Finishing it gives
+  // back its active zone resource
+  auto &old = meta_[active_];
+  if (old.wp != old.start && old.wp < old.start + old.capacity) {
+    if (zbd_finish_zones(zbd_->GetWriteFD(), old.start,
+                         zbd_->GetZoneSize())) {
+      error_ = true;
+      return false;
+    }
+    old.wp = old.start + old.capacity;
+  }
+  active_ = next;
+  pending_ = 0;
+  since_snapshot_ = 0;
+  memset(block_, 0, block_sz_);
+  return true;
+}
+
+bool ZoneJournal::Start(bool fresh) {
+  std::lock_guard<std::mutex> lck(mtx_);
+  if (error_) {
+    return false;
+  }
+  table_.resize(zbd_->GetNrIOZones());
+  for (size_t i = 0; i < table_.size(); ++i) {
+    table_[i] = EntryOf(zbd_, zbd_->GetIOZone(i));
+  }
+  if (fresh) {
+    for (auto &meta : meta_) {
+      if (meta.wp != meta.start &&
+          zbd_reset_zones(zbd_->GetWriteFD(), meta.start,
+                          zbd_->GetZoneSize())) {
+        error_ = true;
+        return false;
+      }
+      meta.wp = meta.start;
+    }
+    epoch_ = 0;
+    // Roll over into zone 0
+    active_ = 1;
+  }
+  return Rollover();
+}
+
+void ZoneJournal::Log(Zone *zone) {
+  auto entry = EntryOf(zbd_, zone);
+  std::lock_guard<std::mutex> lck(mtx_);
+  if (!error_) {
+    Add(entry);
+  }
+}
+
+bool ZoneJournal::LogOpen(Zone *zone, bool reset) {
+  auto entry = EntryOf(zbd_, zone);
+  entry.state = kOpen;
+  entry.generation += reset;
+  std::lock_guard<std::mutex> lck(mtx_);
+  if (error_) {
+    return false;
+  }
+  Add(entry);
+  return Flush(true);
+}
+
+bool ZoneJournal::Sync() {
+  std::lock_guard<std::mutex> lck(mtx_);
+  return Flush(true);
+}
+
+ZoneJournal::Stats ZoneJournal::GetStats() {
+  std::lock_guard<std::mutex> lck(mtx_);
+  return stats_;
+}
+
+bool ZoneJournal::ZoneEpoch(const MetaZone &meta, uint64_t *epoch) {
+  if (meta.wp < meta.start + block_sz_) {
+    return false;
+  }
+  auto ret = pread(zbd_->GetReadDirectFD(), block_, block_sz_, meta.start);
+  if (ret != (ssize_t)block_sz_) {
+    return false;
+  }
+  BlockHeader header;
+  memcpy(&header, block_, sizeof(header));
+  if (header.type != kSnapshotBlock || header.part != 0 ||
+      !Valid(block_, header.epoch, 0)) {
+    return false;
+  }
+  *epoch = header.epoch;
+  return true;
+}
+
+bool ZoneJournal::ReplayZone(const MetaZone &meta, uint64_t epoch,
+                             std::vector<Entry> *table) {
+  char *buf = nullptr;
+  if (posix_memalign((void **)&buf, sysconf(_SC_PAGESIZE),
+                     options_.read_size)) {
+    return false;
+  }
+
+  std::vector<Entry> snapshot;
+  bool have_snapshot = false;
+  bool stop = false;
+  uint64_t seq = 0;
+  uint64_t records = 0;
+  stats_.torn = false;
+  for (uint64_t offset = meta.start; offset < meta.wp && !stop;) {
+    uint64_t size = std::min(options_.read_size, meta.wp - offset);
+    auto ret = pread(zbd_->GetReadDirectFD(), buf, size, offset);
+    if (ret != (ssize_t)size) {
+      stop = true;
+      break;
+    }
+    stats_.replay_bytes += size;
+    offset += size;
+
+    for (uint64_t pos = 0; pos + block_sz_ <= size; pos += block_sz_) {
+      const char *block = buf + pos;
+      BlockHeader header;
+      memcpy(&header, block, sizeof(header));
+      if (!Valid(block, epoch, seq)) {
+        stats_.torn = true;
+        stop = true;
+        break;
+      }
+      seq++;
+
+      auto entries = reinterpret_cast<const Entry *>(block + sizeof(header));
+      if (header.type == kSnapshotBlock) {
+        if (header.part == 0) {
+          snapshot.clear();
+        }
+        snapshot.insert(snapshot.end(), entries, entries + header.count);
+        if (header.part + 1 == header.parts) {
+          *table = std::move(snapshot);
+          snapshot.clear();
+          have_snapshot = true;
+        }
+        continue;
+      }
+      // Records before the first complete snapshot have nothing to go to
+      if (!have_snapshot) {
+        stats_.torn = true;
+        stop = true;
+        break;
+      }
+      for (uint32_t i = 0; i < header.count; ++i) {
+        if (entries[i].index < table->size()) {
+          (*table)[entries[i].index] = entries[i];
+          records++;
+        }
+      }
+    }
+  }
+  free(buf);
+  stats_.replay_records = records;
+  return have_snapshot;
+}
+
+bool ZoneJournal::Replay(std::vector<Entry> *table) {
+  std::lock_guard<std::mutex> lck(mtx_);
+  auto start = std::chrono::steady_clock::now();
+  stats_.replay_bytes = 0;
+  stats_.replay_records = 0;
+
+  // The newest epoch first. A rollover that died before its snapshot was
+  // complete leaves the older zone untouched, replay falls back to it
+  uint64_t epochs[2] = {0, 0};
+  bool valid[2];
+  for (int i = 0; i < 2; ++i) {
+    valid[i] = ZoneEpoch(meta_[i], &epochs[i]);
+  }
+  int order[2] = {0, 1};
+  if (valid[1] && (!valid[0] || epochs[1] > epochs[0])) {
+    std::swap(order[0], order[1]);
+  }
+
+  bool ok = false;
+  for (int i : order) {
+    if (valid[i] && ReplayZone(meta_[i], epochs[i], table)) {
+      active_ = i;
+      epoch_ = epochs[i];
+      stats_.replay_epoch = epoch_;
+      ok = true;
+      break;
+    }
+  }
+  stats_.replay_micros = MicrosSince(start);
+  return ok;
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "zbd_fs.h"
+
+// Append-only journal of the zone table in two metadata zones, so that a
+// restart can rebuild the table without reporting every zone of the device,
+// and keep what the device does not know: who owns a zone, how many of its
+// bytes are still valid and how often it was reset. Every record is the
+// whole state of one zone, so replay applies the records in order over the
+// snapshot that starts the metadata zone.
+//
+// Records reach the device in blocks of the device block size:
+//
+//   header | entry 0 ... entry n-1 | zero padding
+//
+// A block is written once it is full, or earlier when a record must be
+// durable before its zone changes on the device: a zone is journaled as
+// open before its first write and before a reset. Replay asks the device
+// for the write pointer of every zone the journal has as open and trusts
+// it for the empty and full ones, so a lost tail of lazy records only
+// loses valid byte counts and owners, never a write pointer.
+//
+// Every `snapshot_records` records, or once the metadata zone fills up,
+// the journal rolls over: the other metadata zone is reset and starts with
+// a snapshot of the whole table under a higher epoch, and only then is the
+// old zone finished. Replay reads the zone with the newest complete
+// snapshot and stops at the first block that fails its checks.
+class ZoneJournal {
+public:
+  static constexpr uint32_t kMagic = 0x5a4e534a;  // "ZNSJ"
+
+  enum State : uint32_t {
+    kEmpty,
+    // Written and neither full nor finished when journaled, the device has
+    // the write pointer
+    kOpen,
+    kFull,
+  };
+
+  // The state of one I/O zone, a record or a snapshot entry
+  struct Entry {
+    uint32_t index;    // of the I/O zone
+    uint32_t zone_nr;  // on the device
+    uint32_t state;
+    uint32_t generation;
+    uint32_t owner;
+    uint32_t pad;
+    uint64_t wp;  // relative to the start of the zone
+    uint64_t valid;
+    uint64_t capacity;
+  };
+
+  struct Options {
+    // Records between two snapshots
+    uint64_t snapshot_records = 64 * 1024;
+    // Size of the reads of Replay()
+    uint64_t read_size = 1 << 20;
+  };
+
+  struct Stats {
+    uint64_t records = 0;
+    uint64_t blocks = 0;
+    // Blocks written before they were full, to make a record durable
+    uint64_t syncs = 0;
+    uint64_t snapshots = 0;
+    uint64_t bytes = 0;
+    // Of the last Replay()
+    uint64_t replay_micros = 0;
+    uint64_t replay_bytes = 0;
+    uint64_t replay_records = 0;
+    uint64_t replay_epoch = 0;
+    // Replay stopped at a block that failed its checks rather than at the
+    // write pointer of the metadata zone
+    bool torn = false;
+
+    std::string ToString() const;
+  };
+
+  // `meta` are the report entries of the two metadata zones
+  ZoneJournal(ZonedBlockDevice *zbd, const struct zbd_zone *meta,
+              const Options &options);
+  ~ZoneJournal();
+
+  ZoneJournal(const ZoneJournal &) = delete;
+  ZoneJournal &operator=(const ZoneJournal &) = delete;
+
+  // Read the newest complete snapshot and the records after it into
+  // `table`, indexed by I/O zone. False if no metadata zone holds one
+  bool Replay(std::vector<Entry> *table);
+
+  // Start journaling the zone table of the device with a snapshot in the
+  // metadata zone Replay() did not pick. `fresh` resets both of them first,
+  // dropping whatever an earlier journal left there
+  bool Start(bool fresh);
+
+  // Journal the current state of `zone`. The record reaches the device with
+  // the next block, so it is lost in a crash until then
+  void Log(Zone *zone);
+  // Journal `zone` as open and wait for it to reach the device, before the
+  // first write to the zone or a reset of it. Before a reset the record
+  // carries the generation the reset gives the zone, the zone keeps its
+  // own until the reset succeeded
+  bool LogOpen(Zone *zone, bool reset = false);
+  // Write the records that are not on the device yet
+  bool Sync();
+
+  static Entry EntryOf(ZonedBlockDevice *zbd, Zone *zone);
+
+  Stats GetStats();
+
+private:
+  enum BlockType : uint32_t { kRecordBlock = 1, kSnapshotBlock = 2 };
+
+  struct BlockHeader {
+    uint32_t magic;
+    uint32_t crc;  // of the whole block with this field 0
+    uint64_t epoch;
+    uint64_t seq;  // of the block in its metadata zone, from 0
+    uint32_t type;
+    uint32_t count;  // entries in the block
+    // A snapshot spans `parts` consecutive blocks
+    uint32_t part;
+    uint32_t parts;
+  };
+
+  struct MetaZone {
+    uint64_t start;
+    uint64_t capacity;
+    uint64_t wp;
+  };
+
+  uint32_t PerBlock() const {
+    return (block_sz_ - sizeof(BlockHeader)) / sizeof(Entry);
+  }
+  uint32_t SnapshotBlocks() const {
+    return (table_.size() + PerBlock() - 1) / PerBlock();
+  }
+
+  void Add(const Entry &entry);
+  // Write the pending records, or roll over if it is time to
+  bool Flush(bool sync);
+  // Snapshot the table into the other metadata zone and continue there
+  bool Rollover();
+  void Seal(char *block, uint32_t type, uint32_t count, uint32_t part,
+            uint32_t parts);
+  // Check the block read at position `seq` of a zone of `epoch`
+  bool Valid(const char *block, uint64_t epoch, uint64_t seq) const;
+  bool WriteAt(const char *buf, uint64_t size, uint64_t offset);
+  // Epoch of the snapshot the zone starts with, false if it has none
+  bool ZoneEpoch(const MetaZone &meta, uint64_t *epoch);
+  bool ReplayZone(const MetaZone &meta, uint64_t epoch,
+                  std::vector<Entry> *table);
+
+  ZonedBlockDevice *zbd_;
+  Options options_;
+  uint32_t block_sz_;
+  MetaZone meta_[2];
+
+  std::mutex mtx_;
+  // What the journal says, one entry per I/O zone
+  std::vector<Entry> table_;
+  // The block being filled with records
+  char *block_ = nullptr;
+  uint32_t pending_ = 0;
+  uint32_t active_ = 0;
+  uint64_t epoch_ = 0;
+  uint64_t seq_ = 0;
+  uint64_t since_snapshot_ = 0;
+  // A write failed, the journal no longer matches the device
+  bool error_ = false;
+  Stats stats_;
+};
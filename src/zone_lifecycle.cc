@@ -0,0 +1,139 @@
+#include "zone_lifecycle.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+std::string ZoneLifecycle::Stats::ToString() const {
+  char buf[512];
+  snprintf(buf, sizeof(buf),
+           "[Allocations: %" PRIu64 "][Deferred: %" PRIu64 "]"
+           "[Idle closes: %" PRIu64 "][Over open: %" PRIu64 "]"
+           "[Max active: %ld][Max open: %ld]",
+           allocations, deferred, idle_closes, over_open, max_active,
+           max_open);
+  return buf;
+}
+
+ZoneLifecycle::ZoneLifecycle(ZonedBlockDevice *zbd, const Options &options)
+    : zbd_(zbd), options_(options), epoch_(Clock::now()),
+      last_write_(new std::atomic<uint64_t>[zbd->GetNrIOZones()]) {
+  for (size_t i = 0; i < zbd_->GetNrIOZones(); ++i) {
+    last_write_[i] = 0;
+  }
+}
+
+uint64_t ZoneLifecycle::NowMicros() const {
+  return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() -
+                                                               epoch_)
+      .count();
+}
+
+Zone *ZoneLifecycle::TryAllocateZone() {
+  Zone *zone = nullptr;
+  {
+    // Zones handed out count as active right away, so that two streams
+    // cannot both take the last active zone
+    std::lock_guard<std::mutex> lck(mtx_);
+    if (zbd_->GetActiveZones() + pending_ < zbd_->GetMaxActiveZones()) {
+      zone = zbd_->AcquireEmptyZone();
+      if (!zone) {
+        zone = RecycleFullZone();
+      }
+      if (zone) {
+        pending_++;
+      }
+    }
+  }
+  std::lock_guard<std::mutex> lck(stats_mtx_);
+  if (zone) {
+    stats_.allocations++;
+  } else {
+    stats_.deferred++;
+  }
+  return zone;
+}
+
+Zone *ZoneLifecycle::RecycleFullZone() {
+  for (auto &zone : zbd_->io_zones_) {
+    if (zone.IsBusy() || !zone.IsFull() || zone.IsUsed() || !zone.Acquire()) {
+      continue;
+    }
+    if (zone.IsFull() && zone.Reset()) {
+      return &zone;
+    }
+    zone.CheckRelease();
+  }
+  return nullptr;
+}
+
+bool ZoneLifecycle::Append(Zone *zone, char *data, uint32_t size) {
+  if (!zone->IsOpen() && zbd_->GetOpenZones() >= zbd_->GetMaxOpenZones()) {
+    CloseIdleZone(zone);
+  }
+
+  bool was_empty = zone->IsEmpty();
+  bool ok = zone->Append(data, size);
+  if (ok && was_empty) {
+    // Now counted by the device
+    pending_--;
+  }
+  last_write_[zone - zbd_->GetIOZone(0)] = NowMicros();
+  TrackPeaks();
+  return ok;
+}
+
+void ZoneLifecycle::CloseIdleZone(Zone *except) {
+  auto now = NowMicros();
+  Zone *victim = nullptr;
+  uint64_t oldest = UINT64_MAX;
+  for (size_t i = 0; i < zbd_->GetNrIOZones(); ++i) {
+    auto zone = zbd_->GetIOZone(i);
+    if (zone == except || !zone->IsOpen() || zone->IsBusy()) {
+      continue;
+    }
+    auto last = last_write_[i].load(std::memory_order_relaxed);
+    if (now - last < options_.idle_close_us) {
+      continue;
+    }
+    if (last < oldest) {
+      oldest = last;
+      victim = zone;
+    }
+  }
+
+  bool closed = false;
+  if (victim && victim->Acquire()) {
+    closed = victim->IsOpen() && victim->Close();
+    victim->CheckRelease();
+  }
+  std::lock_guard<std::mutex> lck(stats_mtx_);
+  if (closed) {
+    stats_.idle_closes++;
+  } else {
+    stats_.over_open++;
+  }
+}
+
+bool ZoneLifecycle::Retire(Zone *zone) {
+  if (zone->IsEmpty()) {
+    pending_--;
+    return true;
+  }
+  if (zone->IsFull()) {
+    return true;
+  }
+  return zone->Finish();
+}
+
+void ZoneLifecycle::TrackPeaks() {
+  auto active = zbd_->GetActiveZones();
+  auto open = zbd_->GetOpenZones();
+  std::lock_guard<std::mutex> lck(stats_mtx_);
+  stats_.max_active = std::max(stats_.max_active, active);
+  stats_.max_open = std::max(stats_.max_open, open);
+}
+
+ZoneLifecycle::Stats ZoneLifecycle::GetStats() {
+  std::lock_guard<std::mutex> lck(stats_mtx_);
+  return stats_;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "zbd_fs.h"
+
+// Hand out zones to write streams within the active and open zone limits of
+// the device, the way a zoned file system has to. A new stream only gets an
+// empty zone while the device has an active zone to spare, otherwise it is
+// turned away until another stream fills or finishes one. A write to a
+// zone that is not open, while all open zones are taken, first closes the
+// open zone that has gone without a write the longest. Zones are finished
+// early by the finish threshold of the device (see Zone::Append()) or when
+// a stream retires them.
+//
+// Streams acquire a zone only around each of their writes, so that an idle
+// zone can be closed by any writer.
+class ZoneLifecycle {
+public:
+  struct Options {
+    // Only close zones that have been idle for at least this long, 0
+    // closes the least recently written one regardless
+    uint64_t idle_close_us = 0;
+  };
+
+  struct Stats {
+    uint64_t allocations = 0;
+    // Allocations turned away, no active zone or no zone was free
+    uint64_t deferred = 0;
+    uint64_t idle_closes = 0;
+    // Writes that opened a zone beyond the limit, nothing could be closed
+    uint64_t over_open = 0;
+    long max_active = 0;
+    long max_open = 0;
+
+    std::string ToString() const;
+  };
+
+  ZoneLifecycle(ZonedBlockDevice *zbd, const Options &options);
+
+  // Acquire an empty zone for a stream, resetting a full one if there is no
+  // empty zone left. Does not wait: return nullptr if no active zone is
+  // free, the caller moves on to another stream and tries again later. A
+  // single writer owning all streams is the only one who could free one
+  Zone *TryAllocateZone();
+
+  // Append to a zone the caller has acquired, closing an idle zone first if
+  // this write would open one too many
+  bool Append(Zone *zone, char *data, uint32_t size);
+
+  // The stream is done with the acquired zone: finish it unless it is full
+  // already, giving up the capacity left
+  bool Retire(Zone *zone);
+
+  Stats GetStats();
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  uint64_t NowMicros() const;
+  // Acquire a full zone nobody uses and reset it
+  Zone *RecycleFullZone();
+  void CloseIdleZone(Zone *except);
+  void TrackPeaks();
+
+  ZonedBlockDevice *zbd_;
+  Options options_;
+  Clock::time_point epoch_;
+
+  std::mutex mtx_;
+  // Zones handed out but not written yet, they will take an active zone
+  std::atomic<long> pending_{0};
+  // Time of the last write of every zone, in micros since epoch_
+  std::unique_ptr<std::atomic<uint64_t>[]> last_write_;
+
+  std::mutex stats_mtx_;
+  Stats stats_;
+};
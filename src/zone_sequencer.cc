@@ -0,0 +1,164 @@
+#include "zone_sequencer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cinttypes>
+#include <cstdio>
+
+namespace {
+// Give up when the device keeps rejecting writes without any of them
+// getting through in between
+const uint32_t kMaxRecoveries = 8;
+} // namespace
+
+void ZoneWriteSequencer::Stats::Merge(const Stats &other) {
+  writes += other.writes;
+  bytes += other.bytes;
+  retries += other.retries;
+  recoveries += other.recoveries;
+}
+
+std::string ZoneWriteSequencer::Stats::ToString() const {
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "[Writes: %" PRIu64 "][Written: %.1fMiB][Retries: %" PRIu64 "]"
+           "[Recoveries: %" PRIu64 "]",
+           writes, ToMiB(bytes), retries, recoveries);
+  return buf;
+}
+
+ZoneWriteSequencer::ZoneWriteSequencer(ZonedBlockDevice *zbd, uint32_t depth,
+                                       Statistics *stats)
+    : zbd_(zbd), write_stats_(stats), queue_(depth), events_(depth) {}
+
+bool ZoneWriteSequencer::Init() { return queue_.Init(); }
+
+bool ZoneWriteSequencer::Open(Zone *zone) {
+  if (!Flush()) {
+    return false;
+  }
+  zone_ = zone;
+  return true;
+}
+
+bool ZoneWriteSequencer::Write(const char *buf, uint32_t size) {
+  assert(zone_);
+  // A rejected write stops new submissions until it has been replayed
+  while (has_failed_ || queue_.InFlight() >= queue_.Depth()) {
+    if (!WaitOne()) {
+      return false;
+    }
+  }
+
+  uint64_t offset;
+  if (!zone_->Reserve(size, &offset)) {
+    return false;
+  }
+  window_.push_back({buf, size, offset, std::chrono::steady_clock::now()});
+  return Submit(&window_.back());
+}
+
+bool ZoneWriteSequencer::Flush() {
+  while (has_failed_ || queue_.InFlight() > 0) {
+    if (!WaitOne()) {
+      return false;
+    }
+  }
+  Retire();
+  assert(window_.empty());
+  return true;
+}
+
+bool ZoneWriteSequencer::Submit(Request *request) {
+  request->done = false;
+  request->failed = false;
+  // Requests stay put in the deque while others are added or retired
+  return queue_.SubmitWrite(zbd_->GetWriteFD(),
+                            const_cast<char *>(request->buf), request->size,
+                            request->offset, request);
+}
+
+bool ZoneWriteSequencer::WaitOne() {
+  if (queue_.InFlight() > 0) {
+    int n = queue_.Reap(1, events_.size(), events_.data());
+    if (n < 0) {
+      return false;
+    }
+    auto now = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+      auto request = static_cast<Request *>(events_[i].data);
+      if (static_cast<int64_t>(events_[i].res) !=
+          static_cast<int64_t>(request->size)) {
+        // Most likely overtaken by a later write, see Recover()
+        request->failed = true;
+        has_failed_ = true;
+        continue;
+      }
+      request->done = true;
+      recoveries_in_row_ = 0;
+      stats_.writes++;
+      stats_.bytes += request->size;
+      if (write_stats_) {
+        auto dura = std::chrono::duration_cast<std::chrono::microseconds>(
+                        now - request->start)
+                        .count();
+        dura = std::max<int64_t>(dura, 1);
+        write_stats_->AddLatency(kWrite, dura);
+        write_stats_->AddThroughput(kWrite,
+                                    (double)request->size * 1e6 / dura);
+        write_stats_->AddBytes(kWrite, request->size);
+      }
+    }
+  }
+
+  if (has_failed_ && queue_.InFlight() == 0) {
+    return Recover();
+  }
+  Retire();
+  return true;
+}
+
+bool ZoneWriteSequencer::Recover() {
+  stats_.recoveries++;
+  if (++recoveries_in_row_ > kMaxRecoveries) {
+    printf("[ZoneWriteSequencer] Zone %lu keeps rejecting writes\n",
+           zone_->GetZoneNr());
+    return false;
+  }
+
+  // Everything below the write pointer of the device made it. The first
+  // write that did not must start right there, and all writes behind it
+  // were rejected as well since they could not land on the write pointer
+  uint64_t wp;
+  if (!zone_->ReportWritePointer(&wp)) {
+    return false;
+  }
+  Retire();
+  if (window_.empty() || window_.front().offset != wp) {
+    printf("[ZoneWriteSequencer] Zone %lu write pointer at %lu, expected "
+           "%lu\n",
+           zone_->GetZoneNr(), wp,
+           window_.empty() ? 0 : window_.front().offset);
+    return false;
+  }
+
+  has_failed_ = false;
+  for (auto &request : window_) {
+    if (!request.failed) {
+      printf("[ZoneWriteSequencer] Write at %lu done past a rejected one\n",
+             request.offset);
+      return false;
+    }
+    if (!Submit(&request)) {
+      return false;
+    }
+    stats_.retries++;
+  }
+  return true;
+}
+
+void ZoneWriteSequencer::Retire() {
+  while (!window_.empty() && window_.front().done) {
+    window_.pop_front();
+  }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "histogram.h"
+#include "zbd_fs.h"
+
+// Keep several writes to one zone in flight without relying on the zone
+// write locking of mq-deadline. Writes are reserved at the host-side write
+// pointer and submitted in offset order from a single io context, so with
+// the none scheduler they normally reach the device in that order too. If
+// the block layer still reorders them, the device rejects every write that
+// does not land on its write pointer; the sequencer then waits for the
+// in-flight writes, asks the device where the zone ends and resubmits the
+// rejected writes from there, again in offset order.
+//
+// The caller owns (has acquired) the zone and keeps the buffers passed to
+// Write() unchanged until Flush() returns.
+class ZoneWriteSequencer {
+public:
+  struct Stats {
+    uint64_t writes = 0;   // writes that completed successfully
+    uint64_t bytes = 0;
+    uint64_t retries = 0;  // writes resubmitted after a rejection
+    uint64_t recoveries = 0;  // times the write pointer had to be reported
+
+    void Merge(const Stats &other);
+    std::string ToString() const;
+  };
+
+  // `stats`, if given, receives the latency and throughput of every write,
+  // from its first submission until it succeeded
+  ZoneWriteSequencer(ZonedBlockDevice *zbd, uint32_t depth,
+                     Statistics *stats = nullptr);
+
+  // Set up the I/O queue
+  bool Init();
+
+  // Continue writing at the host-side write pointer of `zone`. Earlier
+  // writes are flushed first
+  bool Open(Zone *zone);
+
+  // Reserve `size` bytes at the write pointer and submit them, waiting for
+  // a completion first if `depth` writes are in flight. Return false on an
+  // unrecoverable I/O error or if the zone cannot fit the data
+  bool Write(const char *buf, uint32_t size);
+
+  // Wait until every submitted write is on the device
+  bool Flush();
+
+  uint32_t InFlight() const { return queue_.InFlight(); }
+  const Stats &GetStats() const { return stats_; }
+
+  // See AsyncIOQueue::SetPhaseStats()
+  void SetPhaseStats(Statistics *stats) { queue_.SetPhaseStats(stats); }
+
+private:
+  using TimePoint = std::chrono::steady_clock::time_point;
+
+  struct Request {
+    const char *buf;
+    uint32_t size;
+    uint64_t offset;
+    TimePoint start;
+    bool done = false;
+    bool failed = false;
+  };
+
+  bool Submit(Request *request);
+  // Reap at least one completion. Once a write failed, drain the queue and
+  // resubmit the rejected writes
+  bool WaitOne();
+  bool Recover();
+  // Drop finished writes from the head of the window
+  void Retire();
+
+  ZonedBlockDevice *zbd_;
+  Zone *zone_ = nullptr;
+  Statistics *write_stats_;
+  AsyncIOQueue queue_;
+  std::vector<io_event> events_;
+
+  // Submitted writes in offset order, the oldest first
+  std::deque<Request> window_;
+  bool has_failed_ = false;
+  uint32_t recoveries_in_row_ = 0;
+  Stats stats_;
+};
@@ -0,0 +1,237 @@
+#include "zone_stats.h"
+
+#include <algorithm>
+#include <functional>
+
+#include "json_writer.h"
+
+ZoneStats::Counters
+ZoneStats::Counters::Since(const Counters &earlier) const {
+  Counters delta;
+  delta.write_bytes = write_bytes - earlier.write_bytes;
+  delta.read_bytes = read_bytes - earlier.read_bytes;
+  delta.writes = writes - earlier.writes;
+  delta.reads = reads - earlier.reads;
+  delta.resets = resets - earlier.resets;
+  delta.finishes = finishes - earlier.finishes;
+  for (int b = 0; b < kBuckets; ++b) {
+    delta.write_latency[b] = write_latency[b] - earlier.write_latency[b];
+    delta.read_latency[b] = read_latency[b] - earlier.read_latency[b];
+  }
+  return delta;
+}
+
+double ZoneStats::Percentile(const uint32_t *buckets, double p) {
+  uint64_t total = 0;
+  for (int b = 0; b < kBuckets; ++b) {
+    total += buckets[b];
+  }
+  if (total == 0) {
+    return 0;
+  }
+  double threshold = total * (p / 100.0);
+  uint64_t sum = 0;
+  for (int b = 0; b < kBuckets; ++b) {
+    sum += buckets[b];
+    if (sum >= threshold) {
+      return 1ULL << std::min(b, kBuckets - 2);
+    }
+  }
+  return 1ULL << (kBuckets - 2);
+}
+
+ZoneStats::ZoneStats(uint32_t nr_zones)
+    : nr_zones_(nr_zones), entries_(new Entry[nr_zones]) {}
+
+int ZoneStats::Bucket(uint64_t micros) {
+  if (micros == 0) {
+    return 0;
+  }
+  int b = 64 - __builtin_clzll(micros);
+  return std::min(b, kBuckets - 1);
+}
+
+void ZoneStats::AddWrite(uint64_t zone_nr, uint64_t bytes, uint64_t micros) {
+  auto entry = At(zone_nr);
+  if (!entry) {
+    return;
+  }
+  entry->write_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  entry->writes.fetch_add(1, std::memory_order_relaxed);
+  entry->write_latency[Bucket(micros)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void ZoneStats::AddWriteBytes(uint64_t zone_nr, uint64_t bytes) {
+  auto entry = At(zone_nr);
+  if (!entry) {
+    return;
+  }
+  entry->write_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  entry->writes.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ZoneStats::AddRead(uint64_t zone_nr, uint64_t bytes, uint64_t micros) {
+  auto entry = At(zone_nr);
+  if (!entry) {
+    return;
+  }
+  entry->read_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  entry->reads.fetch_add(1, std::memory_order_relaxed);
+  entry->read_latency[Bucket(micros)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void ZoneStats::AddReset(uint64_t zone_nr) {
+  if (auto entry = At(zone_nr)) {
+    entry->resets.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void ZoneStats::AddFinish(uint64_t zone_nr) {
+  if (auto entry = At(zone_nr)) {
+    entry->finishes.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+std::vector<ZoneStats::Counters> ZoneStats::Snapshot() const {
+  std::vector<Counters> snapshot(nr_zones_);
+  for (uint32_t i = 0; i < nr_zones_; ++i) {
+    auto &entry = entries_[i];
+    auto &counters = snapshot[i];
+    counters.write_bytes = entry.write_bytes.load(std::memory_order_relaxed);
+    counters.read_bytes = entry.read_bytes.load(std::memory_order_relaxed);
+    counters.writes = entry.writes.load(std::memory_order_relaxed);
+    counters.reads = entry.reads.load(std::memory_order_relaxed);
+    counters.resets = entry.resets.load(std::memory_order_relaxed);
+    counters.finishes = entry.finishes.load(std::memory_order_relaxed);
+    for (int b = 0; b < kBuckets; ++b) {
+      counters.write_latency[b] =
+          entry.write_latency[b].load(std::memory_order_relaxed);
+      counters.read_latency[b] =
+          entry.read_latency[b].load(std::memory_order_relaxed);
+    }
+  }
+  return snapshot;
+}
+
+namespace {
+bool Idle(const ZoneStats::Counters &c) {
+  return c.writes == 0 && c.reads == 0 && c.resets == 0 && c.finishes == 0;
+}
+
+// Every exported metric of a zone, in column order
+struct Metric {
+  const char *name;
+  std::function<double(const ZoneStats::Counters &)> value;
+  bool integral = true;
+};
+
+const std::vector<Metric> &Metrics() {
+  using C = ZoneStats::Counters;
+  static const std::vector<Metric> metrics = {
+      {"write_bytes", [](const C &c) { return (double)c.write_bytes; }},
+      {"read_bytes", [](const C &c) { return (double)c.read_bytes; }},
+      {"writes", [](const C &c) { return (double)c.writes; }},
+      {"reads", [](const C &c) { return (double)c.reads; }},
+      {"resets", [](const C &c) { return (double)c.resets; }},
+      {"finishes", [](const C &c) { return (double)c.finishes; }},
+      {"write_p50_us",
+       [](const C &c) { return ZoneStats::Percentile(c.write_latency, 50); },
+       false},
+      {"write_p99_us",
+       [](const C &c) { return ZoneStats::Percentile(c.write_latency, 99); },
+       false},
+      {"read_p50_us",
+       [](const C &c) { return ZoneStats::Percentile(c.read_latency, 50); },
+       false},
+      {"read_p99_us",
+       [](const C &c) { return ZoneStats::Percentile(c.read_latency, 99); },
+       false},
+  };
+  return metrics;
+}
+
+void WriteValue(JsonWriter *writer, const Metric &metric,
+                const ZoneStats::Counters &zone) {
+  if (metric.integral) {
+    writer->Uint(metric.value(zone));
+  } else {
+    writer->Double(metric.value(zone));
+  }
+}
+} // namespace
+
+void ZoneStats::WriteCsv(std::ostream &out, const Export &data) {
+  out << "interval,us,zone";
+  for (auto &metric : Metrics()) {
+    out << "," << metric.name;
+  }
+  out << "\n";
+
+  auto rows = [&](const std::string &interval, uint64_t us,
+                  const std::vector<Counters> &zones, bool skip_idle) {
+    for (size_t zone = 0; zone < zones.size(); ++zone) {
+      // Intervals only list the zones that saw any I/O
+      if (skip_idle && Idle(zones[zone])) {
+        continue;
+      }
+      out << interval << "," << us << "," << zone;
+      for (auto &metric : Metrics()) {
+        auto value = metric.value(zones[zone]);
+        if (metric.integral) {
+          out << "," << (uint64_t)value;
+        } else {
+          out << "," << value;
+        }
+      }
+      out << "\n";
+    }
+  };
+  rows("total", data.run_micros, data.total, false);
+  for (size_t i = 0; i < data.intervals.size(); ++i) {
+    rows(std::to_string(i), data.interval_micros[i], data.intervals[i], true);
+  }
+}
+
+void ZoneStats::WriteJson(std::ostream &out, const Export &data) {
+  JsonWriter writer(out);
+  writer.BeginObject();
+  writer.Field("zones", (uint64_t)data.total.size());
+  writer.Field("run_us", data.run_micros);
+  writer.Key("interval_us");
+  writer.BeginArray();
+  for (auto us : data.interval_micros) {
+    writer.Uint(us);
+  }
+  writer.EndArray();
+
+  // {metric: [zone]} for the total, {metric: [interval][zone]} per interval
+  writer.Key("total");
+  writer.BeginObject();
+  for (auto &metric : Metrics()) {
+    writer.Key(metric.name);
+    writer.BeginArray();
+    for (auto &zone : data.total) {
+      WriteValue(&writer, metric, zone);
+    }
+    writer.EndArray();
+  }
+  writer.EndObject();
+
+  writer.Key("intervals");
+  writer.BeginObject();
+  for (auto &metric : Metrics()) {
+    writer.Key(metric.name);
+    writer.BeginArray();
+    for (auto &zones : data.intervals) {
+      writer.BeginArray();
+      for (auto &zone : zones) {
+        WriteValue(&writer, metric, zone);
+      }
+      writer.EndArray();
+    }
+    writer.EndArray();
+  }
+  writer.EndObject();
+  writer.EndObject();
+  out << "\n";
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "zbd_fs.h"
+
+// Per-zone counters, one cache line aligned entry per zone of the device
+// indexed by Zone::GetZoneNr(). An entry is mostly updated by the thread
+// that owns the zone, with relaxed atomic adds, so keeping them costs about
+// as much as the global statistics. Latencies go to small log2 histograms
+// that are enough to tell a slow zone from the rest.
+class ZoneStats {
+public:
+  // Bucket 0 holds latencies below 1us, bucket b in [1, kBuckets - 1)
+  // holds [2^(b-1), 2^b) us and the last one everything slower (>= 16ms)
+  static constexpr int kBuckets = 16;
+
+  // A plain copy of the counters of one zone
+  struct Counters {
+    uint64_t write_bytes = 0;
+    uint64_t read_bytes = 0;
+    uint64_t writes = 0;
+    uint64_t reads = 0;
+    uint64_t resets = 0;
+    uint64_t finishes = 0;
+    uint32_t write_latency[kBuckets] = {};
+    uint32_t read_latency[kBuckets] = {};
+
+    // What happened between `earlier` and this
+    Counters Since(const Counters &earlier) const;
+  };
+
+  // Upper bound of the bucket the p-th percentile falls in, 0 if empty
+  static double Percentile(const uint32_t *buckets, double p);
+
+  explicit ZoneStats(uint32_t nr_zones);
+
+  void AddWrite(uint64_t zone_nr, uint64_t bytes, uint64_t micros);
+  // Bytes reserved for an async write, whose latency the zone never sees
+  void AddWriteBytes(uint64_t zone_nr, uint64_t bytes);
+  void AddRead(uint64_t zone_nr, uint64_t bytes, uint64_t micros);
+  void AddReset(uint64_t zone_nr);
+  void AddFinish(uint64_t zone_nr);
+
+  uint32_t NrZones() const { return nr_zones_; }
+  std::vector<Counters> Snapshot() const;
+
+  // The counters of every zone over a whole run and over each of its
+  // report intervals
+  struct Export {
+    std::vector<Counters> total;
+    uint64_t run_micros = 0;
+    std::vector<std::vector<Counters>> intervals;
+    std::vector<uint64_t> interval_micros;
+  };
+
+  // One row per zone for the total, then one per interval and zone that
+  // saw any I/O in it
+  static void WriteCsv(std::ostream &out, const Export &data);
+  // Every metric as a [zone] array for the total and an [interval][zone]
+  // matrix, ready for a heatmap
+  static void WriteJson(std::ostream &out, const Export &data);
+
+private:
+  struct alignas(kCacheLineSize) Entry {
+    std::atomic<uint64_t> write_bytes{0};
+    std::atomic<uint64_t> read_bytes{0};
+    std::atomic<uint64_t> writes{0};
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint32_t> resets{0};
+    std::atomic<uint32_t> finishes{0};
+    std::atomic<uint32_t> write_latency[kBuckets] = {};
+    std::atomic<uint32_t> read_latency[kBuckets] = {};
+  };
+
+  static int Bucket(uint64_t micros);
+  Entry *At(uint64_t zone_nr) {
+    return zone_nr < nr_zones_ ? &entries_[zone_nr] : nullptr;
+  }
+
+  uint32_t nr_zones_;
+  std::unique_ptr<Entry[]> entries_;
+};